@@ -0,0 +1,371 @@
+/*
+ * anon-aes-bs.c --
+ *
+ * Constant-time bitsliced AES-128 encryption for CPUs without AES
+ * instructions. Up to 64 blocks are encrypted in parallel. The state
+ * is kept in 128 64-bit words, where bit i of word 8*b+k holds bit k
+ * of byte b of block i. SubBytes is evaluated as a boolean circuit
+ * (Boyar and Peralta), ShiftRows is a renaming of words and
+ * MixColumns and AddRoundKey are plain XORs. There are no table
+ * lookups or branches that depend on the key or the data.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <string.h>
+
+#include "anon-aes.h"
+
+#define LANES 64
+
+/*
+ * The AES S-box applied to the eight bit planes q[0] (least
+ * significant bit) to q[7] (most significant bit) of 64 bytes.
+ */
+
+static inline void
+sbox(uint64_t *q)
+{
+    uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint64_t y20, y21;
+    uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+    x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+    /* top linear transformation */
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    /* non-linear section (inversion in GF(2^8)) */
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    /* bottom linear transformation */
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+/*
+ * Transpose the 64x64 bit matrix m in place, i.e., afterwards bit i
+ * of m[j] is what used to be bit j of m[i].
+ */
+
+static void
+transpose(uint64_t *m)
+{
+    static const uint64_t masks[6] = {
+	0x00000000ffffffffULL, 0x0000ffff0000ffffULL, 0x00ff00ff00ff00ffULL,
+	0x0f0f0f0f0f0f0f0fULL, 0x3333333333333333ULL, 0x5555555555555555ULL
+    };
+    uint64_t t;
+    int i, j, k, l;
+
+    for (i = 0, j = 32; j; i++, j >>= 1) {
+	for (k = 0; k < 64; k += 2*j) {
+	    for (l = k; l < k + j; l++) {
+		t = ((m[l] >> j) ^ m[l + j]) & masks[i];
+		m[l] ^= t << j;
+		m[l + j] ^= t;
+	    }
+	}
+    }
+}
+
+static inline uint64_t
+load64(const uint8_t *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8
+	| (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24
+	| (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40
+	| (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static inline void
+store64(uint8_t *p, const uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	p[i] = (uint8_t) (v >> (8*i));
+    }
+}
+
+static inline void
+add_round_key(uint64_t *s, const uint64_t *rk)
+{
+    int w;
+
+    for (w = 0; w < 128; w++) {
+	s[w] ^= rk[w];
+    }
+}
+
+/*
+ * ShiftRows followed by MixColumns (unless last is set), reading
+ * the state s and writing the state t. Byte r + 4*c of the state is
+ * row r of column c.
+ */
+
+static inline void
+shift_mix(const uint64_t *s, uint64_t *t, const int last)
+{
+    const uint64_t *a0, *a1, *a2, *a3;
+    uint64_t y[8];
+    int c, r, k;
+
+    for (c = 0; c < 4; c++) {
+	if (last) {
+	    for (r = 0; r < 4; r++) {
+		memcpy(t + 8*(r + 4*c), s + 8*(r + 4*((c + r) & 3)),
+		       8 * sizeof(uint64_t));
+	    }
+	    continue;
+	}
+	for (r = 0; r < 4; r++) {
+	    a0 = s + 8*(((r + 0) & 3) + 4*((c + r + 0) & 3));
+	    a1 = s + 8*(((r + 1) & 3) + 4*((c + r + 1) & 3));
+	    a2 = s + 8*(((r + 2) & 3) + 4*((c + r + 2) & 3));
+	    a3 = s + 8*(((r + 3) & 3) + 4*((c + r + 3) & 3));
+	    for (k = 0; k < 8; k++) {
+		y[k] = a0[k] ^ a1[k];
+	    }
+	    /* 2*a0 ^ 3*a1 ^ a2 ^ a3 = xtime(a0 ^ a1) ^ a1 ^ a2 ^ a3 */
+	    t[8*(r + 4*c) + 0] = y[7] ^ a1[0] ^ a2[0] ^ a3[0];
+	    t[8*(r + 4*c) + 1] = y[0] ^ y[7] ^ a1[1] ^ a2[1] ^ a3[1];
+	    t[8*(r + 4*c) + 2] = y[1] ^ a1[2] ^ a2[2] ^ a3[2];
+	    t[8*(r + 4*c) + 3] = y[2] ^ y[7] ^ a1[3] ^ a2[3] ^ a3[3];
+	    t[8*(r + 4*c) + 4] = y[3] ^ y[7] ^ a1[4] ^ a2[4] ^ a3[4];
+	    t[8*(r + 4*c) + 5] = y[4] ^ a1[5] ^ a2[5] ^ a3[5];
+	    t[8*(r + 4*c) + 6] = y[5] ^ a1[6] ^ a2[6] ^ a3[6];
+	    t[8*(r + 4*c) + 7] = y[6] ^ a1[7] ^ a2[7] ^ a3[7];
+	}
+    }
+}
+
+/*
+ * The S-box of a single byte, using the circuit so that the key
+ * schedule does not leak the key through table lookups either.
+ */
+
+static uint8_t
+sub_byte(const uint8_t v)
+{
+    uint64_t q[8];
+    uint8_t r = 0;
+    int k;
+
+    for (k = 0; k < 8; k++) {
+	q[k] = (v >> k) & 1;
+    }
+    sbox(q);
+    for (k = 0; k < 8; k++) {
+	r |= (uint8_t) ((q[k] & 1) << k);
+    }
+    return r;
+}
+
+/*
+ * Expand the 128-bit key into the 11 round keys (FIPS-197 layout).
+ */
+
+void
+anon_aes_bs_set_key(anon_aes_t *aes, const uint8_t *key)
+{
+    static const uint8_t rcon[10] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+    };
+    const uint8_t *p;
+    uint8_t *k;
+    int r, i;
+
+    memcpy(aes->rk[0], key, AES_BLOCK);
+    for (r = 1; r < 11; r++) {
+	p = aes->rk[r-1];
+	k = aes->rk[r];
+	k[0] = p[0] ^ sub_byte(p[13]) ^ rcon[r-1];
+	k[1] = p[1] ^ sub_byte(p[14]);
+	k[2] = p[2] ^ sub_byte(p[15]);
+	k[3] = p[3] ^ sub_byte(p[12]);
+	for (i = 4; i < AES_BLOCK; i++) {
+	    k[i] = p[i] ^ k[i-4];
+	}
+    }
+}
+
+/*
+ * Encrypt n consecutive 16 byte blocks in ECB mode, 64 at a time.
+ */
+
+void
+anon_aes_bs_encrypt(anon_aes_t *aes, const uint8_t *in, uint8_t *out,
+		    size_t n)
+{
+    uint64_t s[128], t[128], rk[11][128];
+    size_t i, m;
+    int r, b, w;
+
+    /* round key bits spread to all lanes */
+    for (r = 0; r < 11; r++) {
+	for (w = 0; w < 128; w++) {
+	    rk[r][w] = -(uint64_t) ((aes->rk[r][w >> 3] >> (w & 7)) & 1);
+	}
+    }
+
+    for (; n > 0; n -= m, in += m*AES_BLOCK, out += m*AES_BLOCK) {
+	m = n < LANES ? n : LANES;
+	memset(s, 0, sizeof(s));
+	for (i = 0; i < m; i++) {
+	    s[i] = load64(in + i*AES_BLOCK);
+	    s[LANES + i] = load64(in + i*AES_BLOCK + 8);
+	}
+	transpose(s);
+	transpose(s + LANES);
+
+	add_round_key(s, rk[0]);
+	for (r = 1; r < 11; r += 2) {
+	    for (b = 0; b < AES_BLOCK; b++) {
+		sbox(s + 8*b);
+	    }
+	    shift_mix(s, t, 0);
+	    add_round_key(t, rk[r]);
+	    for (b = 0; b < AES_BLOCK; b++) {
+		sbox(t + 8*b);
+	    }
+	    shift_mix(t, s, r + 1 == 10);
+	    add_round_key(s, rk[r + 1]);
+	}
+
+	transpose(s);
+	transpose(s + LANES);
+	for (i = 0; i < m; i++) {
+	    store64(out + i*AES_BLOCK, s[i]);
+	    store64(out + i*AES_BLOCK + 8, s[LANES + i]);
+	}
+    }
+}
@@ -0,0 +1,404 @@
+/*
+ * anon-aes.c --
+ *
+ * AES-128 (Rijndael) encryption of many independent blocks. The
+ * prefix-preserving anonymization functions use AES only as a
+ * pseudorandom function and all the blocks for one or more addresses
+ * are known up front, so they can be pushed through the cipher in
+ * one go. Several backends produce identical output: AES-NI, VAES-256
+ * and VAES-512 kernels, the OpenSSL EVP interface and a constant-time
+ * bitsliced implementation (anon-aes-bs.c). The best backend the CPU
+ * supports is picked at runtime using cpuid; the environment variable
+ * LIBANON_PRF can be used to pick a backend by name.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <openssl/evp.h>
+
+#if defined(HAVE_AESNI_INTRINSICS)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "anon-aes.h"
+
+#define CPU_AESNI	0x01
+#define CPU_VAES256	0x02
+#define CPU_VAES512	0x04
+
+struct backend {
+    const char *name;
+    unsigned int cpu;		/* required CPU features */
+    int evp;			/* needs an EVP cipher context */
+    void (*set_key)(anon_aes_t *aes, const uint8_t *key);
+    void (*encrypt)(anon_aes_t *aes, const uint8_t *in,
+		    uint8_t *out, size_t n);
+};
+
+static const struct backend *backend = NULL;
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+
+/*
+ * OpenSSL EVP backend, which is still much better than calling
+ * AES_ecb_encrypt() once per block. OpenSSL picks its own code path
+ * (e.g., vector permutation AES on CPUs with SSSE3). A cipher context
+ * must not be used by several threads at once, so its calls are
+ * serialized; the other backends only read the round keys.
+ */
+
+static void
+evp_set_key(anon_aes_t *aes, const uint8_t *key)
+{
+    (void) EVP_EncryptInit_ex(aes->evp, NULL, NULL, key, NULL);
+}
+
+static void
+evp_encrypt(anon_aes_t *aes, const uint8_t *in, uint8_t *out, size_t n)
+{
+    int len;
+
+    pthread_mutex_lock(&aes->lock);
+    (void) EVP_EncryptUpdate(aes->evp, out, &len, in, (int) n * AES_BLOCK);
+    pthread_mutex_unlock(&aes->lock);
+}
+
+#if defined(HAVE_AESNI_INTRINSICS)
+
+#define AESNI	__attribute__((target("aes,sse2")))
+
+static inline AESNI __m128i
+expand_step(__m128i key, __m128i kg)
+{
+    kg = _mm_shuffle_epi32(kg, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, kg);
+}
+
+#define EXPAND(i, rcon) \
+    k = expand_step(k, _mm_aeskeygenassist_si128(k, rcon)); \
+    _mm_storeu_si128((__m128i *) aes->rk[i], k)
+
+static AESNI void
+aesni_set_key(anon_aes_t *aes, const uint8_t *key)
+{
+    __m128i k = _mm_loadu_si128((const __m128i *) key);
+
+    _mm_storeu_si128((__m128i *) aes->rk[0], k);
+    EXPAND(1, 0x01); EXPAND(2, 0x02); EXPAND(3, 0x04); EXPAND(4, 0x08);
+    EXPAND(5, 0x10); EXPAND(6, 0x20); EXPAND(7, 0x40); EXPAND(8, 0x80);
+    EXPAND(9, 0x1b); EXPAND(10, 0x36);
+}
+
+#undef EXPAND
+
+/*
+ * The kernels below interleave eight registers so that the latency
+ * of the AES round instructions is hidden behind the other seven
+ * registers. The rounds are spelled out (instead of looping over an
+ * array of registers) so that the blocks stay in registers even
+ * without aggressive loop unrolling.
+ */
+
+#define ROUND8(op, k) \
+    b0 = op(b0, k); b1 = op(b1, k); b2 = op(b2, k); b3 = op(b3, k); \
+    b4 = op(b4, k); b5 = op(b5, k); b6 = op(b6, k); b7 = op(b7, k)
+
+#define LOAD8(load, xor, p, w) \
+    b0 = xor(load(p, 0), rk[0]); b1 = xor(load(p, w), rk[0]); \
+    b2 = xor(load(p, 2*w), rk[0]); b3 = xor(load(p, 3*w), rk[0]); \
+    b4 = xor(load(p, 4*w), rk[0]); b5 = xor(load(p, 5*w), rk[0]); \
+    b6 = xor(load(p, 6*w), rk[0]); b7 = xor(load(p, 7*w), rk[0])
+
+#define STORE8(store, p, w) \
+    store(p, 0, b0); store(p, w, b1); store(p, 2*w, b2); \
+    store(p, 3*w, b3); store(p, 4*w, b4); store(p, 5*w, b5); \
+    store(p, 6*w, b6); store(p, 7*w, b7)
+
+/*
+ * AES-NI kernel: eight blocks in flight.
+ */
+
+#define LOAD128(p, o)		_mm_loadu_si128((const __m128i *) ((p) + (o)))
+#define STORE128(p, o, b)	_mm_storeu_si128((__m128i *) ((p) + (o)), b)
+
+static AESNI void
+aesni_encrypt(anon_aes_t *aes, const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m128i rk[11], b0, b1, b2, b3, b4, b5, b6, b7;
+    int r;
+
+    for (r = 0; r < 11; r++) {
+	rk[r] = LOAD128(aes->rk[r], 0);
+    }
+
+    for (; n >= 8; n -= 8, in += 8*AES_BLOCK, out += 8*AES_BLOCK) {
+	LOAD8(LOAD128, _mm_xor_si128, in, AES_BLOCK);
+	for (r = 1; r < 10; r++) {
+	    ROUND8(_mm_aesenc_si128, rk[r]);
+	}
+	ROUND8(_mm_aesenclast_si128, rk[10]);
+	STORE8(STORE128, out, AES_BLOCK);
+    }
+
+    for (; n > 0; n--, in += AES_BLOCK, out += AES_BLOCK) {
+	b0 = _mm_xor_si128(LOAD128(in, 0), rk[0]);
+	for (r = 1; r < 10; r++) {
+	    b0 = _mm_aesenc_si128(b0, rk[r]);
+	}
+	b0 = _mm_aesenclast_si128(b0, rk[10]);
+	STORE128(out, 0, b0);
+    }
+}
+
+#if defined(HAVE_VAES_INTRINSICS)
+
+/*
+ * VAES-256 kernel: two blocks per ymm register, sixteen blocks in
+ * flight. The tail is handled by the AES-NI kernel.
+ */
+
+#define LOAD256(p, o)		_mm256_loadu_si256((const __m256i *) ((p) + (o)))
+#define STORE256(p, o, b)	_mm256_storeu_si256((__m256i *) ((p) + (o)), b)
+
+static __attribute__((target("vaes,avx2"))) void
+vaes256_encrypt(anon_aes_t *aes, const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m256i rk[11], b0, b1, b2, b3, b4, b5, b6, b7;
+    int r;
+
+    for (r = 0; r < 11; r++) {
+	rk[r] = _mm256_broadcastsi128_si256(LOAD128(aes->rk[r], 0));
+    }
+
+    for (; n >= 16; n -= 16, in += 16*AES_BLOCK, out += 16*AES_BLOCK) {
+	LOAD8(LOAD256, _mm256_xor_si256, in, 2*AES_BLOCK);
+	for (r = 1; r < 10; r++) {
+	    ROUND8(_mm256_aesenc_epi128, rk[r]);
+	}
+	ROUND8(_mm256_aesenclast_epi128, rk[10]);
+	STORE8(STORE256, out, 2*AES_BLOCK);
+    }
+
+    if (n) {
+	aesni_encrypt(aes, in, out, n);
+    }
+}
+
+/*
+ * VAES-512 kernel: four blocks per zmm register, thirty-two blocks
+ * in flight. The tail is handled by the AES-NI kernel.
+ */
+
+#define LOAD512(p, o)		_mm512_loadu_si512((const void *) ((p) + (o)))
+#define STORE512(p, o, b)	_mm512_storeu_si512((void *) ((p) + (o)), b)
+
+static __attribute__((target("vaes,avx512f"))) void
+vaes512_encrypt(anon_aes_t *aes, const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m512i rk[11], b0, b1, b2, b3, b4, b5, b6, b7;
+    int r;
+
+    for (r = 0; r < 11; r++) {
+	rk[r] = _mm512_broadcast_i32x4(LOAD128(aes->rk[r], 0));
+    }
+
+    for (; n >= 32; n -= 32, in += 32*AES_BLOCK, out += 32*AES_BLOCK) {
+	LOAD8(LOAD512, _mm512_xor_si512, in, 4*AES_BLOCK);
+	for (r = 1; r < 10; r++) {
+	    ROUND8(_mm512_aesenc_epi128, rk[r]);
+	}
+	ROUND8(_mm512_aesenclast_epi128, rk[10]);
+	STORE8(STORE512, out, 4*AES_BLOCK);
+    }
+
+    if (n >= 16) {
+	vaes256_encrypt(aes, in, out, n);
+    } else if (n) {
+	aesni_encrypt(aes, in, out, n);
+    }
+}
+
+#endif /* HAVE_VAES_INTRINSICS */
+
+/*
+ * Read the extended control register to find out whether the
+ * operating system saves the ymm (and zmm) register state.
+ */
+
+static uint64_t
+xgetbv0(void)
+{
+    uint32_t eax, edx;
+
+    __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((uint64_t) edx << 32) | eax;
+}
+
+#endif /* HAVE_AESNI_INTRINSICS */
+
+/*
+ * Find out which AES instructions the CPU and the operating system
+ * support.
+ */
+
+static unsigned int
+cpu_features(void)
+{
+    unsigned int features = 0;
+#if defined(HAVE_AESNI_INTRINSICS)
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int ebx7 = 0, ecx7 = 0;
+    uint64_t xcr0 = 0;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES)) {
+	features |= CPU_AESNI;
+	if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+	    xcr0 = xgetbv0();
+	}
+	if (__get_cpuid_max(0, NULL) >= 7) {
+	    __cpuid_count(7, 0, eax, ebx7, ecx7, edx);
+	}
+	if ((ecx7 & (1 << 9)) && (ebx7 & (1 << 5))
+	    && (xcr0 & 0x06) == 0x06) {
+	    features |= CPU_VAES256;
+	}
+	if ((ecx7 & (1 << 9)) && (ebx7 & (1 << 16))
+	    && (xcr0 & 0xe6) == 0xe6) {
+	    features |= CPU_VAES512;
+	}
+    }
+#endif
+    return features;
+}
+
+/*
+ * The backends in order of preference. The bitsliced backend is
+ * slower than OpenSSL's own constant-time code on most CPUs without
+ * AES instructions, but it never falls back to lookup tables.
+ */
+
+static const struct backend backends[] = {
+#if defined(HAVE_VAES_INTRINSICS)
+    { "vaes512", CPU_AESNI | CPU_VAES512, 0, aesni_set_key, vaes512_encrypt },
+    { "vaes256", CPU_AESNI | CPU_VAES256, 0, aesni_set_key, vaes256_encrypt },
+#endif
+#if defined(HAVE_AESNI_INTRINSICS)
+    { "aesni", CPU_AESNI, 0, aesni_set_key, aesni_encrypt },
+#endif
+    { "openssl", 0, 1, evp_set_key, evp_encrypt },
+    { "bitslice", 0, 0, anon_aes_bs_set_key, anon_aes_bs_encrypt },
+    { NULL, 0, 0, NULL, NULL }
+};
+
+/*
+ * Pick the backend named by LIBANON_PRF if the CPU supports it and
+ * the best supported backend otherwise. Run once through
+ * pthread_once(), so that concurrent first calls wait for the choice
+ * and see it; every context is initialized after it.
+ */
+
+static void
+select_backend(void)
+{
+    const struct backend *b, *best = NULL;
+    const char *name = getenv("LIBANON_PRF");
+    unsigned int features = cpu_features();
+
+    for (b = backends; b->name; b++) {
+	if ((b->cpu & features) != b->cpu) {
+	    continue;
+	}
+	if (! best) {
+	    best = b;
+	}
+	if (name && strcmp(name, b->name) == 0) {
+	    best = b;
+	    break;
+	}
+    }
+    backend = best;
+}
+
+/*
+ * Initialize an AES context with an all zero key.
+ */
+
+int
+anon_aes_init(anon_aes_t *aes)
+{
+    static const uint8_t zero[AES_BLOCK];
+
+    assert(aes);
+
+    pthread_once(&backend_once, select_backend);
+    memset(aes, 0, sizeof(anon_aes_t));
+    if (backend->evp) {
+	aes->evp = EVP_CIPHER_CTX_new();
+	if (! aes->evp) {
+	    return -1;
+	}
+	/* the lock exists exactly as long as the context */
+	pthread_mutex_init(&aes->lock, NULL);
+	if (! EVP_EncryptInit_ex(aes->evp, EVP_aes_128_ecb(), NULL,
+				 zero, NULL)) {
+	    anon_aes_cleanup(aes);
+	    return -1;
+	}
+	EVP_CIPHER_CTX_set_padding(aes->evp, 0);
+    }
+    anon_aes_set_key(aes, zero);
+    return 0;
+}
+
+/*
+ * Set the 128-bit AES key.
+ */
+
+void
+anon_aes_set_key(anon_aes_t *aes, const uint8_t *key)
+{
+    assert(aes && key);
+
+    backend->set_key(aes, key);
+}
+
+/*
+ * Encrypt n consecutive 16 byte blocks in ECB mode.
+ */
+
+void
+anon_aes_encrypt(anon_aes_t *aes, const uint8_t *in, uint8_t *out, size_t n)
+{
+    backend->encrypt(aes, in, out, n);
+}
+
+void
+anon_aes_cleanup(anon_aes_t *aes)
+{
+    if (aes && aes->evp) {
+	EVP_CIPHER_CTX_free(aes->evp);
+	pthread_mutex_destroy(&aes->lock);
+	aes->evp = NULL;
+    }
+}
+
+/*
+ * Name of the backend selected for this CPU (for diagnostics).
+ */
+
+const char*
+anon_aes_backend(void)
+{
+    pthread_once(&backend_once, select_backend);
+    return backend->name;
+}
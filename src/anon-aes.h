@@ -0,0 +1,39 @@
+/*
+ * anon-aes.h --
+ *
+ * Internal AES-128 (Rijndael) multi-block encryption interface used
+ * as the pseudorandom function of the prefix-preserving anonymization
+ * functions. Not installed and not part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_AES_H_
+#define _ANON_AES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#define AES_BLOCK 16
+
+typedef struct _anon_aes {
+    uint8_t rk[11][AES_BLOCK];	/* expanded round keys */
+    EVP_CIPHER_CTX *evp;	/* used by the OpenSSL backend */
+    pthread_mutex_t lock;	/* serializes the use of evp */
+} anon_aes_t;
+
+int		anon_aes_init(anon_aes_t *aes);
+void		anon_aes_set_key(anon_aes_t *aes, const uint8_t *key);
+void		anon_aes_encrypt(anon_aes_t *aes, const uint8_t *in,
+				 uint8_t *out, size_t n);
+void		anon_aes_cleanup(anon_aes_t *aes);
+const char*	anon_aes_backend(void);
+
+/* constant-time bitsliced backend (anon-aes-bs.c) */
+void		anon_aes_bs_set_key(anon_aes_t *aes, const uint8_t *key);
+void		anon_aes_bs_encrypt(anon_aes_t *aes, const uint8_t *in,
+				    uint8_t *out, size_t n);
+
+#endif /* _ANON_AES_H_ */
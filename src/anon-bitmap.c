@@ -0,0 +1,174 @@
+/*
+ * anon-bitmap.c --
+ *
+ * Used IPv4 prefixes as bitmaps over the complete binary tree of all
+ * prefixes. The prefixes are numbered in heap order: the root is 1
+ * and the children of j are 2j and 2j+1, so that a prefix v of length
+ * d is node 2^d + v and the nodes of depth d are a bitmap of 2^d
+ * bits. One bitmap of 2^33 bits (1 GB) tells which nodes of the
+ * used_i tree exist, another of 2^32 bits (512 MB) which of the nodes
+ * above depth 32 are complete; a node at depth 32 is complete if it
+ * exists. Both are allocated up front, but only the pages that are
+ * touched take memory. Inserting sets bits with atomic operations
+ * only, so that several threads can insert at the same time.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "anon-bitmap.h"
+
+#define LENGTH		32
+
+struct _anon_bitmap {
+    uint64_t *exists;		/* nodes 1..2^33-1 */
+    uint64_t *complete;		/* nodes 1..2^32-1 */
+};
+
+#define TEST(b, j)	(((b)[(j) >> 6] >> ((j) & 63)) & 1)
+#define SET(b, j)	((b)[(j) >> 6] |= (uint64_t) 1 << ((j) & 63))
+
+/* atomic versions for inserting; ATOMIC_SET returns the old bit */
+#define ATOMIC_TEST(b, j) \
+	((__atomic_load_n(&(b)[(j) >> 6], __ATOMIC_RELAXED) >> ((j) & 63)) & 1)
+#define ATOMIC_SET(b, j) \
+	((__atomic_fetch_or(&(b)[(j) >> 6], (uint64_t) 1 << ((j) & 63), \
+			    __ATOMIC_RELAXED) >> ((j) & 63)) & 1)
+
+/* both children 2j and 2j+1 (an aligned pair) present? */
+#define BOTH(b, j)	((((b)[(2*(j)) >> 6] >> ((2*(j)) & 63)) & 3) == 3)
+
+#define BIT(addr, n)	(((addr) >> (LENGTH - 1 - (n))) & 1)
+
+anon_bitmap_t*
+anon_bitmap_new(void)
+{
+    anon_bitmap_t *t;
+
+    if (sizeof(size_t) < 8) {
+	return NULL;
+    }
+    t = (anon_bitmap_t *) malloc(sizeof(anon_bitmap_t));
+    if (! t) {
+	return NULL;
+    }
+    t->exists = (uint64_t *)
+	calloc((size_t) 1 << (LENGTH + 1 - 6), sizeof(uint64_t));
+    t->complete = (uint64_t *)
+	calloc((size_t) 1 << (LENGTH - 6), sizeof(uint64_t));
+    if (! t->exists || ! t->complete) {
+	anon_bitmap_delete(t);
+	return NULL;
+    }
+    SET(t->exists, 1);
+    return t;
+}
+
+/*
+ * Mark the prefix addr/prefixlen (host byte order) as used and add
+ * the number of nodes created to *nodes. Returns 1 if the prefix was
+ * not covered yet and 0 if it was. Concurrent calls (with a counter
+ * of their own) are safe; the bitmaps end up the same as if they had
+ * been made one after the other. Queries must wait until all of them
+ * are done.
+ */
+
+int
+anon_bitmap_insert(anon_bitmap_t *t, const uint32_t addr,
+		   const int prefixlen, unsigned *nodes)
+{
+    uint64_t j = 1;
+    int n, new = 0;
+
+    for (n = 0; n < prefixlen; n++) {
+	if (ATOMIC_TEST(t->complete, j)) {
+	    return 0;
+	}
+	j = 2*j + BIT(addr, n);
+	new = ! ATOMIC_SET(t->exists, j);
+	if (new) {
+	    (*nodes)++;
+	}
+    }
+    if (prefixlen == LENGTH) {
+	return new;
+    }
+    return ! ATOMIC_SET(t->complete, j);
+}
+
+/*
+ * Bit n (counted from the most significant bit) of the result is set
+ * if bit n of addr can be flipped, see canflip() in anon-ip.c.
+ */
+
+uint32_t
+anon_bitmap_canflip(anon_bitmap_t *t, const uint32_t addr)
+{
+    uint64_t j = 1;
+    uint32_t mask = 0;
+    int n;
+
+    for (n = 0; n < LENGTH; n++) {
+	if (TEST(t->complete, j)) {
+	    break;
+	}
+	if (! BOTH(t->exists, j)) {
+	    mask |= (uint32_t) 0x80000000 >> n;
+	}
+	j = 2*j + BIT(addr, n);
+	if (! TEST(t->exists, j)) {
+	    break;
+	}
+    }
+    return mask;
+}
+
+static void
+flatten(anon_bitmap_t *t, const uint64_t j, const int depth,
+	struct anon_step *s, size_t *n)
+{
+    struct anon_step *u = s + (*n)++;
+
+    u->depth = depth;
+    u->flags = (depth && (j & 1)) ? ANON_STEP_RIGHT : 0;
+    if (depth == LENGTH || TEST(t->complete, j)) {
+	u->flags |= ANON_STEP_COMPLETE;
+	return;
+    }
+    if (! BOTH(t->exists, j)) {
+	u->flags |= ANON_STEP_SINGLE;
+    }
+    if (TEST(t->exists, 2*j)) {
+	flatten(t, 2*j, depth + 1, s, n);
+    }
+    if (TEST(t->exists, 2*j + 1)) {
+	flatten(t, 2*j + 1, depth + 1, s, n);
+    }
+}
+
+/*
+ * Store the nodes in preorder in s, which must have room for all of
+ * them, and return their number.
+ */
+
+size_t
+anon_bitmap_flatten(anon_bitmap_t *t, struct anon_step *s)
+{
+    size_t n = 0;
+
+    flatten(t, 1, 0, s, &n);
+    return n;
+}
+
+void
+anon_bitmap_delete(anon_bitmap_t *t)
+{
+    if (! t) {
+	return;
+    }
+    free(t->exists);
+    free(t->complete);
+    free(t);
+}
@@ -0,0 +1,30 @@
+/*
+ * anon-bitmap.h --
+ *
+ * Internal set of used IPv4 prefixes held in fixed bitmaps, one bit
+ * per node of the complete binary tree of all prefixes, an alternative
+ * to the binary used_i tree of anon-ip.c for very large used sets.
+ * It answers the same canflip queries without following pointers.
+ * Not installed and not part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_BITMAP_H_
+#define _ANON_BITMAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "anon-node.h"
+
+typedef struct _anon_bitmap anon_bitmap_t;
+
+anon_bitmap_t*	anon_bitmap_new(void);
+int		anon_bitmap_insert(anon_bitmap_t *t, const uint32_t addr,
+				   const int prefixlen, unsigned *nodes);
+uint32_t	anon_bitmap_canflip(anon_bitmap_t *t, const uint32_t addr);
+size_t		anon_bitmap_flatten(anon_bitmap_t *t, struct anon_step *s);
+void		anon_bitmap_delete(anon_bitmap_t *t);
+
+#endif /* _ANON_BITMAP_H_ */
@@ -0,0 +1,214 @@
+/*
+ * anon-cache.c --
+ *
+ * Size-bounded LRU cache mapping 64-bit keys to 64-bit values. All
+ * entries are allocated up front; they are linked into hash chains
+ * for lookups and into a doubly linked list in LRU order. Links are
+ * 32-bit entry indices. Since even a lookup reorders the LRU list,
+ * all operations are serialized by a mutex so that a cache can be
+ * shared by concurrent mapping threads.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "anon-cache.h"
+
+#define NIL	0xffffffff
+
+struct entry {
+    uint64_t key;
+    uint64_t value;
+    uint32_t hnext;		/* next entry in the hash chain */
+    uint32_t prev, next;	/* neighbours in LRU order */
+};
+
+struct _anon_cache {
+    struct entry *entries;
+    uint32_t *buckets;
+    uint32_t size;		/* number of entries */
+    uint32_t used;		/* number of entries in use */
+    uint32_t mask;		/* number of buckets - 1 */
+    uint32_t head, tail;	/* most and least recently used entry */
+    uint64_t hits, misses;
+    pthread_mutex_t lock;
+};
+
+static inline uint32_t
+hash(anon_cache_t *c, const uint64_t key)
+{
+    return (uint32_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & c->mask;
+}
+
+static inline void
+lru_unlink(anon_cache_t *c, const uint32_t i)
+{
+    struct entry *e = c->entries + i;
+
+    if (e->prev != NIL) {
+	c->entries[e->prev].next = e->next;
+    } else {
+	c->head = e->next;
+    }
+    if (e->next != NIL) {
+	c->entries[e->next].prev = e->prev;
+    } else {
+	c->tail = e->prev;
+    }
+}
+
+static inline void
+lru_push(anon_cache_t *c, const uint32_t i)
+{
+    struct entry *e = c->entries + i;
+
+    e->prev = NIL;
+    e->next = c->head;
+    if (c->head != NIL) {
+	c->entries[c->head].prev = i;
+    } else {
+	c->tail = i;
+    }
+    c->head = i;
+}
+
+/*
+ * Create a new cache holding at most size entries.
+ */
+
+anon_cache_t*
+anon_cache_new(const size_t size)
+{
+    anon_cache_t *c;
+    uint32_t nbuckets;
+
+    if (size == 0 || size >= NIL) {
+	return NULL;
+    }
+
+    c = (anon_cache_t *) malloc(sizeof(anon_cache_t));
+    if (! c) {
+	return NULL;
+    }
+    memset(c, 0, sizeof(anon_cache_t));
+    if (pthread_mutex_init(&c->lock, NULL) != 0) {
+	free(c);
+	return NULL;
+    }
+
+    for (nbuckets = 1; nbuckets < size && nbuckets < 0x80000000;
+	 nbuckets <<= 1) ;
+    c->entries = (struct entry *) malloc(size * sizeof(struct entry));
+    c->buckets = (uint32_t *) malloc(nbuckets * sizeof(uint32_t));
+    if (! c->entries || ! c->buckets) {
+	anon_cache_delete(c);
+	return NULL;
+    }
+    memset(c->buckets, 0xff, nbuckets * sizeof(uint32_t));
+    c->size = size;
+    c->mask = nbuckets - 1;
+    c->head = c->tail = NIL;
+    return c;
+}
+
+/*
+ * Lookup key and move its entry to the front of the LRU list.
+ * Returns 1 and sets value on a hit, 0 on a miss.
+ */
+
+int
+anon_cache_get(anon_cache_t *c, const uint64_t key, uint64_t *value)
+{
+    uint32_t i;
+
+    assert(c && value);
+
+    pthread_mutex_lock(&c->lock);
+    for (i = c->buckets[hash(c, key)]; i != NIL; i = c->entries[i].hnext) {
+	if (c->entries[i].key == key) {
+	    if (c->head != i) {
+		lru_unlink(c, i);
+		lru_push(c, i);
+	    }
+	    *value = c->entries[i].value;
+	    c->hits++;
+	    pthread_mutex_unlock(&c->lock);
+	    return 1;
+	}
+    }
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/*
+ * Insert a key, evicting the least recently used entry if the cache
+ * is full. Keys already in the cache are updated.
+ */
+
+void
+anon_cache_put(anon_cache_t *c, const uint64_t key, const uint64_t value)
+{
+    uint32_t i, *p;
+    struct entry *e;
+
+    assert(c);
+
+    pthread_mutex_lock(&c->lock);
+    for (i = c->buckets[hash(c, key)]; i != NIL; i = c->entries[i].hnext) {
+	if (c->entries[i].key == key) {
+	    c->entries[i].value = value;
+	    pthread_mutex_unlock(&c->lock);
+	    return;
+	}
+    }
+
+    if (c->used < c->size) {
+	i = c->used++;
+    } else {
+	i = c->tail;
+	lru_unlink(c, i);
+	for (p = &c->buckets[hash(c, c->entries[i].key)];
+	     *p != i; p = &c->entries[*p].hnext) ;
+	*p = c->entries[i].hnext;
+    }
+
+    e = c->entries + i;
+    e->key = key;
+    e->value = value;
+    e->hnext = c->buckets[hash(c, key)];
+    c->buckets[hash(c, key)] = i;
+    lru_push(c, i);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+anon_cache_stats(anon_cache_t *c, uint64_t *hits, uint64_t *misses)
+{
+    assert(c);
+
+    pthread_mutex_lock(&c->lock);
+    if (hits) *hits = c->hits;
+    if (misses) *misses = c->misses;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+anon_cache_delete(anon_cache_t *c)
+{
+    if (! c) {
+	return;
+    }
+    if (c->entries) {
+	free(c->entries);
+    }
+    if (c->buckets) {
+	free(c->buckets);
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
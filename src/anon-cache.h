@@ -0,0 +1,28 @@
+/*
+ * anon-cache.h --
+ *
+ * Internal size-bounded LRU cache mapping 64-bit keys to 64-bit
+ * values, used to remember partial one-time-pads of frequently seen
+ * address prefixes. Not installed and not part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_CACHE_H_
+#define _ANON_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct _anon_cache anon_cache_t;
+
+anon_cache_t*	anon_cache_new(const size_t size);
+int		anon_cache_get(anon_cache_t *c, const uint64_t key,
+			       uint64_t *value);
+void		anon_cache_put(anon_cache_t *c, const uint64_t key,
+			       const uint64_t value);
+void		anon_cache_stats(anon_cache_t *c, uint64_t *hits,
+				 uint64_t *misses);
+void		anon_cache_delete(anon_cache_t *c);
+
+#endif /* _ANON_CACHE_H_ */
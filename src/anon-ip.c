@@ -14,10 +14,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <openssl/aes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 #include <openssl/sha.h>
 
 #include "libanon.h"
+#include "anon-aes.h"
+#include "anon-cache.h"
+#include "anon-node.h"
+#include "anon-poptrie.h"
+#include "anon-bitmap.h"
+#include "anon-rcu.h"
+#include "anon-pp.h"
 
 /*
  * WARNING: We are using the 1-based indexing for bits of IP address,
@@ -25,76 +37,284 @@
  * research final report)
  */
 
-/* structure for internal used_i tree */
-struct node {
-    char complete; /* if complete subtree below node is used */
-    struct node* left;
-    struct node* right;
-    struct node* parent;
-};
-
 struct _anon_ipv4 {
-    struct node *tree;
-    unsigned nodes;
-    AES_KEY aes_key;	/* AES key */
+    int used;		/* representation of the used set */
+    anon_nodes_t tree;	/* used_i tree, the root at index 0 */
+    anon_poptrie_t *ptrie; /* used set as a multibit trie */
+    anon_bitmap_t *bitmap; /* used set as bitmaps */
+    unsigned nodes;	/* nodes of the (binary) used_i tree */
+    size_t prefixes;	/* complete nodes (more if some were covered) */
+    anon_aes_t aes;	/* AES (Rijndael) cipher */
     uint8_t m_key[16];	/* 128 bit secret key */
     uint8_t m_pad[16];	/* 128 bit secret pad */
+    uint32_t mpad;	/* first 32 bits of m_pad */
+    uint8_t *ptable;	/* precomputed pads of the top pdepth bits */
+    int pdepth;		/* number of bits covered by ptable */
+    void *pmap;		/* mapped pad table file (if any) */
+    size_t pmaplen;	/* length of the mapped pad table file */
+    anon_cache_t *cache; /* partial pads of recently seen /24s */
+    size_t cache_size;	/* maximum number of cache entries */
+    struct cidr *cidr;	/* fully precomputed CIDR blocks (sorted) */
+    size_t ncidr;	/* number of precomputed CIDR blocks */
+    struct lex *lex;	/* materialized lex mapping (sorted) */
+    size_t nlex;	/* number of materialized used prefixes */
+    anon_rcu_t rcu;	/* published lex mapping (struct version) */
+};
+
+/* fully precomputed CIDR block */
+struct cidr {
+    uint32_t net;	/* network address in host byte order */
+    int prefixlen;
+    uint32_t *pads;	/* pads of all addresses (network byte order) */
+};
+
+/* used prefix with its materialized lex mapping */
+struct lex {
+    uint32_t net;	/* prefix in host byte order */
+    uint32_t anet;	/* anonymized prefix in host byte order */
+    int prefixlen;
+};
+
+/* published version of the lex mapping, see anon_ipv4_publish() */
+struct version {
+    struct lex *lex;
+    size_t nlex;
 };
 
 #define IPv4LENGTH 32
+#define IPv4BATCH 16
+#define IPv4PDEPTH_MAX 24
+#define CACHEDEPTH 24
+#define IPv4CIDR_MIN 8
+#define TRIEBLOCKS 512
+
+/* number of addresses and last address of a CIDR block */
+#define CIDR_SIZE(c)	((size_t) 1 << (IPv4LENGTH - (c)->prefixlen))
+#define CIDR_LAST(c)	((c)->net + (uint32_t) (CIDR_SIZE(c) - 1))
+
+/* bytes per ptable entry and index of the entry for ip */
+#define PWIDTH(d)	(((d) + 7) / 8)
+#define PINDEX(ip, d)	(ntohl(ip) >> (IPv4LENGTH - (d)))
+
+/*
+ * Layout of a pad table file: a header of PFILE_HEADER bytes followed
+ * by the table. All header fields are in network byte order.
+ */
+
+#define PFILE_MAGIC	"LIBANON4"
+#define PFILE_VERSION	1
+#define PFILE_HEADER	64
+
+struct pfile_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t depth;
+    uint8_t fingerprint[SHA_DIGEST_LENGTH]; /* SHA-1(m_key, m_pad) */
+};
+
+static uint32_t canflip(anon_ipv4_t *a, const in_addr_t ip);
+static void canflip_count_n(anon_nodes_t *t, uint32_t i, int* n,
+			    int level);
+static void expand(anon_ipv4_t *a, const uint32_t net, const int plen,
+		   const int depth, uint8_t *table, const int w);
+static void lex_rekey(anon_ipv4_t *a);
+static void version_free(struct version *v);
+
+/*
+ * Bit operations on addresses held in host byte order words, see
+ * anon-pp.h. pp32_prf_input() builds the pseudorandom function input
+ * for prefix length pos: The most significant pos bits are taken from
+ * the address. The other 128-pos bits are taken from m_pad.
+ */
+
+ANON_PP_DEFINE(pp32, IPv4LENGTH, uint32_t)
+
+/*
+ * Release the precomputed pad table, which is either allocated by
+ * anon_ipv4_precompute() or mapped by anon_ipv4_precompute_load().
+ */
+
+static void
+ptable_drop(anon_ipv4_t *a)
+{
+    if (a->pmap) {
+	munmap(a->pmap, a->pmaplen);
+    } else if (a->ptable) {
+	free(a->ptable);
+    }
+    a->pmap = NULL;
+    a->pmaplen = 0;
+    a->ptable = NULL;
+    a->pdepth = 0;
+}
+
+/*
+ * The fingerprint identifies the key a pad table file was built
+ * with. The table itself reveals the top of the mapping and must be
+ * protected like the key.
+ */
 
-static int canflip(anon_ipv4_t *a, const in_addr_t ip, const int prefixlen);
-static void delete_node(struct node* n);
-static struct node* add_new_node(struct node* parent, int right);
-static void canflip_count_n(struct node* p,int* n, int level);
+static void
+fingerprint(anon_ipv4_t *a, uint8_t *md)
+{
+    uint8_t buf[sizeof(a->m_key) + sizeof(a->m_pad)];
+
+    memcpy(buf, a->m_key, sizeof(a->m_key));
+    memcpy(buf + sizeof(a->m_key), a->m_pad, sizeof(a->m_pad));
+    SHA1(buf, sizeof(buf), md);
+}
+
+/*
+ * The precomputed pad bits of ip as a host byte order word.
+ */
+
+static inline uint32_t
+ptable_pad(anon_ipv4_t *a, const in_addr_t ip)
+{
+    const uint8_t *e;
+    uint32_t pad = 0;
+    int b;
+
+    e = a->ptable + PINDEX(ip, a->pdepth) * PWIDTH(a->pdepth);
+    for (b = 0; b < PWIDTH(a->pdepth); b++) {
+	pad |= (uint32_t) e[b] << (24 - 8*b);
+    }
+    return pad;
+}
+
+static int
+cidr_cmp(const void *p, const void *q)
+{
+    const struct cidr *c = p, *d = q;
+
+    return (c->net > d->net) - (c->net < d->net);
+}
+
+static void
+cidr_drop(anon_ipv4_t *a)
+{
+    size_t i;
+
+    for (i = 0; i < a->ncidr; i++) {
+	free(a->cidr[i].pads);
+    }
+    if (a->cidr) {
+	free(a->cidr);
+    }
+    a->cidr = NULL;
+    a->ncidr = 0;
+}
+
+/*
+ * Find the precomputed pad of ip (network byte order) by a binary
+ * search over the sorted CIDR blocks. Returns NULL if ip is not
+ * inside of a precomputed block.
+ */
+
+static inline const uint32_t*
+cidr_lookup(anon_ipv4_t *a, const in_addr_t ip)
+{
+    uint32_t addr = ntohl(ip);
+    size_t lo = 0, hi = a->ncidr, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (addr < a->cidr[mid].net) {
+	    hi = mid;
+	} else if (addr > CIDR_LAST(&a->cidr[mid])) {
+	    lo = mid + 1;
+	} else {
+	    return &a->cidr[mid].pads[addr - a->cidr[mid].net];
+	}
+    }
+    return NULL;
+}
 
 /*
- * Node allocator and deallocator (factored out to experiment with
- * different allocators).
+ * Create the empty used set (the used_i tree with just its root) in
+ * the representation selected for a, or release it. The used set
+ * is gone once the lex mapping has been materialized.
  */
 
-static inline struct node*
-node_alloc()
+static int
+used_init(anon_ipv4_t *a)
 {
-    return (struct node*) malloc(sizeof(struct node));
+    a->nodes = 1;
+    if (a->used == ANON_IPV4_USED_POPTRIE) {
+	a->ptrie = anon_poptrie_new();
+	return a->ptrie ? 0 : -1;
+    }
+    if (a->used == ANON_IPV4_USED_BITMAP) {
+	a->bitmap = anon_bitmap_new();
+	return a->bitmap ? 0 : -1;
+    }
+    return anon_nodes_init(&a->tree);
 }
 
-static inline void
-node_free(struct node* n)
+static void
+used_clear(anon_ipv4_t *a)
 {
-    free(n);
+    anon_poptrie_delete(a->ptrie);
+    a->ptrie = NULL;
+    anon_bitmap_delete(a->bitmap);
+    a->bitmap = NULL;
+    anon_nodes_clear(&a->tree);
 }
 
+#define USED_GONE(a)	(! (a)->tree.size && ! (a)->ptrie && ! (a)->bitmap)
+
 /*
  * Create a new IP anonymization object.
  */
 
 anon_ipv4_t*
 anon_ipv4_new()
+{
+    return anon_ipv4_new_used(ANON_IPV4_USED_TREE);
+}
+
+/*
+ * Create a new IP anonymization object with the given representation
+ * of the used set (lex mode). ANON_IPV4_USED_TREE is a binary tree
+ * with a node per address bit. ANON_IPV4_USED_POPTRIE is a multibit
+ * trie with a cache line per 7 address bits, which needs about 5
+ * instead of 32 dependent memory accesses per address.
+ * ANON_IPV4_USED_BITMAP is a bitmap per tree level of 1.5 GB in
+ * total, which suits used sets of hundreds of millions of addresses.
+ */
+
+anon_ipv4_t*
+anon_ipv4_new_used(const int used)
 {
     anon_ipv4_t *a;
 
+    if (used != ANON_IPV4_USED_TREE && used != ANON_IPV4_USED_POPTRIE
+	&& used != ANON_IPV4_USED_BITMAP) {
+	return NULL;
+    }
+
     a = (anon_ipv4_t *) malloc(sizeof(anon_ipv4_t));
     if (! a) {
 	return NULL;
     }
     memset(a, 0, sizeof(anon_ipv4_t));
-    a->tree = node_alloc();
-    if (!a->tree) {
+    a->used = used;
+    anon_rcu_init(&a->rcu);
+    if (used_init(a) != 0) {
+	used_clear(a);
+	anon_rcu_cleanup(&a->rcu);
 	free(a);
 	return NULL;
     }
-    a->tree->parent = NULL;
-    a->tree->left = NULL;
-    a->tree->right = NULL;
-    a->tree->complete = 0;
-    a->nodes = 1;
 
     /*
-     * initialize the AES (Rijndael) cipher
+     * initialize the AES (Rijndael) cipher with an all zero key
      * (in case user forgets to call ..._set_key)
      */
-    AES_set_encrypt_key(NULL, 0, &(a->aes_key));
+    if (anon_aes_init(&a->aes) != 0) {
+	anon_ipv4_delete(a);
+	return NULL;
+    }
 
     return a;
 }
@@ -110,9 +330,16 @@ anon_ipv4_delete(anon_ipv4_t *a)
 	return;
     }
 
-    if (a->tree) {
-	delete_node(a->tree);
+    used_clear(a);
+    anon_aes_cleanup(&a->aes);
+    ptable_drop(a);
+    anon_cache_delete(a->cache);
+    cidr_drop(a);
+    if (a->lex) {
+	free(a->lex);
     }
+    version_free(a->rcu.current);
+    anon_rcu_cleanup(&a->rcu);
     free(a);
 }
 
@@ -123,6 +350,8 @@ anon_ipv4_delete(anon_ipv4_t *a)
 void
 anon_ipv4_set_key(anon_ipv4_t *a, const anon_key_t *key)
 {
+    size_t i;
+
     assert(a);
     assert(key);
     assert(key->key);
@@ -131,316 +360,1310 @@ anon_ipv4_set_key(anon_ipv4_t *a, const anon_key_t *key)
     /* initialize the 128-bit secret key */
     memcpy(a->m_key, key->key, 16);
     /* initialize the AES (Rijndael) cipher */
-    AES_set_encrypt_key(key->key, 128, &(a->aes_key));
+    anon_aes_set_key(&a->aes, key->key);
     /* initialize the 128-bit secret pad. The pad is encrypted before
      * being used for padding. 
      */
-    AES_ecb_encrypt(key->key + 16, a->m_pad, &(a->aes_key), AES_ENCRYPT);
+    anon_aes_encrypt(&a->aes, key->key + 16, a->m_pad, 1);
+    a->mpad = pp32_load(a->m_pad);
+    /* the precomputed and cached pads depend on the key */
+    if (a->pdepth) {
+	(void) anon_ipv4_precompute(a, a->pdepth);
+    }
+    if (a->cache) {
+	(void) anon_ipv4_set_cache(a, a->cache_size);
+    }
+    for (i = 0; i < a->ncidr; i++) {
+	memset(a->cidr[i].pads, 0, CIDR_SIZE(&a->cidr[i]) * sizeof(uint32_t));
+	expand(a, a->cidr[i].net, a->cidr[i].prefixlen, IPv4LENGTH,
+	       (uint8_t *) a->cidr[i].pads, sizeof(uint32_t));
+    }
+    if (a->lex) {
+	lex_rekey(a);
+    }
+    if (a->rcu.current) {
+	(void) anon_ipv4_publish(a);
+    }
 }
 
 /*
- * Mark IP address prefix as used - create corresponding nodes in the
- * tree and mark the prefix node complete.
+ * Enable (or resize) a cache of at most size partial one-time-pads
+ * keyed on the top CACHEDEPTH bits of the address. Traffic tends to be
+ * concentrated in few /24 networks, and a cache hit saves CACHEDEPTH
+ * cipher calls. A size of 0 disables the cache.
  */
 
 int
-anon_ipv4_set_used(anon_ipv4_t *a, const in_addr_t ip, const int prefixlen) 
+anon_ipv4_set_cache(anon_ipv4_t *a, const size_t size)
 {
-    struct node* nodep = a->tree; /* current node */
-    struct node* childp = NULL; /* child node to be followed */
-    int n = 0;
-    int first_bit; /* first (most significant) bit of ip address
-		    * - currently to be considered in traversing the tree
-		    */
-    uint8_t* c = (uint8_t*) &(ip); /* cut-down representation of ip */
-    int pfl = prefixlen;
-    
     assert(a);
 
-    if (prefixlen > 32 || prefixlen < 1) pfl = 32;
-
-    while (n < pfl) {
-	// printf("n: %02d, ip: %d\n",n,ip >> n);
-	if (nodep->complete) {
-	    // printf("hit complete...\n");
-	    return 0;
-	}
-	first_bit = c[n/8] & ( 0x80 >> (n % 8)); //( 1 << (7-(n%8)));
-	// printf("going %s\n", first_bit ? "right" : "left");
-	if (first_bit) {
-	    childp = nodep->right;
-	} else {
-	    childp = nodep->left;
-	}	    
-	if (!childp) {
-	    // printf("adding new node...\n");
-	    childp = add_new_node(nodep,first_bit);
-	    if (! childp) {
-		return -1;
-	    }
-	    a->nodes++;
+    anon_cache_delete(a->cache);
+    a->cache = NULL;
+    a->cache_size = 0;
+    if (size) {
+	a->cache = anon_cache_new(size);
+	if (! a->cache) {
+	    return -1;
 	}
-	nodep = childp;
-	n++;
+	a->cache_size = size;
     }
-    nodep->complete = 1;
     return 0;
 }
 
-/* 
- * ip is expected in network byte order (the one from inet_pton)
- * 
- * can i-th (1-based indexing) bit in ip be flipped?
- * returns !( used_i(a_1 a_2 ... a_{i-1}0)
- *	&&  used_i(a_1 a_2 ... a_{i-1}1) )
- * where i = prefixlen and ip = a_1 a_2 ...
+/*
+ * Report the number of cache hits and misses.
  */
 
-static int
-canflip(anon_ipv4_t *a, const in_addr_t ip, const int prefixlen)
+void
+anon_ipv4_cache_stats(anon_ipv4_t *a, uint64_t *hits, uint64_t *misses)
 {
-    struct node* nodep = a->tree; /* current node */
-    struct node* childp = NULL; /* child node to be followed */
-    uint8_t* c = (uint8_t*) &(ip); /* cut-down representation of ip */
-    int n = 0;
-    int pfl = prefixlen-1; /* need a_1 a_2 ... a_{i-1} [0,1] */
-    int first_bit; /* last bit of ip address - currently to be considered */
-    while (n < pfl) {
-	// printf("n: %02d, ip: %d\n",n,ip >> n);
-	if (nodep->complete) {
-	    // printf("hit complete... (n=%d)\n",n);
-	    return 0;
-	}
-	first_bit = c[n/8] & ( 0x80 >> (n % 8)); //( 1 << (7-(n%8)));
-	if (first_bit) {
-	    childp = nodep->right;
-	} else {
-	    childp = nodep->left;
-	}	    
-	if (!childp) {
-	    // printf("not used...\n");
-	    return 0;
-	}
-	nodep = childp;
-	n++;
-    }
-    if (nodep->complete) {
-	// printf("last node is complete... (n=%d)\n",n);
+    assert(a);
+
+    if (a->cache) {
+	anon_cache_stats(a->cache, hits, misses);
+    } else {
+	if (hits) *hits = 0;
+	if (misses) *misses = 0;
     }
-    return ( !(nodep->left && nodep->right) && !nodep->complete);
 }
 
-unsigned
-anon_ipv4_nodes_count(anon_ipv4_t *a)
+/*
+ * Fill table with the pseudorandom one-time-pad bits of the first
+ * depth positions for all 2^(depth-plen) extensions of the prefix
+ * net/plen (net in host byte order). The flip bit for position pos
+ * only depends on the first pos bits of an address, so the table is
+ * built level by level and every distinct flip bit costs exactly one
+ * cipher call. At level l >= plen, the entry of extension j lives at
+ * index j << (depth - l). Once its flip bit is known, the entry is
+ * copied to the index of its right child at level l+1. Entries are w
+ * bytes wide and hold the pad in network byte order.
+ */
+
+static void
+expand(anon_ipv4_t *a, const uint32_t net, const int plen, const int depth,
+       uint8_t *table, const int w)
 {
-    return a->nodes;
+    uint8_t rin_output[IPv4BATCH*IPv4LENGTH][16];
+    uint8_t rin_input[IPv4BATCH*IPv4LENGTH][16];
+    uint32_t j, k, m, cnt, prefix;
+    uint8_t *e;
+    int level, s;
+
+    for (level = 0; level < depth; level++) {
+	s = depth - (level < plen ? plen : level);
+	cnt = level < plen ? 1 : (uint32_t) 1 << (level - plen);
+	for (k = 0; k < cnt; k += m) {
+	    m = (cnt - k < IPv4BATCH*IPv4LENGTH)
+		? cnt - k : IPv4BATCH*IPv4LENGTH;
+	    for (j = 0; j < m; j++) {
+		prefix = net;
+		if (level > plen) {
+		    prefix |= (k + j) << (IPv4LENGTH - level);
+		}
+		pp32_prf_input(prefix, a->m_pad, a->mpad, level, rin_input[j]);
+	    }
+	    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], m);
+	    for (j = 0; j < m; j++) {
+		e = table + ((size_t) (k + j) << s) * w;
+		e[level/8] |= (rin_output[j][0] >> 7) << (7-(level%8));
+		if (level >= plen) {
+		    memcpy(e + ((size_t) 1 << (s - 1)) * w, e, w);
+		}
+	    }
+	}
+    }
 }
 
+/*
+ * Precompute the pseudorandom one-time-pad bits for the first depth
+ * positions of all 2^depth prefixes (2^depth - 1 cipher calls in
+ * total). Afterwards, the prefix-preserving functions only need
+ * IPv4LENGTH - depth cipher calls per address. Each table entry holds
+ * the first PWIDTH(depth) bytes of the pad. A depth of 0 drops the
+ * table.
+ */
+
 int
-canflipv4_count_ip(anon_ipv4_t *a)
+anon_ipv4_precompute(anon_ipv4_t *a, const int depth)
 {
-    int n = 0;
-    canflip_count_n(a->tree, &n,0);
-    return n;
-}
+    uint8_t *table;
 
-/* warning: not tested with complete !!! */
-static void
-canflip_count_n(struct node* p,int* n, int level) {
-    if (!p)
-	return;
-    if (p->complete) {
-	/* number of addresses in subtree */
-	//(*n) += (int) powl(2,IPv4LENGTH-level-1);
-	(*n) += 2 << (IPv4LENGTH-level-1);
-	(*n) ++;
-	return;
+    assert(a);
+
+    if (depth < 0 || depth > IPv4PDEPTH_MAX) {
+	return -1;
     }
-    if (!(p->left) && !(p->right)) {
-	(*n)++;
+    ptable_drop(a);
+    if (depth == 0) {
+	return 0;
     }
-    canflip_count_n(p->left, n,level+1);
-    canflip_count_n(p->right, n, level+1);
-}
 
+    table = (uint8_t *) calloc((size_t) 1 << depth, PWIDTH(depth));
+    if (! table) {
+	return -1;
+    }
+    expand(a, 0, 0, depth, table, PWIDTH(depth));
+
+    a->ptable = table;
+    a->pdepth = depth;
+    return 0;
+}
 
 /*
- * creates new node and inserts it into the tree as a child of parent
- * if right is non-zero, it become a right child; left otherwise
- * returns pointer to the new child or NULL on error
+ * Precompute the complete one-time-pads of all addresses in the n
+ * CIDR blocks net[i]/prefixlen[i], which must not overlap. The
+ * prefix-preserving functions then look up addresses inside these
+ * blocks in a dense table and only run the cipher for addresses
+ * outside of them. A block with prefix length p needs 2^(32-p) * 4
+ * bytes; prefix lengths below IPv4CIDR_MIN are rejected. Calling the
+ * function again replaces the blocks; n = 0 drops them.
  */
 
-static struct node*
-add_new_node(struct node* parent, int right) {
-    if (!parent) {
-	return NULL;
+int
+anon_ipv4_precompute_cidr(anon_ipv4_t *a, const in_addr_t *net,
+			  const int *prefixlen, const size_t n)
+{
+    struct cidr *cidr;
+    uint32_t mask;
+    size_t i, j;
+
+    assert(a);
+
+    for (i = 0; i < n; i++) {
+	if (prefixlen[i] < IPv4CIDR_MIN || prefixlen[i] > IPv4LENGTH) {
+	    return -1;
+	}
     }
-    if (parent->complete) {
-	return NULL;
+
+    cidr = (struct cidr *) calloc(n ? n : 1, sizeof(struct cidr));
+    if (! cidr) {
+	return -1;
     }
-    
-    struct node* n = node_alloc();
-    if (!n) {
-	return NULL;
+    for (i = 0; i < n; i++) {
+	mask = 0xffffffff << (IPv4LENGTH - prefixlen[i]);
+	cidr[i].net = ntohl(net[i]) & mask;
+	cidr[i].prefixlen = prefixlen[i];
+    }
+    qsort(cidr, n, sizeof(struct cidr), cidr_cmp);
+    for (i = 1; i < n; i++) {
+	if (cidr[i].net <= CIDR_LAST(&cidr[i-1])) {
+	    free(cidr);
+	    return -1;
+	}
+    }
+    for (i = 0; i < n; i++) {
+	cidr[i].pads = (uint32_t *) calloc(CIDR_SIZE(&cidr[i]),
+					   sizeof(uint32_t));
+	if (! cidr[i].pads) {
+	    for (j = 0; j < i; j++) {
+		free(cidr[j].pads);
+	    }
+	    free(cidr);
+	    return -1;
+	}
+	expand(a, cidr[i].net, cidr[i].prefixlen, IPv4LENGTH,
+	       (uint8_t *) cidr[i].pads, sizeof(uint32_t));
     }
-    n->left = NULL;
-    n->right = NULL;
-    n->parent = parent;
-    n->complete = 0;
 
-    if (right) {
-	n->right = parent->right;
-	parent->right = n;
+    cidr_drop(a);
+    if (n) {
+	a->cidr = cidr;
+	a->ncidr = n;
     } else {
-	n->left = parent->left;
-	parent->left = n;
+	free(cidr);
     }
-    return n;
+    return 0;
 }
 
-static void
-delete_node(struct node* n) {
-    if (!n) return;
-    delete_node(n->left);
-    delete_node(n->right);
-    n->left = NULL;
-    n->right = NULL;
-    node_free(n);
+/*
+ * Write the precomputed pad table together with the fingerprint of
+ * the key to a file. The file is written under a temporary name and
+ * renamed, so that concurrent readers never map a partial table.
+ */
+
+int
+anon_ipv4_precompute_save(anon_ipv4_t *a, const char *filename)
+{
+    uint8_t header[PFILE_HEADER];
+    struct pfile_header *h = (struct pfile_header *) header;
+    char *tmpname;
+    size_t len;
+    FILE *f;
+    int fd, ok;
+
+    assert(a && filename);
+
+    if (! a->ptable) {
+	return -1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(h->magic, PFILE_MAGIC, sizeof(h->magic));
+    h->version = htonl(PFILE_VERSION);
+    h->depth = htonl(a->pdepth);
+    fingerprint(a, h->fingerprint);
+    len = ((size_t) 1 << a->pdepth) * PWIDTH(a->pdepth);
+
+    tmpname = malloc(strlen(filename) + 8);
+    if (! tmpname) {
+	return -1;
+    }
+    sprintf(tmpname, "%s.XXXXXX", filename);
+    fd = mkstemp(tmpname);
+    if (fd == -1) {
+	free(tmpname);
+	return -1;
+    }
+    f = fdopen(fd, "wb");
+    if (! f) {
+	close(fd);
+	unlink(tmpname);
+	free(tmpname);
+	return -1;
+    }
+    ok = fwrite(header, sizeof(header), 1, f) == 1
+	&& fwrite(a->ptable, len, 1, f) == 1;
+    /* fclose() releases f (and fd) even if it fails */
+    if (fclose(f) != 0) {
+	ok = 0;
+    }
+    if (! ok || rename(tmpname, filename) != 0) {
+	unlink(tmpname);
+	free(tmpname);
+	return -1;
+    }
+    free(tmpname);
+    return 0;
 }
 
 /*
- * prefix-preserving anonymization on ip
- * ip and aip are expected in network byte order (as returned by inet_pton
- * slightly modified version of PAnonymizer::anonymize() from Crypto-PAn
+ * Map a pad table file written by anon_ipv4_precompute_save()
+ * read-only into memory. Processes mapping the same file share one
+ * page-cached copy of the table. Fails with errno ENOENT if there is
+ * no such file and with EINVAL if the file was built with a different
+ * key (or is not a pad table).
  */
+
 int
-anon_ipv4_map_pref(anon_ipv4_t *a, const in_addr_t ip, in_addr_t *aip)
+anon_ipv4_precompute_load(anon_ipv4_t *a, const char *filename)
 {
-    uint8_t rin_output[16];
-    uint8_t rin_input[16];
-    int pos, i;
-    uint8_t* c = (uint8_t*) &(ip); /* cut-down representation of ip */
-    uint8_t* ac = (uint8_t*) aip ; /* cut-down representation of aip */
+    uint8_t md[SHA_DIGEST_LENGTH];
+    struct pfile_header *h;
+    struct stat st;
+    uint32_t depth;
+    void *map;
+    int fd;
 
-    assert(a);
+    assert(a && filename);
 
-    memset(aip, 0, sizeof(in_addr_t));
-    memcpy(rin_input, a->m_pad, 16);
-    
-    /* For each prefix with length from 0 to 31, generate a bit
-     * using the Rijndael cipher, which is used as a pseudorandom
-     * function here. The bits generated in every round are combined
-     * into a pseudorandom one-time-pad.
-     */
-    for (pos = 0; pos <= 31 ; pos++) { 
-	/* Padding: The most significant pos bits are taken from
-	 * ip. The other 128-pos bits are taken from m_pad.
-	 */
-	for(i=0;i<pos/8;i++) {
-	    rin_input[i] = c[i];
-	}
-	rin_input[pos/8] = (c[pos/8] >> (8-pos%8)) << (8-pos%8);
-	//fprintf(stderr, "rin_input[%d]: %02x\n", pos/8, rin_input[pos/8]);
-	
-	rin_input[pos/8] |= ((a->m_pad[pos/8] << (pos%8)) & 0xff) >> (pos%8);
-	//fprintf(stderr, "rin_input[%d]: %02x pad: %02x\n",
-	//	pos/8, rin_input[pos/8],
-	//	((a->m_pad[pos/8] << (pos%8)) & 0xff) >> (pos%8));
-
-	for(i=(pos/8)+1;i<16;i++) {
-	    rin_input[i] = a->m_pad[i];
-	}
-	
-	/* Encryption: The Rijndael cipher is used as pseudorandom
-	 * function. During each round, only the first bit of
-	 * rin_output is used.
-	 */
-	AES_ecb_encrypt(rin_input, rin_output, &(a->aes_key), AES_ENCRYPT);
-
-	/* Combination: the bits are combined into a pseudorandom
-	 *  one-time-pad
-	 */
-	ac[pos/8] |=  (rin_output[0] >> 7) << (7-(pos%8));
-	/*
-	 fprintf(stderr, "bit %2d: rin_input: %02x:%02x:%02x:%02x "
-		 "rin_output: %02x:%02x:%02x:%02x flip bit: %d\n",
-		 pos,
-		 rin_input[0], rin_input[1], rin_input[2], rin_input[3],
-		 rin_output[0], rin_output[1], rin_output[2], rin_output[3],
-		 (rin_output[0] >> 7));
-	*/
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+	return -1;
     }
-    /* XOR the orginal address with the pseudorandom one-time-pad */
-    for(i=0;i<4;i++) {
-	ac[i] = ac[i] ^ c[i];
+    if (fstat(fd, &st) == -1) {
+	close(fd);
+	return -1;
+    }
+    if (st.st_size < PFILE_HEADER) {
+	close(fd);
+	errno = EINVAL;
+	return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	return -1;
     }
+
+    h = (struct pfile_header *) map;
+    depth = ntohl(h->depth);
+    fingerprint(a, md);
+    if (memcmp(h->magic, PFILE_MAGIC, sizeof(h->magic)) != 0
+	|| ntohl(h->version) != PFILE_VERSION
+	|| depth < 1 || depth > IPv4PDEPTH_MAX
+	|| (size_t) st.st_size
+	   != PFILE_HEADER + ((size_t) 1 << depth) * PWIDTH(depth)
+	|| memcmp(h->fingerprint, md, sizeof(md)) != 0) {
+	munmap(map, st.st_size);
+	errno = EINVAL;
+	return -1;
+    }
+
+    ptable_drop(a);
+    a->pmap = map;
+    a->pmaplen = st.st_size;
+    a->ptable = (uint8_t *) map + PFILE_HEADER;
+    a->pdepth = depth;
     return 0;
 }
 
 /*
- * prefix- and lexicographical-order-preserving anonymization on
- * ip
+ * Mark IP address prefix as used - create corresponding nodes in the
+ * tree and mark the prefix node complete.
  */
 
 int
-anon_ipv4_map_pref_lex(anon_ipv4_t *a, const in_addr_t ip, in_addr_t *aip)
+anon_ipv4_set_used(anon_ipv4_t *a, const in_addr_t ip, const int prefixlen) 
 {
-    uint8_t rin_output[16];
-    uint8_t rin_input[16];
-    int pos, i;
+    struct anon_node* nodep; /* current node */
+    uint32_t childp; /* child node to be followed */
+    int n = 0;
+    int first_bit; /* first (most significant) bit of ip address
+		    * - currently to be considered in traversing the tree
+		    */
     uint8_t* c = (uint8_t*) &(ip); /* cut-down representation of ip */
-    uint8_t* ac = (uint8_t*) aip ; /* cut-down representation of aip */
+    int pfl = prefixlen;
     
-
     assert(a);
 
-    memset(aip, 0, sizeof(in_addr_t));
-    memcpy(rin_input, a->m_pad, 16);
+    if (prefixlen > 32 || prefixlen < 1) pfl = 32;
 
-    /* For each prefix with length from 0 to 31, generate a bit
-     * using the Rijndael cipher, which is used as a pseudorandom
-     * function here. The bits generated in every round are combined
-     * into a pseudorandom one-time-pad.
-     */
-    for (pos = 0; pos <= 31 ; pos++) { 
-	/* Padding: The most significant pos bits are taken from
-	 * ip. The other 128-pos bits are taken from m_pad.
-	 */
-	for(i=0;i<pos/8;i++) {
-	    rin_input[i] = c[i];
-	}
-	rin_input[pos/8] = (c[pos/8] >> (8-pos%8)) << (8-pos%8);
-	
-	rin_input[pos/8] |= ((a->m_pad[pos/8] << (pos%8)) & 0xff) >> (pos%8);
-	for(i=(pos/8)+1;i<16;i++) {
-	    rin_input[i] = a->m_pad[i];
-	}
-	
-	/* Encryption: The Rijndael cipher is used as pseudorandom
-	 * function. During each round, only the first bit of
-	 * rin_output is used.
-	 */
-	AES_ecb_encrypt(rin_input, rin_output, &(a->aes_key), AES_ENCRYPT);
-
-	/* combine with used_i */
-	if (! canflip(a, ip, pos+1)) {
-	    rin_output[0] = 0;
-	}
-	/*
-	fprintf(stderr, "canflip pos %d: %d\n",
-	pos+1, canflip(a, ip, pos+1));
-	*/
-	
-	/* Combination: the bits are combined into a pseudorandom
-	 *  one-time-pad
-	 */
-	ac[pos/8] |=  (rin_output[0] >> 7) << (7-(pos%8));
-	// fprintf(stderr, "bit %2d: flip bit: %d\n",
-	// 	pos, (rin_output[0] >> 7));
+    /* the used set is fixed once it has been materialized */
+    if (USED_GONE(a)) {
+	return -1;
     }
-    /* XOR the orginal address with the pseudorandom one-time-pad */
-    for(i=0;i<4;i++) {
-	ac[i] = ac[i] ^ c[i];
+    if (a->ptrie) {
+	n = anon_poptrie_insert(a->ptrie, ntohl(ip), pfl, &a->nodes);
+	if (n > 0) {
+	    a->prefixes++;
+	}
+	return n < 0 ? -1 : 0;
+    }
+    if (a->bitmap) {
+	a->prefixes += anon_bitmap_insert(a->bitmap, ntohl(ip), pfl, &a->nodes);
+	return 0;
+    }
+    nodep = anon_node(&a->tree, 0);
+
+    while (n < pfl) {
+	// printf("n: %02d, ip: %d\n",n,ip >> n);
+	if (nodep->complete) {
+	    // printf("hit complete...\n");
+	    return 0;
+	}
+	first_bit = c[n/8] & ( 0x80 >> (n % 8)); //( 1 << (7-(n%8)));
+	// printf("going %s\n", first_bit ? "right" : "left");
+	if (first_bit) {
+	    childp = nodep->right;
+	} else {
+	    childp = nodep->left;
+	}	    
+	if (!childp) {
+	    // printf("adding new node...\n");
+	    childp = anon_nodes_alloc(&a->tree);
+	    if (childp == ANON_NODE_MAX) {
+		return -1;
+	    }
+	    /* nodep stays valid, chunks never move */
+	    if (first_bit) {
+		nodep->right = childp;
+	    } else {
+		nodep->left = childp;
+	    }
+	    a->nodes++;
+	}
+	nodep = anon_node(&a->tree, childp);
+	n++;
+    }
+    if (! nodep->complete) {
+	nodep->complete = 1;
+	a->prefixes++;
+    }
+    return 0;
+}
+
+/*
+ * Mark the n addresses ip[0..n-1] with prefix length prefixlen as
+ * used. The addresses should be sorted: each one is inserted from the
+ * deepest node it shares with the previous one (their lowest common
+ * ancestor) rather than from the root, and the new nodes are
+ * allocated in preorder. The resulting tree does not depend on the
+ * order.
+ */
+
+int
+anon_ipv4_set_used_sorted(anon_ipv4_t *a, const in_addr_t *ip,
+			  const size_t n, const int prefixlen)
+{
+    uint32_t path[IPv4LENGTH + 1];	/* nodes along the previous address */
+    uint32_t addr, prev = 0, child;
+    struct anon_node *nodep;
+    int pfl = prefixlen, d, depth = 0, bit;
+    size_t i;
+
+    assert(a);
+
+    if (prefixlen > 32 || prefixlen < 1) pfl = 32;
+
+    if (USED_GONE(a)) {
+	return -1;
+    }
+    if (! a->tree.size) {
+	for (i = 0; i < n; i++) {
+	    if (anon_ipv4_set_used(a, ip[i], pfl) != 0) {
+		return -1;
+	    }
+	}
+	return 0;
+    }
+
+    path[0] = 0;
+    for (i = 0; i < n; i++) {
+	addr = ntohl(ip[i]);
+	d = (addr == prev) ? IPv4LENGTH : __builtin_clz(addr ^ prev);
+	if (d > depth) {
+	    d = depth;
+	}
+	for (; d < pfl; d++) {
+	    nodep = anon_node(&a->tree, path[d]);
+	    if (nodep->complete) {
+		break;
+	    }
+	    bit = (addr >> (IPv4LENGTH - 1 - d)) & 1;
+	    child = bit ? nodep->right : nodep->left;
+	    if (! child) {
+		child = anon_nodes_alloc(&a->tree);
+		if (child == ANON_NODE_MAX) {
+		    return -1;
+		}
+		/* nodep stays valid, chunks never move */
+		if (bit) {
+		    nodep->right = child;
+		} else {
+		    nodep->left = child;
+		}
+		a->nodes++;
+	    }
+	    path[d + 1] = child;
+	}
+	depth = d;
+	nodep = anon_node(&a->tree, path[d]);
+	if (d == pfl && ! nodep->complete) {
+	    nodep->complete = 1;
+	    a->prefixes++;
+	}
+	prev = addr;
+    }
+    return 0;
+}
+
+/*
+ * Concurrent marking of used addresses: every thread marks addresses
+ * through a pool of its own, which allocates the thread's nodes. A
+ * new child is published with a compare-and-swap on the parent's
+ * child index; a thread losing the race follows the winner's child
+ * and keeps its node for the next allocation. Complete flags are set
+ * atomically. The tree ends up as after marking the same addresses
+ * one after the other. The bitmaps take concurrent inserts as they
+ * are, so their pools only count; the multibit trie can not be
+ * shared. The pools must be created before the threads start and
+ * deleted after they are done, before the addresses are mapped.
+ */
+
+struct _anon_ipv4_pool {
+    anon_ipv4_t *a;
+    anon_nodes_pool_t nodes;	/* nodes of this thread */
+    uint32_t spare;		/* node that lost a race or 0 */
+    unsigned count;		/* nodes published */
+    size_t prefixes;		/* nodes marked complete */
+};
+
+anon_ipv4_pool_t*
+anon_ipv4_pool_new(anon_ipv4_t *a)
+{
+    anon_ipv4_pool_t *p;
+
+    assert(a);
+
+    if (! a->bitmap
+	&& (! a->tree.size || anon_nodes_share(&a->tree) != 0)) {
+	return NULL;
+    }
+    p = (anon_ipv4_pool_t *) malloc(sizeof(anon_ipv4_pool_t));
+    if (! p) {
+	return NULL;
+    }
+    memset(p, 0, sizeof(anon_ipv4_pool_t));
+    p->a = a;
+    if (! a->bitmap) {
+	anon_nodes_pool_init(&p->nodes, &a->tree);
+    }
+    return p;
+}
+
+int
+anon_ipv4_pool_set_used(anon_ipv4_pool_t *p, const in_addr_t ip,
+		       const int prefixlen)
+{
+    anon_nodes_t *t = &p->a->tree;
+    struct anon_node *nodep;
+    uint32_t *childp, child, i = 0;
+    uint8_t *c = (uint8_t *) &ip;
+    int n, pfl = prefixlen;
+
+    assert(p);
+
+    if (prefixlen > 32 || prefixlen < 1) pfl = 32;
+
+    if (p->a->bitmap) {
+	p->prefixes += anon_bitmap_insert(p->a->bitmap, ntohl(ip), pfl,
+					  &p->count);
+	return 0;
+    }
+    for (n = 0; n < pfl; n++) {
+	nodep = anon_node(t, i);
+	if (__atomic_load_n(&nodep->complete, __ATOMIC_ACQUIRE)) {
+	    return 0;
+	}
+	childp = (c[n / 8] & (0x80 >> (n % 8))) ? &nodep->right : &nodep->left;
+	child = __atomic_load_n(childp, __ATOMIC_ACQUIRE);
+	if (! child) {
+	    if (! p->spare) {
+		p->spare = anon_nodes_pool_alloc(&p->nodes);
+		if (p->spare == ANON_NODE_MAX) {
+		    p->spare = 0;
+		    return -1;
+		}
+	    }
+	    if (__atomic_compare_exchange_n(childp, &child, p->spare, 0,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE)) {
+		child = p->spare;
+		p->spare = 0;
+		p->count++;
+	    }
+	}
+	i = child;
+    }
+    nodep = anon_node(t, i);
+    if (! __atomic_exchange_n(&nodep->complete, 1, __ATOMIC_RELEASE)) {
+	p->prefixes++;
+    }
+    return 0;
+}
+
+void
+anon_ipv4_pool_delete(anon_ipv4_pool_t *p)
+{
+    if (! p) {
+	return;
+    }
+    __atomic_fetch_add(&p->a->nodes, p->count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->a->prefixes, p->prefixes, __ATOMIC_RELAXED);
+    if (! p->a->bitmap) {
+	anon_nodes_pool_done(&p->nodes);
+    }
+    free(p);
+}
+
+/* 
+ * ip is expected in network byte order (the one from inet_pton)
+ * 
+ * can i-th (1-based indexing) bit in ip be flipped?
+ * returns !( used_i(a_1 a_2 ... a_{i-1}0)
+ *	&&  used_i(a_1 a_2 ... a_{i-1}1) )
+ * where ip = a_1 a_2 ...
+ *
+ * The answers for all positions are returned at once as a word with
+ * bit i-1 (counted from the most significant bit) set if the i-th bit
+ * can be flipped. The tree is descended only once along ip: the node
+ * reached after i-1 steps decides position i, and the walk ends at a
+ * complete or missing node, below which nothing can be flipped.
+ */
+
+static uint32_t
+canflip(anon_ipv4_t *a, const in_addr_t ip)
+{
+    struct anon_node* nodep; /* current node */
+    uint32_t i = 0;
+    uint32_t addr = ntohl(ip), mask = 0;
+    int n;
+
+    if (a->ptrie) {
+	return anon_poptrie_canflip(a->ptrie, addr);
+    }
+    if (a->bitmap) {
+	return anon_bitmap_canflip(a->bitmap, addr);
+    }
+    for (n = 0; n < IPv4LENGTH; n++) {
+	nodep = anon_node(&a->tree, i);
+	if (nodep->complete) {
+	    break;
+	}
+	if (! (nodep->left && nodep->right)) {
+	    mask |= (uint32_t) 0x80000000 >> n;
+	}
+	i = (addr & ((uint32_t) 0x80000000 >> n))
+	    ? nodep->right : nodep->left;
+	if (! i) {
+	    break;
+	}
+    }
+    return mask;
+}
+
+unsigned
+anon_ipv4_nodes_count(anon_ipv4_t *a)
+{
+    return a->nodes;
+}
+
+int
+canflipv4_count_ip(anon_ipv4_t *a)
+{
+    int n = 0;
+    if (a->tree.size) {
+	canflip_count_n(&a->tree, 0, &n, 0);
+    }
+    return n;
+}
+
+/* warning: not tested with complete !!! */
+static void
+canflip_count_n(anon_nodes_t *t, uint32_t i, int* n, int level) {
+    struct anon_node* p = anon_node(t, i);
+
+    if (p->complete) {
+	/* number of addresses in subtree */
+	//(*n) += (int) powl(2,IPv4LENGTH-level-1);
+	(*n) += 2 << (IPv4LENGTH-level-1);
+	(*n) ++;
+	return;
+    }
+    if (!(p->left) && !(p->right)) {
+	(*n)++;
+    }
+    if (p->left)
+	canflip_count_n(t, p->left, n,level+1);
+    if (p->right)
+	canflip_count_n(t, p->right, n, level+1);
+}
+
+
+/*
+ * Compute the first len bits of the pseudorandom one-time-pads for
+ * the n (at most IPv4BATCH) addresses in ip; the other bits of the
+ * pads are zero. For each prefix with length from 0 to len-1, a bit
+ * is generated using the Rijndael cipher, which is used as a
+ * pseudorandom function here. The bits generated in every round are
+ * combined into the pad. The bits of the first pdepth rounds are
+ * taken from the precomputed table and the bits of the first
+ * CACHEDEPTH rounds may be found in the prefix cache. Addresses in
+ * precomputed CIDR blocks need no rounds at all. The inputs of
+ * the remaining rounds do not depend on each other, so all of them
+ * are built first and encrypted with a single multi-block call.
+ */
+
+static void
+otp(anon_ipv4_t *a, const in_addr_t *ip, uint32_t *pad, const size_t n,
+    const int len)
+{
+    uint8_t rin_output[IPv4BATCH*IPv4LENGTH][16];
+    uint8_t rin_input[IPv4BATCH*IPv4LENGTH][16];
+    int pos, from[IPv4BATCH], miss[IPv4BATCH];
+    size_t j, nb, off[IPv4BATCH];
+    const uint32_t *p;
+    uint32_t addr;
+    uint64_t v;
+
+    for (j = 0, nb = 0; j < n; j++) {
+	pad[j] = 0;
+	from[j] = a->pdepth;
+	miss[j] = 0;
+	if (a->ncidr && (p = cidr_lookup(a, ip[j]))) {
+	    pad[j] = ntohl(*p);
+	    from[j] = IPv4LENGTH;
+	    off[j] = nb;
+	    continue;
+	}
+	if (a->cache && a->pdepth < CACHEDEPTH) {
+	    if (anon_cache_get(a->cache, PINDEX(ip[j], CACHEDEPTH), &v)) {
+		pad[j] = (uint32_t) v << (IPv4LENGTH - CACHEDEPTH);
+		from[j] = CACHEDEPTH;
+	    } else {
+		miss[j] = 1;
+	    }
+	}
+	if (from[j] == a->pdepth && a->pdepth) {
+	    pad[j] = ptable_pad(a, ip[j]);
+	}
+	off[j] = nb;
+	addr = ntohl(ip[j]);
+	for (pos = from[j]; pos < len; pos++) {
+	    pp32_prf_input(addr, a->m_pad, a->mpad, pos, rin_input[nb++]);
+	}
+    }
+
+    /* Encryption: The Rijndael cipher is used as pseudorandom
+     * function. During each round, only the first bit of
+     * rin_output is used.
+     */
+    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], nb);
+
+    /* Combination: the bits are combined into a pseudorandom
+     *  one-time-pad
+     */
+    for (j = 0; j < n; j++) {
+	if (from[j] < len) {
+	    pad[j] |= pp32_bits((const uint8_t (*)[16]) rin_output + off[j],
+				from[j], len);
+	}
+	/* table, cache and CIDR blocks may provide more than len bits */
+	pad[j] &= pp32_mask(len);
+	if (miss[j] && len >= CACHEDEPTH) {
+	    anon_cache_put(a->cache, PINDEX(ip[j], CACHEDEPTH),
+			   pad[j] >> (IPv4LENGTH - CACHEDEPTH));
+	}
+    }
+}
+
+/*
+ * prefix-preserving anonymization on ip
+ * ip and aip are expected in network byte order (as returned by inet_pton
+ * slightly modified version of PAnonymizer::anonymize() from Crypto-PAn
+ */
+int
+anon_ipv4_map_pref(anon_ipv4_t *a, const in_addr_t ip, in_addr_t *aip)
+{
+    uint32_t pad;
+
+    assert(a);
+
+    otp(a, &ip, &pad, 1, IPv4LENGTH);
+
+    /* XOR the orginal address with the pseudorandom one-time-pad */
+    *aip = htonl(ntohl(ip) ^ pad);
+    return 0;
+}
+
+/*
+ * prefix-preserving anonymization of the prefix ip/prefixlen, e.g., a
+ * route or an ACL entry. Only the first prefixlen PRF rounds are run
+ * and the bits beyond prefixlen are copied unchanged. The anonymized
+ * prefix equals the first prefixlen bits of anon_ipv4_map_pref().
+ */
+
+int
+anon_ipv4_map_prefix(anon_ipv4_t *a, const in_addr_t ip,
+		     const int prefixlen, in_addr_t *aip)
+{
+    uint32_t pad;
+
+    assert(a);
+
+    if (prefixlen < 0 || prefixlen > IPv4LENGTH) {
+	return -1;
+    }
+
+    otp(a, &ip, &pad, 1, prefixlen);
+    *aip = htonl(ntohl(ip) ^ pad);
+    return 0;
+}
+
+/*
+ * prefix-preserving anonymization of n addresses at once. The PRF
+ * rounds of IPv4BATCH addresses are interleaved and handed to the
+ * cipher in a single call, which amortizes the per-call overhead and
+ * keeps the wide (VAES) kernels busy. ip and aip may point to the
+ * same array.
+ */
+
+int
+anon_ipv4_map_pref_batch(anon_ipv4_t *a, const in_addr_t *ip,
+			 in_addr_t *aip, const size_t n)
+{
+    uint32_t pad[IPv4BATCH];
+    size_t k, j, m;
+
+    assert(a);
+
+    for (k = 0; k < n; k += m) {
+	m = (n - k < IPv4BATCH) ? n - k : IPv4BATCH;
+	otp(a, ip + k, pad, m, IPv4LENGTH);
+	for (j = 0; j < m; j++) {
+	    aip[k+j] = htonl(ntohl(ip[k+j]) ^ pad[j]);
+	}
+    }
+    return 0;
+}
+
+static int
+u64_cmp(const void *p, const void *q)
+{
+    const uint64_t x = *(const uint64_t *) p, y = *(const uint64_t *) q;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * prefix-preserving anonymization of n addresses at once, evaluating
+ * each distinct PRF block only once. The addresses are sorted and
+ * walked as an implicit prefix trie: if an address shares its first
+ * l bits with its predecessor, the flip bits of the positions 0..l are
+ * the same and only the positions l+1..31 need cipher calls. The new
+ * blocks of many addresses are encrypted in a single call and the
+ * results are scattered back in input order. Only the precomputed
+ * table is used; the trie walk makes the cache and CIDR blocks
+ * redundant. ip and aip may point to the same array.
+ */
+
+int
+anon_ipv4_map_pref_trie(anon_ipv4_t *a, const in_addr_t *ip,
+			in_addr_t *aip, const size_t n)
+{
+    uint8_t rin_output[TRIEBLOCKS][16];
+    uint8_t rin_input[TRIEBLOCKS][16];
+    uint8_t from[TRIEBLOCKS];
+    uint64_t *sorted;
+    uint32_t addr, prev = 0, pad = 0;
+    size_t i, j, k, nb, m;
+    int pos, l, f;
+
+    assert(a);
+
+    /* index in the low and address in the high 32 bits */
+    m = n < 0xffffffff ? n : 0xffffffff;
+    sorted = (uint64_t *) malloc((m ? m : 1) * sizeof(uint64_t));
+    if (! sorted) {
+	return -1;
+    }
+    for (i = 0; i < m; i++) {
+	sorted[i] = ((uint64_t) ntohl(ip[i]) << 32) | i;
+    }
+    qsort(sorted, m, sizeof(uint64_t), u64_cmp);
+
+    for (i = 0; i < m; i = k) {
+
+	/* collect the new blocks of as many addresses as fit */
+	for (k = i, nb = 0; k < m && k - i < TRIEBLOCKS; k++) {
+	    addr = sorted[k] >> 32;
+	    for (l = 0; l < IPv4LENGTH
+		     && ! ((addr ^ prev) & (0x80000000 >> l)); l++) ;
+	    f = (k == 0) ? 0 : (l < IPv4LENGTH) ? l + 1 : IPv4LENGTH;
+	    if (f < a->pdepth) {
+		f = a->pdepth;
+	    }
+	    if (f < IPv4LENGTH && nb + IPv4LENGTH - f > TRIEBLOCKS) {
+		break;
+	    }
+	    from[k - i] = f;
+	    for (pos = f; pos < IPv4LENGTH; pos++) {
+		pp32_prf_input(addr, a->m_pad, a->mpad, pos, rin_input[nb++]);
+	    }
+	    prev = addr;
+	}
+	anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], nb);
+
+	/* combine the shared and the new bits and scatter the results */
+	for (j = i, nb = 0; j < k; j++) {
+	    f = from[j - i];
+	    if (a->pdepth && f == a->pdepth) {
+		pad = ptable_pad(a, htonl(sorted[j] >> 32));
+	    } else {
+		pad &= pp32_mask(f);
+	    }
+	    if (f < IPv4LENGTH) {
+		pad |= pp32_bits((const uint8_t (*)[16]) rin_output + nb,
+				 f, IPv4LENGTH);
+		nb += IPv4LENGTH - f;
+	    }
+	    aip[sorted[j] & 0xffffffff] = htonl((uint32_t) (sorted[j] >> 32)
+						^ pad);
+	}
+    }
+    free(sorted);
+
+    if (m < n) {
+	return anon_ipv4_map_pref_trie(a, ip + m, aip + m, n - m);
+    }
+    return 0;
+}
+
+/*
+ * prefix-preserving anonymization of n addresses with each of the k
+ * anonymization objects in a (usually set up with different keys).
+ * The results of a[j] are stored in the array aip[j]. The addresses
+ * are processed in chunks of IPv4BATCH, which are mapped with all k
+ * objects while they are still in the cache, so that input only
+ * needs to be parsed once for all keys.
+ */
+
+int
+anon_ipv4_map_pref_multi(anon_ipv4_t **a, const size_t k,
+			 const in_addr_t *ip, in_addr_t **aip, const size_t n)
+{
+    size_t i, j, m;
+
+    assert(a && aip);
+
+    for (i = 0; i < n; i += m) {
+	m = (n - i < IPv4BATCH) ? n - i : IPv4BATCH;
+	for (j = 0; j < k; j++) {
+	    (void) anon_ipv4_map_pref_batch(a[j], ip + i, aip[j] + i, m);
+	}
+    }
+    return 0;
+}
+
+/*
+ * Materialization of the lex mapping: once all used prefixes are
+ * known, the mapping of every one of them is fixed by the used_i
+ * tree. The tree is first flattened into its nodes in preorder and
+ * released, so that the following passes run over memory
+ * sequentially. The second pass evaluates the flip bit of every
+ * node with a single child exactly once (nodes with two children
+ * flip nothing); the cipher inputs are collected and encrypted
+ * TRIEBLOCKS at a time. The third pass emits the complete nodes,
+ * i.e., the used prefixes, with their anonymized prefixes in
+ * ascending order. A node's prefix follows from its parent's, which
+ * is the closest preceding node of smaller depth.
+ */
+
+static void
+flatten(anon_nodes_t *tree, const uint32_t i, const int depth,
+	const uint8_t right, struct anon_step *s, size_t *n)
+{
+    struct anon_node *p = anon_node(tree, i);
+    struct anon_step *t = s + (*n)++;
+
+    t->depth = depth;
+    t->flags = right ? ANON_STEP_RIGHT : 0;
+    if (p->complete) {
+	t->flags |= ANON_STEP_COMPLETE;
+	return;
+    }
+    if (! (p->left && p->right)) {
+	t->flags |= ANON_STEP_SINGLE;
+    }
+    if (p->left) {
+	flatten(tree, p->left, depth + 1, 0, s, n);
+    }
+    if (p->right) {
+	flatten(tree, p->right, depth + 1, 1, s, n);
+    }
+}
+
+/* prefix of step t given the prefix of the step before it */
+
+static inline uint32_t
+step_net(const uint32_t net, const struct anon_step *t)
+{
+    if (t->depth == 0) {
+	return 0;
+    }
+    return (net & pp32_mask(t->depth - 1))
+	| ((t->flags & ANON_STEP_RIGHT) ? 0x80000000 >> (t->depth - 1) : 0);
+}
+
+static void
+step_encrypt(anon_ipv4_t *a, const uint8_t (*rin_input)[16],
+	     struct anon_step **wait, const size_t m)
+{
+    uint8_t rin_output[TRIEBLOCKS][16];
+    size_t k;
+
+    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], m);
+    for (k = 0; k < m; k++) {
+	wait[k]->flags |= (rin_output[k][0] >> 7) * ANON_STEP_FLIP;
+    }
+}
+
+static void
+step_flips(anon_ipv4_t *a, struct anon_step *s, const size_t n)
+{
+    uint8_t rin_input[TRIEBLOCKS][16];
+    struct anon_step *wait[TRIEBLOCKS];
+    uint32_t net = 0;
+    size_t i, m = 0;
+
+    for (i = 0; i < n; i++) {
+	net = step_net(net, &s[i]);
+	if (! (s[i].flags & ANON_STEP_SINGLE)) {
+	    continue;
+	}
+	if (s[i].depth < a->pdepth) {
+	    s[i].flags |= ((ptable_pad(a, htonl(net)) << s[i].depth) >> 31)
+		* ANON_STEP_FLIP;
+	    continue;
+	}
+	pp32_prf_input(net, a->m_pad, a->mpad, s[i].depth, rin_input[m]);
+	wait[m++] = &s[i];
+	if (m == TRIEBLOCKS) {
+	    step_encrypt(a, (const uint8_t (*)[16]) rin_input, wait, m);
+	    m = 0;
+	}
+    }
+    if (m) {
+	step_encrypt(a, (const uint8_t (*)[16]) rin_input, wait, m);
+    }
+}
+
+/*
+ * Compute the lex mapping of all used prefixes at once into a new
+ * sorted table and store it in *lexp and its size in *nlexp. The
+ * used set is released as soon as it has been flattened unless keep
+ * is set.
+ */
+
+static int
+lex_build(anon_ipv4_t *a, const int keep, struct lex **lexp, size_t *nlexp)
+{
+    struct anon_step *s;
+    struct lex *lex, *e;
+    uint32_t net = 0, pad = 0;
+    size_t i, n = 0;
+
+    s = (struct anon_step *) malloc(a->nodes * sizeof(struct anon_step));
+    lex = (struct lex *) malloc((a->prefixes ? a->prefixes : 1)
+				* sizeof(struct lex));
+    if (! s || ! lex) {
+	free(s);
+	free(lex);
+	return -1;
+    }
+    if (a->ptrie) {
+	n = anon_poptrie_flatten(a->ptrie, s);
+    } else if (a->bitmap) {
+	n = anon_bitmap_flatten(a->bitmap, s);
+    } else {
+	flatten(&a->tree, 0, 0, 0, s, &n);
+    }
+    if (! keep) {
+	used_clear(a);
+    }
+    step_flips(a, s, n);
+
+    for (i = 0, e = lex; i < n; i++) {
+	net = step_net(net, &s[i]);
+	pad &= pp32_mask(s[i].depth);
+	if (s[i].flags & ANON_STEP_COMPLETE) {
+	    e->net = net;
+	    e->anet = net ^ pad;
+	    e->prefixlen = s[i].depth;
+	    e++;
+	} else if (s[i].flags & ANON_STEP_FLIP) {
+	    pad |= 0x80000000 >> s[i].depth;
+	}
+    }
+    free(s);
+
+    *nlexp = e - lex;
+    *lexp = (struct lex *) realloc(lex, (*nlexp ? *nlexp : 1)
+				   * sizeof(struct lex));
+    if (! *lexp) {
+	*lexp = lex;
+    }
+    return 0;
+}
+
+/*
+ * Compute the lex mapping of all used prefixes at once and replace
+ * the used_i tree by the sorted table of the results, which
+ * anon_ipv4_map_pref_lex() then searches. The table takes 12 bytes
+ * per used prefix instead of up to 32 tree nodes. The used set can
+ * not be extended afterwards.
+ */
+
+int
+anon_ipv4_materialize_lex(anon_ipv4_t *a)
+{
+    struct lex *lex;
+    size_t nlex;
+
+    assert(a);
+
+    if (USED_GONE(a)) {
+	return 0;
+    }
+    if (lex_build(a, 0, &lex, &nlex) != 0) {
+	return -1;
+    }
+    if (a->lex) {
+	free(a->lex);
+    }
+    a->lex = lex;
+    a->nlex = nlex;
+    return 0;
+}
+
+/*
+ * Find the used prefix covering ip (host byte order) in the sorted
+ * table lex of n prefixes by a binary search. Returns NULL if ip is
+ * not covered.
+ */
+
+static inline const struct lex*
+lex_lookup(const struct lex *lex, const size_t n, const uint32_t ip)
+{
+    size_t lo = 0, hi = n, mid;
+    const struct lex *e;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (ip < lex[mid].net) {
+	    hi = mid;
+	} else {
+	    lo = mid + 1;
+	}
+    }
+    if (lo == 0) {
+	return NULL;
+    }
+    e = &lex[lo - 1];
+    return ((ip ^ e->net) & pp32_mask(e->prefixlen)) ? NULL : e;
+}
+
+/*
+ * The table depends on the key: rebuild the used_i tree from the
+ * used prefixes and materialize it again. If that fails, the tree
+ * (or nothing) is left.
+ */
+
+static void
+lex_rekey(anon_ipv4_t *a)
+{
+    unsigned nodes = a->nodes;
+    size_t i;
+    int err = 0;
+
+    a->prefixes = 0;
+    err = used_init(a);
+    if (! err) {
+	for (i = 0; i < a->nlex && ! err; i++) {
+	    err = anon_ipv4_set_used(a, htonl(a->lex[i].net),
+				     a->lex[i].prefixlen);
+	}
+    }
+    a->nodes = nodes;
+    if (err || anon_ipv4_materialize_lex(a) != 0) {
+	free(a->lex);
+	a->lex = NULL;
+	a->nlex = 0;
+	if (err) {
+	    used_clear(a);
+	}
+    }
+}
+
+/*
+ * prefix- and lexicographical-order-preserving anonymization on
+ * ip. After anon_ipv4_materialize_lex(), the result is looked up and
+ * addresses outside of the used prefixes can not be mapped.
+ */
+
+int
+anon_ipv4_map_pref_lex(anon_ipv4_t *a, const in_addr_t ip, in_addr_t *aip)
+{
+    const struct version *v;
+    const struct lex *e;
+    unsigned epoch;
+    uint32_t pad;
+
+    assert(a);
+
+    if (anon_rcu_published(&a->rcu)) {
+	v = anon_rcu_enter(&a->rcu, &epoch);
+	e = lex_lookup(v->lex, v->nlex, ntohl(ip));
+	if (e) {
+	    *aip = htonl(e->anet | (ntohl(ip) & ~pp32_mask(e->prefixlen)));
+	}
+	anon_rcu_leave(&a->rcu, epoch);
+	return e ? 0 : -1;
+    }
+    if (a->lex) {
+	e = lex_lookup(a->lex, a->nlex, ntohl(ip));
+	if (! e) {
+	    return -1;
+	}
+	*aip = htonl(e->anet | (ntohl(ip) & ~pp32_mask(e->prefixlen)));
+	return 0;
+    }
+    if (USED_GONE(a)) {
+	return -1;
+    }
+
+    otp(a, &ip, &pad, 1, IPv4LENGTH);
+
+    /* combine with used_i */
+    pad &= canflip(a, ip);
+
+    /* XOR the orginal address with the pseudorandom one-time-pad */
+    *aip = htonl(ntohl(ip) ^ pad);
+    return 0;
+}
+
+/*
+ * Freeze a for concurrent mapping. The lex mapping is materialized,
+ * so that no more addresses can be marked as used, and the prefix
+ * cache is released, since every lookup reorders it under a lock
+ * that all mapping threads would contend for. The map functions
+ * only read a afterwards and can be called by any number of threads
+ * at once; anon_ipv4_map_pref_lex() fails for addresses outside of
+ * the used prefixes. Fails (and leaves a unfrozen) if the lex
+ * mapping can not be materialized.
+ */
+
+int
+anon_ipv4_freeze(anon_ipv4_t *a)
+{
+    assert(a);
+
+    if (anon_ipv4_materialize_lex(a) != 0) {
+	return -1;
+    }
+    return anon_ipv4_set_cache(a, 0);
+}
+
+static void
+version_free(struct version *v)
+{
+    if (v) {
+	free(v->lex);
+	free(v);
+    }
+}
+
+/*
+ * Publish the lex mapping of the used set as it is now for readers
+ * in other threads. The mapping is computed into a new table while
+ * readers keep using the previous one; the table is then switched
+ * atomically and the previous one is released once no reader uses
+ * it anymore. From the first call on, anon_ipv4_map_pref_lex() maps
+ * with the published table only and never blocks. The used set is
+ * kept, so more addresses can be marked as used and published again.
+ * A materialized lex mapping is published as it is.
+ */
+
+int
+anon_ipv4_publish(anon_ipv4_t *a)
+{
+    struct version *v;
+    int err = 0;
+
+    assert(a);
+
+    v = (struct version *) malloc(sizeof(struct version));
+    if (! v) {
+	return -1;
+    }
+    if (! USED_GONE(a)) {
+	err = lex_build(a, 1, &v->lex, &v->nlex);
+    } else if (a->lex) {
+	v->nlex = a->nlex;
+	v->lex = (struct lex *) malloc((a->nlex ? a->nlex : 1)
+				       * sizeof(struct lex));
+	if (v->lex) {
+	    memcpy(v->lex, a->lex, a->nlex * sizeof(struct lex));
+	}
+	err = v->lex ? 0 : -1;
+    } else {
+	err = -1;
+    }
+    if (err) {
+	free(v);
+	return -1;
     }
+    version_free(anon_rcu_publish(&a->rcu, v));
     return 0;
 }
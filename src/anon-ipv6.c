@@ -15,10 +15,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <openssl/aes.h>
+#include <limits.h>
 #include <openssl/sha.h>
 
 #include "libanon.h"
+#include "anon-aes.h"
+#include "anon-cache.h"
+#include "anon-node.h"
+#include "anon-patricia.h"
+#include "anon-sorted.h"
+#include "anon-pcache.h"
+#include "anon-rcu.h"
+#include "anon-pp.h"
 
 /*
  * WARNING: We are using the 1-based indexing for bits of IP address,
@@ -26,44 +34,183 @@
  * research final report)
  */
 
-/* structure for internal used_i tree */
-struct node {
-    char complete; /* if complete subtree below node is used */
-    struct node* left;
-    struct node* right;
-    struct node* parent;
+/*
+ * Address formats with an embedded IPv4 address: IPv4-mapped
+ * (::ffff:0:0/96), NAT64 (64:ff9b::/96) and 6to4 (2002::/16). off is
+ * the bit position of the IPv4 address.
+ */
+
+static const struct embed {
+    uint8_t prefix[16];
+    int off;
+} embeds[] = {
+    { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff }, 96 },
+    { { 0x00, 0x64, 0xff, 0x9b }, 96 },
+    { { 0x20, 0x02 }, 16 },
 };
 
+#define EMBEDS (sizeof(embeds) / sizeof(embeds[0]))
+
 struct _anon_ipv6 {
-    struct node *tree;
-    unsigned nodes;
-    AES_KEY aes_key;	/* AES key */
+    int used;		/* representation of the used set */
+    anon_nodes_t tree;	/* used_i tree, the root at index 0 */
+    anon_patricia_t *ptree; /* used set as a path-compressed tree */
+    anon_sorted_t *sorted; /* used set as a sorted array */
+    unsigned nodes;	/* nodes of the (binary) used_i tree */
+    size_t prefixes;	/* complete nodes (more if some were covered) */
+    anon_aes_t aes;	/* AES (Rijndael) cipher */
     uint8_t m_key[16];	/* 128 bit secret key */
     uint8_t m_pad[16];	/* 128 bit secret pad */
+#ifdef ANON_PP_U128
+    anon_u128_t mpad;	/* m_pad as a word */
+#endif
+    int iid;		/* treatment of the interface identifier */
+    anon_aes_t iid_aes;	/* cipher keyed for hashing identifiers */
+    anon_cache_t *cache; /* partial pads of recently seen /64s */
+    size_t cache_size;	/* maximum number of cache entries */
+    anon_pcache_t *pcache; /* results of previous runs */
+    anon_ipv4_t *ipv4;	/* maps embedded IPv4 addresses if set */
+    uint8_t embed_pad[EMBEDS][16]; /* pads of the embedding prefixes */
+    struct lex *lex;	/* materialized lex mapping (sorted) */
+    size_t nlex;	/* number of materialized used prefixes */
+    anon_rcu_t rcu;	/* published lex mapping (struct version) */
+};
+
+/* used prefix with its materialized lex mapping */
+struct lex {
+    in6_addr_t net;
+    in6_addr_t anet;	/* anonymized prefix */
+    int prefixlen;
+};
+
+/* published version of the lex mapping, see anon_ipv6_publish() */
+struct version {
+    struct lex *lex;
+    size_t nlex;
 };
 
 #define IPv6LENGTH 128
 
-static int canflip(anon_ipv6_t *a, const in6_addr_t ip, const int prefixlen);
-static void delete_node(struct node* n);
-static struct node* add_new_node(struct node* parent, int right);
-static void canflip_count_n(struct node* p,int* n, int level);
+static int canflip(anon_ipv6_t *a, const in6_addr_t *ip, uint8_t *pos);
+static void canflip_count_n(anon_nodes_t *t, uint32_t i, int* n,
+			    int level);
+static void embed_init(anon_ipv6_t *a);
+static void lex_rekey(anon_ipv6_t *a);
+static void version_free(struct version *v);
+static int lcp(const uint8_t *x, const uint8_t *y);
 
 /*
- * Node allocator and deallocator (factored out to experiment with
- * different allocators).
+ * Build the pseudorandom function input for prefix length pos: The
+ * most significant pos bits are taken from ip. The other 128-pos bits
+ * are taken from m_pad. With a native 128-bit integer type, this is
+ * done with word masks (see anon-pp.h) on the address loaded once by
+ * PRF_ADDR().
  */
 
-static inline struct node*
-node_alloc()
+#ifdef ANON_PP_U128
+
+ANON_PP_DEFINE(pp128, IPv6LENGTH, anon_u128_t)
+
+typedef anon_u128_t prf_addr_t;
+#define PRF_ADDR(ip)	pp128_load((ip)->s6_addr)
+
+static inline void
+prf_input(anon_ipv6_t *a, const prf_addr_t addr, const int pos,
+	  uint8_t *rin_input)
+{
+    pp128_prf_input(addr, a->m_pad, a->mpad, pos, rin_input);
+}
+
+#else
+
+typedef const in6_addr_t *prf_addr_t;
+#define PRF_ADDR(ip)	(ip)
+
+static inline void
+prf_input(anon_ipv6_t *a, const prf_addr_t ip, const int pos,
+	  uint8_t *rin_input)
 {
-    return (struct node*) malloc(sizeof(struct node));
+    int i;
+
+    for(i=0;i<pos/8;i++) {
+	rin_input[i] = ip->s6_addr[i];
+    }
+    rin_input[pos/8] = (ip->s6_addr[pos/8] >> (8-pos%8)) << (8-pos%8);
+    rin_input[pos/8] |= ((a->m_pad[pos/8] << (pos%8)) & 0xff) >> (pos%8);
+    for(i=(pos/8)+1;i<16;i++) {
+	rin_input[i] = a->m_pad[i];
+    }
 }
 
+#endif
+
+/*
+ * OR the flip bits of the rounds from..to-1 into pad; rin_output
+ * holds the cipher outputs of these rounds.
+ */
+
 static inline void
-node_free(struct node* n)
+add_bits(uint8_t *pad, const uint8_t (*rin_output)[16], const int from,
+	 const int to)
+{
+    int pos;
+
+#ifdef ANON_PP_U128
+    if (to - from > 8) {
+	pp128_store(pp128_load(pad) | pp128_bits(rin_output, from, to), pad);
+	return;
+    }
+#endif
+    for (pos = from; pos < to; pos++) {
+	pad[pos/8] |= (rin_output[pos - from][0] >> 7) << (7-(pos%8));
+    }
+}
+
+/*
+ * Create the empty used set (the used_i tree with just its root) in
+ * the representation selected for a, or release it. The used set
+ * is gone once the lex mapping has been materialized.
+ */
+
+static int
+used_init(anon_ipv6_t *a)
+{
+    a->nodes = 1;
+    if (a->used == ANON_IPV6_USED_PATRICIA) {
+	a->ptree = anon_patricia_new();
+	return a->ptree ? 0 : -1;
+    }
+    if (a->used == ANON_IPV6_USED_ARRAY) {
+	a->sorted = anon_sorted_new();
+	return a->sorted ? 0 : -1;
+    }
+    return anon_nodes_init(&a->tree);
+}
+
+static void
+used_clear(anon_ipv6_t *a)
+{
+    anon_patricia_delete(a->ptree);
+    a->ptree = NULL;
+    anon_sorted_delete(a->sorted);
+    a->sorted = NULL;
+    anon_nodes_clear(&a->tree);
+}
+
+#define USED_GONE(a)	(! (a)->tree.size && ! (a)->ptree && ! (a)->sorted)
+
+/*
+ * Bring the node and prefix counts up to date. The sorted array is
+ * only sorted (and counted) when the used set is queried.
+ */
+
+static int
+used_build(anon_ipv6_t *a)
 {
-    free(n);
+    if (a->sorted) {
+	return anon_sorted_build(a->sorted, &a->nodes, &a->prefixes);
+    }
+    return 0;
 }
 
 /*
@@ -72,30 +219,51 @@ node_free(struct node* n)
 
 anon_ipv6_t*
 anon_ipv6_new()
+{
+    return anon_ipv6_new_used(ANON_IPV6_USED_TREE);
+}
+
+/*
+ * Create a new IP anonymization object with the given representation
+ * of the used set (lex mode). ANON_IPV6_USED_TREE is a binary tree
+ * with a node per address bit. ANON_IPV6_USED_PATRICIA is a
+ * path-compressed tree, which stores at most two nodes per used
+ * address instead of up to 128. ANON_IPV6_USED_ARRAY is a sorted
+ * array of the used prefixes, 17 bytes per prefix.
+ */
+
+anon_ipv6_t*
+anon_ipv6_new_used(const int used)
 {
     anon_ipv6_t *a;
 
+    if (used != ANON_IPV6_USED_TREE && used != ANON_IPV6_USED_PATRICIA
+	&& used != ANON_IPV6_USED_ARRAY) {
+	return NULL;
+    }
+
     a = (anon_ipv6_t *) malloc(sizeof(anon_ipv6_t));
     if (! a) {
 	return NULL;
     }
     memset(a, 0, sizeof(anon_ipv6_t));
-    a->tree = node_alloc();
-    if (!a->tree) {
+    a->used = used;
+    anon_rcu_init(&a->rcu);
+    if (used_init(a) != 0) {
+	used_clear(a);
+	anon_rcu_cleanup(&a->rcu);
 	free(a);
 	return NULL;
     }
-    a->tree->parent = NULL;
-    a->tree->left = NULL;
-    a->tree->right = NULL;
-    a->tree->complete = 0;
-    a->nodes = 1;
 
     /*
-     * initialize the AES (Rijndael) cipher
+     * initialize the AES (Rijndael) cipher with an all zero key
      * (in case user forgets to call ..._set_key)
      */
-    AES_set_encrypt_key(NULL, 0, &(a->aes_key));
+    if (anon_aes_init(&a->aes) != 0 || anon_aes_init(&a->iid_aes) != 0) {
+	anon_ipv6_delete(a);
+	return NULL;
+    }
 
     return a;
 }
@@ -111,9 +279,16 @@ anon_ipv6_delete(anon_ipv6_t *a)
 	return;
     }
 
-    if (a->tree) {
-	delete_node(a->tree);
+    used_clear(a);
+    anon_aes_cleanup(&a->aes);
+    anon_aes_cleanup(&a->iid_aes);
+    anon_cache_delete(a->cache);
+    anon_pcache_close(a->pcache);
+    if (a->lex) {
+	free(a->lex);
     }
+    version_free(a->rcu.current);
+    anon_rcu_cleanup(&a->rcu);
     free(a);
 }
 
@@ -126,6 +301,9 @@ anon_ipv6_delete(anon_ipv6_t *a)
 void
 anon_ipv6_set_key(anon_ipv6_t *a, const anon_key_t *key)
 {
+    static const uint8_t iid_label[16] = "libanon-ipv6-iid";
+    uint8_t iid_key[16];
+
     assert(a);
     assert(key);
     assert(key->key);
@@ -135,11 +313,111 @@ anon_ipv6_set_key(anon_ipv6_t *a, const anon_key_t *key)
     /* initialize the 128-bit secret key */
     memcpy(a->m_key, key->key, 16);
     /* initialize the AES (Rijndael) cipher */
-    AES_set_encrypt_key(key->key, 128, &(a->aes_key));
+    anon_aes_set_key(&a->aes, key->key);
     /* initialize the 128-bit secret pad. The pad is encrypted before
      * being used for padding. 
      */
-    AES_ecb_encrypt(key->key + 16, a->m_pad, &(a->aes_key), AES_ENCRYPT);
+    anon_aes_encrypt(&a->aes, key->key + 16, a->m_pad, 1);
+#ifdef ANON_PP_U128
+    a->mpad = pp128_load(a->m_pad);
+#endif
+    /* derive the key for hashing interface identifiers */
+    anon_aes_encrypt(&a->aes, iid_label, iid_key, 1);
+    anon_aes_set_key(&a->iid_aes, iid_key);
+    /* the cached pads depend on the key */
+    if (a->cache) {
+	(void) anon_ipv6_set_cache(a, a->cache_size);
+    }
+    if (a->ipv4) {
+	embed_init(a);
+    }
+    /* and so do the results in a cache file */
+    anon_pcache_close(a->pcache);
+    a->pcache = NULL;
+    if (a->lex) {
+	lex_rekey(a);
+    }
+    if (a->rcu.current) {
+	(void) anon_ipv6_publish(a);
+    }
+}
+
+/*
+ * Enable (or resize) a cache of at most size partial one-time-pads
+ * (the flip bits of the first 64 rounds) of recently seen /64
+ * prefixes. Addresses of one site usually share very few /64s and a
+ * cache hit saves 64 cipher calls. The cache may be shared by
+ * concurrent mapping threads. A size of 0 disables the cache.
+ */
+
+int
+anon_ipv6_set_cache(anon_ipv6_t *a, const size_t size)
+{
+    assert(a);
+
+    anon_cache_delete(a->cache);
+    a->cache = NULL;
+    a->cache_size = 0;
+    if (size) {
+	a->cache = anon_cache_new(size);
+	if (! a->cache) {
+	    return -1;
+	}
+	a->cache_size = size;
+    }
+    return 0;
+}
+
+/*
+ * Use the file filename as a persistent cache of anonymized
+ * addresses, creating it with room for size addresses if it does not
+ * exist. The file is tagged with a fingerprint of the key and the
+ * IID mode and cannot be used with other ones; changing the key or
+ * the IID mode closes it. The file may be shared by concurrent
+ * processes; writers are serialized with flock(2). Only complete
+ * addresses (not prefixes) are cached. The file holds the original
+ * addresses in the clear next to their anonymized ones and must be
+ * protected as strictly as the key. A NULL filename closes the file.
+ */
+
+int
+anon_ipv6_set_cache_file(anon_ipv6_t *a, const char *filename,
+			 const size_t size)
+{
+    uint8_t buf[sizeof(a->m_key) + sizeof(a->m_pad) + 1];
+    uint8_t md[SHA_DIGEST_LENGTH];
+
+    assert(a);
+
+    anon_pcache_close(a->pcache);
+    a->pcache = NULL;
+    if (! filename) {
+	return 0;
+    }
+
+    memcpy(buf, a->m_key, sizeof(a->m_key));
+    memcpy(buf + sizeof(a->m_key), a->m_pad, sizeof(a->m_pad));
+    buf[sizeof(buf) - 1] = a->iid;
+    SHA1(buf, sizeof(buf), md);
+    a->pcache = anon_pcache_open(filename, size, md);
+    return a->pcache ? 0 : -1;
+}
+
+/*
+ * Report the number of cache hits and misses.
+ */
+
+void
+anon_ipv6_cache_stats(anon_ipv6_t *a, uint64_t *hits, uint64_t *misses)
+{
+    assert(a);
+
+    if (a->cache) {
+	anon_cache_stats(a->cache, hits, misses);
+    } else {
+	if (hits) *hits = 0;
+	if (misses) *misses = 0;
+    }
 }
 
 /*
@@ -151,8 +429,8 @@ int
 anon_ipv6_set_used(anon_ipv6_t *a, const struct in6_addr ip,
 		   const int prefixlen) 
 {
-    struct node* nodep = a->tree; /* current node */
-    struct node* childp = NULL; /* child node to be followed */
+    struct anon_node* nodep; /* current node */
+    uint32_t childp; /* child node to be followed */
     int n = 0;
     int first_bit; /* first (most significant) bit of ip address */
     int pfl = prefixlen;
@@ -162,6 +440,22 @@ anon_ipv6_set_used(anon_ipv6_t *a, const struct in6_addr ip,
     /* this should be an assert */
     if (prefixlen > 128 || prefixlen < 1) pfl = 128;
 
+    /* the used set is fixed once it has been materialized */
+    if (USED_GONE(a)) {
+	return -1;
+    }
+    if (a->sorted) {
+	return anon_sorted_insert(a->sorted, ip.s6_addr, pfl);
+    }
+    if (a->ptree) {
+	n = anon_patricia_insert(a->ptree, ip.s6_addr, pfl, &a->nodes);
+	if (n > 0) {
+	    a->prefixes++;
+	}
+	return n < 0 ? -1 : 0;
+    }
+    nodep = anon_node(&a->tree, 0);
+
     while (n < pfl) {
 	// printf("n: %02d, ip: %d\n",n,ip >> n);
 	if (nodep->complete) {
@@ -177,62 +471,265 @@ anon_ipv6_set_used(anon_ipv6_t *a, const struct in6_addr ip,
 	}	    
 	if (!childp) {
 	    // printf("adding new node...\n");
-	    childp = add_new_node(nodep,first_bit);
-	    if (! childp) {
+	    childp = anon_nodes_alloc(&a->tree);
+	    if (childp == ANON_NODE_MAX) {
 		return -1;
 	    }
+	    /* nodep stays valid, chunks never move */
+	    if (first_bit) {
+		nodep->right = childp;
+	    } else {
+		nodep->left = childp;
+	    }
 	    a->nodes++;
 	}
-	nodep = childp;
+	nodep = anon_node(&a->tree, childp);
 	n++;
     }
-    nodep->complete = 1;
+    if (! nodep->complete) {
+	nodep->complete = 1;
+	a->prefixes++;
+    }
+    return 0;
+}
+
+/*
+ * Mark the n addresses ip[0..n-1] with prefix length prefixlen as
+ * used. A sorted array takes them all at once and sorts them when it
+ * is queried next.
+ */
+
+int
+anon_ipv6_set_used_array(anon_ipv6_t *a, const in6_addr_t *ip,
+			 const size_t n, const int prefixlen)
+{
+    size_t i;
+
+    assert(a);
+
+    if (a->sorted && anon_sorted_reserve(a->sorted, n) != 0) {
+	return -1;
+    }
+    for (i = 0; i < n; i++) {
+	if (anon_ipv6_set_used(a, ip[i], prefixlen) != 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Mark the n addresses ip[0..n-1] with prefix length prefixlen as
+ * used. The addresses should be sorted: each one is inserted from the
+ * deepest node it shares with the previous one (their lowest common
+ * ancestor) rather than from the root, and the new nodes are
+ * allocated in preorder. The resulting tree does not depend on the
+ * order.
+ */
+
+int
+anon_ipv6_set_used_sorted(anon_ipv6_t *a, const in6_addr_t *ip,
+			  const size_t n, const int prefixlen)
+{
+    uint32_t path[IPv6LENGTH + 1];	/* nodes along the previous address */
+    uint32_t child;
+    struct anon_node *nodep;
+    int pfl = prefixlen, d, depth = 0, bit;
+    size_t i;
+
+    assert(a);
+
+    if (prefixlen > 128 || prefixlen < 1) pfl = 128;
+
+    if (USED_GONE(a)) {
+	return -1;
+    }
+    if (! a->tree.size) {
+	return anon_ipv6_set_used_array(a, ip, n, pfl);
+    }
+
+    path[0] = 0;
+    for (i = 0; i < n; i++) {
+	d = i ? lcp(ip[i-1].s6_addr, ip[i].s6_addr) : 0;
+	if (d > depth) {
+	    d = depth;
+	}
+	for (; d < pfl; d++) {
+	    nodep = anon_node(&a->tree, path[d]);
+	    if (nodep->complete) {
+		break;
+	    }
+	    bit = ip[i].s6_addr[d / 8] & (0x80 >> (d % 8));
+	    child = bit ? nodep->right : nodep->left;
+	    if (! child) {
+		child = anon_nodes_alloc(&a->tree);
+		if (child == ANON_NODE_MAX) {
+		    return -1;
+		}
+		/* nodep stays valid, chunks never move */
+		if (bit) {
+		    nodep->right = child;
+		} else {
+		    nodep->left = child;
+		}
+		a->nodes++;
+	    }
+	    path[d + 1] = child;
+	}
+	depth = d;
+	nodep = anon_node(&a->tree, path[d]);
+	if (d == pfl && ! nodep->complete) {
+	    nodep->complete = 1;
+	    a->prefixes++;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Concurrent marking of used addresses: every thread marks addresses
+ * through a pool of its own, which allocates the thread's nodes. A
+ * new child is published with a compare-and-swap on the parent's
+ * child index; a thread losing the race follows the winner's child
+ * and keeps its node for the next allocation. Complete flags are set
+ * atomically. The tree ends up as after marking the same addresses
+ * one after the other. Only the binary tree can be shared; the pools
+ * must be created before the threads start and deleted after they
+ * are done, before the addresses are mapped.
+ */
+
+struct _anon_ipv6_pool {
+    anon_ipv6_t *a;
+    anon_nodes_pool_t nodes;	/* nodes of this thread */
+    uint32_t spare;		/* node that lost a race or 0 */
+    unsigned count;		/* nodes published */
+    size_t prefixes;		/* nodes marked complete */
+};
+
+anon_ipv6_pool_t*
+anon_ipv6_pool_new(anon_ipv6_t *a)
+{
+    anon_ipv6_pool_t *p;
+
+    assert(a);
+
+    if (! a->tree.size || anon_nodes_share(&a->tree) != 0) {
+	return NULL;
+    }
+    p = (anon_ipv6_pool_t *) malloc(sizeof(anon_ipv6_pool_t));
+    if (! p) {
+	return NULL;
+    }
+    memset(p, 0, sizeof(anon_ipv6_pool_t));
+    p->a = a;
+    anon_nodes_pool_init(&p->nodes, &a->tree);
+    return p;
+}
+
+int
+anon_ipv6_pool_set_used(anon_ipv6_pool_t *p, const in6_addr_t ip,
+		       const int prefixlen)
+{
+    anon_nodes_t *t = &p->a->tree;
+    struct anon_node *nodep;
+    uint32_t *childp, child, i = 0;
+    int n, pfl = prefixlen;
+
+    assert(p);
+
+    if (prefixlen > 128 || prefixlen < 1) pfl = 128;
+
+    for (n = 0; n < pfl; n++) {
+	nodep = anon_node(t, i);
+	if (__atomic_load_n(&nodep->complete, __ATOMIC_ACQUIRE)) {
+	    return 0;
+	}
+	childp = (ip.s6_addr[n / 8] & (0x80 >> (n % 8))) ? &nodep->right : &nodep->left;
+	child = __atomic_load_n(childp, __ATOMIC_ACQUIRE);
+	if (! child) {
+	    if (! p->spare) {
+		p->spare = anon_nodes_pool_alloc(&p->nodes);
+		if (p->spare == ANON_NODE_MAX) {
+		    p->spare = 0;
+		    return -1;
+		}
+	    }
+	    if (__atomic_compare_exchange_n(childp, &child, p->spare, 0,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE)) {
+		child = p->spare;
+		p->spare = 0;
+		p->count++;
+	    }
+	}
+	i = child;
+    }
+    nodep = anon_node(t, i);
+    if (! __atomic_exchange_n(&nodep->complete, 1, __ATOMIC_RELEASE)) {
+	p->prefixes++;
+    }
     return 0;
 }
 
+void
+anon_ipv6_pool_delete(anon_ipv6_pool_t *p)
+{
+    if (! p) {
+	return;
+    }
+    __atomic_fetch_add(&p->a->nodes, p->count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->a->prefixes, p->prefixes, __ATOMIC_RELAXED);
+    anon_nodes_pool_done(&p->nodes);
+    free(p);
+}
+
 /* 
  * can i-th (1-based indexing) bit in ip be flipped?
  * returns !( used_i(a_1 a_2 ... a_{i-1}0)
  *	&&  used_i(a_1 a_2 ... a_{i-1}1) )
- * where i = prefixlen and ip = a_1 a_2 ...
+ * where ip = a_1 a_2 ...
+ *
+ * The tree is descended only once along ip: the node reached after
+ * i-1 steps decides position i, and the walk ends at a complete or
+ * missing node, below which nothing can be flipped. The 0-based
+ * positions that can be flipped are stored in pos (in ascending
+ * order) and their number is returned.
  */
 
 static int
-canflip(anon_ipv6_t *a, const in6_addr_t ip, const int prefixlen)
+canflip(anon_ipv6_t *a, const in6_addr_t *ip, uint8_t *pos)
 {
-    struct node* nodep = a->tree; /* current node */
-    struct node* childp = NULL; /* child node to be followed */
-    int n = 0;
-    int pfl = prefixlen-1; /* need a_1 a_2 ... a_{i-1} [0,1] */
-    int first_bit; /* last bit of ip address - currently to be considered */
-    while (n < pfl) {
-	// printf("n: %02d, ip: %d\n",n,ip >> n);
+    struct anon_node* nodep; /* current node */
+    uint32_t i = 0;
+    int n, k = 0;
+
+    if (a->ptree) {
+	return anon_patricia_canflip(a->ptree, ip->s6_addr, pos);
+    }
+    if (a->sorted) {
+	return anon_sorted_canflip(a->sorted, ip->s6_addr, pos);
+    }
+    for (n = 0; n < IPv6LENGTH; n++) {
+	nodep = anon_node(&a->tree, i);
 	if (nodep->complete) {
-	    // printf("hit complete... (n=%d)\n",n);
-	    return 0;
+	    break;
 	}
-	first_bit = ip.s6_addr[n / 8] & (0x80 >> (n % 8));
-	if (first_bit) {
-	    childp = nodep->right;
-	} else {
-	    childp = nodep->left;
-	}	    
-	if (!childp) {
-	    // printf("not used...\n");
-	    return 0;
+	if (! (nodep->left && nodep->right)) {
+	    pos[k++] = n;
+	}
+	i = (ip->s6_addr[n / 8] & (0x80 >> (n % 8)))
+	    ? nodep->right : nodep->left;
+	if (! i) {
+	    break;
 	}
-	nodep = childp;
-	n++;
-    }
-    if (nodep->complete) {
-	// printf("last node is complete... (n=%d)\n",n);
     }
-    return ( !(nodep->left && nodep->right) && !nodep->complete);
+    return k;
 }
 
 unsigned
 anon_ipv6_nodes_count(anon_ipv6_t *a)
 {
+    (void) used_build(a);
     return a->nodes;
 }
 
@@ -240,15 +737,17 @@ int
 canflip_count_ipv6(anon_ipv6_t *a)
 {
     int n = 0;
-    canflip_count_n(a->tree, &n,0);
+    if (a->tree.size) {
+	canflip_count_n(&a->tree, 0, &n, 0);
+    }
     return n;
 }
 
 /* warning: not tested with complete !!! */
 static void
-canflip_count_n(struct node* p,int* n, int level) {
-    if (!p)
-	return;
+canflip_count_n(anon_nodes_t *t, uint32_t i, int* n, int level) {
+    struct anon_node* p = anon_node(t, i);
+
     if (p->complete) {
 	/* number of addresses in subtree */
 	//(*n) += (int) powl(2,IPv4LENGTH-level-1);
@@ -259,176 +758,920 @@ canflip_count_n(struct node* p,int* n, int level) {
     if (!(p->left) && !(p->right)) {
 	(*n)++;
     }
-    canflip_count_n(p->left, n,level+1);
-    canflip_count_n(p->right, n, level+1);
+    if (p->left)
+	canflip_count_n(t, p->left, n,level+1);
+    if (p->right)
+	canflip_count_n(t, p->right, n, level+1);
 }
 
 
 /*
- * creates new node and inserts it into the tree as a child of parent
- * if right is non-zero, it become a right child; left otherwise
- * returns pointer to the new child or NULL on error
+ * Prefix-preserving anonymization of the n (at most IPv6BATCH)
+ * prefixes ip[j]/prefixlen. For each prefix with length from 0 to
+ * prefixlen-1, a bit is generated using the Rijndael cipher, which is
+ * used as a pseudorandom function here. The bits generated in every
+ * round are combined into a pseudorandom one-time-pad, which is
+ * XORed with the address. The inputs of the rounds do not depend on
+ * each other, so all of them are built first and encrypted with a
+ * single multi-block call. The bits of the first 64 rounds may be
+ * found in the /64 cache. Unless the IID mode is ANON_IPV6_IID_PREF,
+ * at most 64 rounds are run and the interface identifier (the low 64
+ * bits) is kept, zeroed or hashed instead. ip and aip may point to
+ * the same array.
  */
 
-static struct node*
-add_new_node(struct node* parent, int right) {
-    if (!parent) {
-	return NULL;
-    }
-    if (parent->complete) {
-	return NULL;
-    }
-    
-    struct node* n = node_alloc();
-    if (!n) {
-	return NULL;
-    }
-    n->left = NULL;
-    n->right = NULL;
-    n->parent = parent;
-    n->complete = 0;
+#define IPv6BATCH 4
+#define IPv6IID 64
+#define TRIEBLOCKS 512
+#define EMBEDDED 255
 
-    if (right) {
-	n->right = parent->right;
-	parent->right = n;
-    } else {
-	n->left = parent->left;
-	parent->left = n;
+/*
+ * Replace the interface identifier of the anonymized address aip as
+ * selected by the IID mode; hash is the encrypted original address.
+ */
+
+static inline void
+iid(anon_ipv6_t *a, in6_addr_t *aip, const uint8_t *hash)
+{
+    if (a->iid == ANON_IPV6_IID_ZERO) {
+	memset(aip->s6_addr + IPv6IID/8, 0, 16 - IPv6IID/8);
+    } else if (a->iid == ANON_IPV6_IID_HASH) {
+	memcpy(aip->s6_addr + IPv6IID/8, hash, 16 - IPv6IID/8);
     }
-    return n;
 }
 
-static void
-delete_node(struct node* n) {
-    if (!n) return;
-    delete_node(n->left);
-    delete_node(n->right);
-    n->left = NULL;
-    n->right = NULL;
-    node_free(n);
+/* the first 64 bits of an address (or pad) as a cache key */
+
+static inline uint64_t
+prefix64(const uint8_t *c)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	v = (v << 8) | c[i];
+    }
+    return v;
 }
 
 /*
- * prefix-preserving anonymization on ip
- * slightly modified version of PAnonymizer::anonymize() from Crypto-PAn
+ * Compute the flip bits of the first plen positions of ip into pad.
  */
-int
-anon_ipv6_map_pref(anon_ipv6_t *a, const in6_addr_t ip, in6_addr_t *aip)
-{
-    uint8_t rin_output[16];
-    uint8_t rin_input[16];
-    int pos, i;
 
-    assert(a);
-
-    memset(aip, 0, sizeof(in6_addr_t));
-    memcpy(rin_input, a->m_pad, 16);
+static void
+prefix_pad(anon_ipv6_t *a, const in6_addr_t *ip, const int plen,
+	   uint8_t *pad)
+{
+    uint8_t rin_output[IPv6LENGTH][16];
+    uint8_t rin_input[IPv6LENGTH][16];
+    const prf_addr_t w = PRF_ADDR(ip);
+    int pos;
 
-    /* For each prefix with length from 0 to 31, generate a using
-     * bit the Rijndael cipher, which is used as a pseudorandom
-     * function here. The bits generated in every round are combined
-     * into a pseudorandom one-time-pad.
-     */
-    for (pos = 0; pos < 128 ; pos++) { 
-	/* Padding: The most significant pos bits are taken from
-	 * ip. The other 128-pos bits are taken from m_pad.
-	 */
-	for(i=0;i<pos/8;i++) {
-		rin_input[i] = ip.s6_addr[i];
-	}
-	rin_input[pos/8] = (ip.s6_addr[pos/8] >> (8-pos%8)) << (8-pos%8);
-	/* debugging output
-	fprintf(stderr, "pos: %d, pos/8: %d , rin_input[%d]: 0x%x, "
-		"rin_input[%d]: 0x%x, ip.s6_addr[%d]: 0x%x\n",
-		pos, pos/8, pos/8, rin_input[pos/8], 
-		(pos/8 > 0) ? pos/8-1 : 0, rin_input[(pos/8 > 0) ? pos/8-1:0],
-		(pos/8 > 0) ? pos/8-1:0, ip.s6_addr[(pos/8 > 0) ? pos/8-1:0]);
-	*/
-	rin_input[pos/8] |= ((a->m_pad[pos/8] << (pos%8)) & 0xff) >> (pos%8);
-	for(i=(pos/8)+1;i<16;i++) {
-	    rin_input[i] = a->m_pad[i];
-	}
-
-	/* Encryption: The Rijndael cipher is used as pseudorandom
-	 * function. During each round, only the first bit of
-	 * rin_output is used.
-	 */
-	AES_ecb_encrypt(rin_input, rin_output, &(a->aes_key), AES_ENCRYPT);
-	/* Combination: the bits are combined into a pseudorandom
-	 *  one-time-pad
-	 */
-	aip->s6_addr[pos/8] |=  (rin_output[0] >> 7) << (7-(pos%8));
+    memset(pad, 0, 16);
+    if (plen <= 0) {
+	return;
     }
-    /* XOR the orginal address with the pseudorandom one-time-pad */
-    for(i=0;i<16;i++) {
-	aip->s6_addr[i] = aip->s6_addr[i] ^ ip.s6_addr[i];
+    for (pos = 0; pos < plen; pos++) {
+	prf_input(a, w, pos, rin_input[pos]);
     }
-    return 0;
+    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], plen);
+    add_bits(pad, (const uint8_t (*)[16]) rin_output, 0, plen);
 }
 
 /*
- * prefix- and lexicographical-order-preserving anonymization on
- * ip
+ * The embedding prefixes are constant, hence so are their pads.
  */
 
-int
-anon_ipv6_map_pref_lex(anon_ipv6_t *a, const in6_addr_t ip, in6_addr_t *aip)
+static void
+embed_init(anon_ipv6_t *a)
 {
-    uint8_t rin_output[16];
-    uint8_t rin_input[16];
-    int pos, i;
+    in6_addr_t prefix;
+    size_t e;
 
-    assert(a);
+    for (e = 0; e < EMBEDS; e++) {
+	memcpy(prefix.s6_addr, embeds[e].prefix, 16);
+	prefix_pad(a, &prefix, embeds[e].off, a->embed_pad[e]);
+    }
+}
 
-    memset(aip, 0, sizeof(in6_addr_t));
-    memcpy(rin_input, a->m_pad, 16);
+/*
+ * Return the format of the embedded IPv4 address in ip/prefixlen or
+ * -1 if there is none.
+ */
 
-    /* For each prefix with length from 0 to 31, generate a using
-     * bit the Rijndael cipher, which is used as a pseudorandom
-     * function here. The bits generated in every round are combined
-     * into a pseudorandom one-time-pad.
-     */
-    for (pos = 0; pos < 128 ; pos++) { 
-	/* Padding: The most significant pos bits are taken from
-	 * ip. The other 128-pos bits are taken from m_pad.
-	 */
-	for(i=0;i<pos/8;i++) {
-		rin_input[i] = ip.s6_addr[i];
-	}
-	rin_input[pos/8] = (ip.s6_addr[pos/8] >> (8-pos%8)) << (8-pos%8);
-	/* debugging output
-	fprintf(stderr, "pos: %d, pos/8: %d , rin_input[%d]: 0x%x, "
-		"rin_input[%d]: 0x%x, ip.s6_addr[%d]: 0x%x\n",
-		pos, pos/8, pos/8, rin_input[pos/8], 
-		(pos/8 > 0) ? pos/8-1 : 0, rin_input[(pos/8 > 0) ? pos/8-1:0],
-		(pos/8 > 0) ? pos/8-1:0, ip.s6_addr[(pos/8 > 0) ? pos/8-1:0]);
-	*/
-	rin_input[pos/8] |= ((a->m_pad[pos/8] << (pos%8)) & 0xff) >> (pos%8);
-	for(i=(pos/8)+1;i<16;i++) {
-	    rin_input[i] = a->m_pad[i];
-	}
-
-	/* Encryption: The Rijndael cipher is used as pseudorandom
-	 * function. During each round, only the first bit of
-	 * rin_output is used.
-	 */
-	AES_ecb_encrypt(rin_input, rin_output, &(a->aes_key), AES_ENCRYPT);
-
-	/* combine with used_i */
-	if (! canflip(a, ip, pos+1)) {
-	    rin_output[0] = 0;
-	}
-	//fprintf(stderr, "canflip pos %d: %d\n",
-	//	  pos+1, canflip(a, ip, pos+1));
-
-	/* Combination: the bits are combined into a pseudorandom
-	 *  one-time-pad
-	 */
-	aip->s6_addr[pos/8] |=  (rin_output[0] >> 7) << (7-(pos%8));
-    }
-    /* XOR the orginal address with the pseudorandom one-time-pad */
+static int
+embed_class(const in6_addr_t *ip, const int prefixlen)
+{
+    size_t e;
+
+    for (e = 0; e < EMBEDS; e++) {
+	if (prefixlen > embeds[e].off
+	    && memcmp(ip->s6_addr, embeds[e].prefix, embeds[e].off/8) == 0) {
+	    return e;
+	}
+    }
+    return -1;
+}
+
+/*
+ * If ip/prefixlen carries an embedded IPv4 address, fill in the pad
+ * up to the end of the IPv4 address (the flip bits of the constant
+ * prefix followed by the IPv4 mapping) and set from to the first
+ * position still to be computed. Returns 0 for other addresses.
+ */
+
+static int
+embedded(anon_ipv6_t *a, const in6_addr_t *ip, const int prefixlen,
+	 uint8_t *pad, int *from)
+{
+    in_addr_t v4, av4;
+    int e, off, q;
+
+    e = embed_class(ip, prefixlen);
+    if (e < 0) {
+	return 0;
+    }
+
+    off = embeds[e].off;
+    q = (prefixlen - off < 32) ? prefixlen - off : 32;
+    memcpy(&v4, ip->s6_addr + off/8, 4);
+    if (q == 32) {
+	(void) anon_ipv4_map_pref(a->ipv4, v4, &av4);
+    } else {
+	(void) anon_ipv4_map_prefix(a->ipv4, v4, q, &av4);
+    }
+    v4 ^= av4;
+    memcpy(pad, a->embed_pad[e], off/8);
+    memcpy(pad + off/8, &v4, 4);
+    *from = off + q;
+    return 1;
+}
+
+static void
+map(anon_ipv6_t *a, const in6_addr_t *ip, in6_addr_t *aip, const size_t n,
+    const int prefixlen)
+{
+    uint8_t rin_output[IPv6BATCH*IPv6LENGTH][16];
+    uint8_t rin_input[IPv6BATCH*IPv6LENGTH][16];
+    uint8_t pad[IPv6BATCH][16];
+    int pos, i, len = prefixlen, from[IPv6BATCH], to[IPv6BATCH];
+    int miss[IPv6BATCH];
+    uint8_t store[IPv6BATCH][16], result[IPv6BATCH][16];
+    size_t j, nb, off[IPv6BATCH], ns;
+    prf_addr_t w;
+    uint64_t v;
+
+    if (a->iid != ANON_IPV6_IID_PREF && len > IPv6IID) {
+	len = IPv6IID;
+    }
+
+    for (j = 0, nb = 0; j < n; j++) {
+	memset(pad[j], 0, 16);
+	from[j] = 0;
+	to[j] = len;
+	miss[j] = 0;
+	/* embedded IPv4 addresses depend on the IPv4 key, which is not
+	 * part of the cache file fingerprint */
+	if (a->pcache && prefixlen == IPv6LENGTH
+	    && ! (a->ipv4 && embed_class(&ip[j], prefixlen) >= 0)) {
+	    miss[j] = 2;
+	}
+	if (miss[j] && anon_pcache_get(a->pcache, ip[j].s6_addr, result[j])) {
+	    /* a pad that turns ip into the stored result */
+	    for (i = 0; i < 16; i++) {
+		pad[j][i] = result[j][i] ^ ip[j].s6_addr[i];
+	    }
+	    from[j] = to[j] = IPv6LENGTH;
+	    miss[j] = 0;
+	    off[j] = nb;
+	    continue;
+	}
+	if (a->ipv4 && embedded(a, &ip[j], prefixlen, pad[j], &from[j])) {
+	    if (to[j] < from[j]) {
+		to[j] = from[j];
+	    }
+	} else if (a->cache && len >= IPv6IID) {
+	    if (anon_cache_get(a->cache, prefix64(ip[j].s6_addr), &v)) {
+		for (i = 0; i < 8; i++) {
+		    pad[j][i] = v >> (56 - 8*i);
+		}
+		from[j] = IPv6IID;
+	    } else {
+		miss[j] |= 1;
+	    }
+	}
+	off[j] = nb;
+	w = PRF_ADDR(&ip[j]);
+	for (pos = from[j]; pos < to[j]; pos++) {
+	    prf_input(a, w, pos, rin_input[nb++]);
+	}
+    }
+    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], nb);
+
+    /* hashed interface identifiers: one block per address, keyed
+     * with a separate key so that they never collide with the
+     * Crypto-PAn rounds */
+    if (len < prefixlen && a->iid == ANON_IPV6_IID_HASH) {
+	for (j = 0; j < n; j++) {
+	    memcpy(rin_input[j], ip[j].s6_addr, 16);
+	}
+	anon_aes_encrypt(&a->iid_aes, rin_input[0], rin_input[0], n);
+    }
+
+    for (j = 0, ns = 0; j < n; j++) {
+	if (miss[j] & 2) {
+	    memcpy(store[ns], ip[j].s6_addr, 16);
+	}
+	add_bits(pad[j], (const uint8_t (*)[16]) rin_output + off[j],
+		 from[j], to[j]);
+	if (miss[j] & 1) {
+	    anon_cache_put(a->cache, prefix64(ip[j].s6_addr),
+			   prefix64(pad[j]));
+	}
+	for(i=0;i<16;i++) {
+	    aip[j].s6_addr[i] = pad[j][i] ^ ip[j].s6_addr[i];
+	}
+	if (to[j] < prefixlen) {
+	    iid(a, &aip[j], rin_input[j]);
+	}
+	if (miss[j] & 2) {
+	    memcpy(result[ns++], aip[j].s6_addr, 16);
+	}
+    }
+    if (ns) {
+	anon_pcache_put(a->pcache, (const uint8_t (*)[16]) store,
+			(const uint8_t (*)[16]) result, ns);
+    }
+}
+
+/*
+ * prefix-preserving anonymization on ip
+ * slightly modified version of PAnonymizer::anonymize() from Crypto-PAn
+ */
+
+int
+anon_ipv6_map_pref(anon_ipv6_t *a, const in6_addr_t ip, in6_addr_t *aip)
+{
+    assert(a);
+
+    map(a, &ip, aip, 1, IPv6LENGTH);
+    return 0;
+}
+
+/*
+ * prefix-preserving anonymization of the prefix ip/prefixlen, e.g., a
+ * route or an ACL entry. Only the first prefixlen PRF rounds are run
+ * and the bits beyond prefixlen are copied unchanged (unless the IID
+ * mode applies to them).
+ */
+
+int
+anon_ipv6_map_prefix(anon_ipv6_t *a, const in6_addr_t ip,
+		     const int prefixlen, in6_addr_t *aip)
+{
+    assert(a);
+
+    if (prefixlen < 0 || prefixlen > IPv6LENGTH) {
+	return -1;
+    }
+
+    map(a, &ip, aip, 1, prefixlen);
+    return 0;
+}
+
+/*
+ * prefix-preserving anonymization of n addresses at once. The PRF
+ * rounds of IPv6BATCH addresses are interleaved and handed to the
+ * cipher in a single call, which amortizes the per-call overhead and
+ * keeps the wide (VAES) kernels busy. ip and aip may point to the
+ * same array.
+ */
+
+int
+anon_ipv6_map_pref_batch(anon_ipv6_t *a, const in6_addr_t *ip,
+			 in6_addr_t *aip, const size_t n)
+{
+    size_t k, m;
+
+    assert(a);
+
+    for (k = 0; k < n; k += m) {
+	m = (n - k < IPv6BATCH) ? n - k : IPv6BATCH;
+	map(a, ip + k, aip + k, m, IPv6LENGTH);
+    }
+    return 0;
+}
+
+struct trie_entry {
+    in6_addr_t addr;
+    size_t index;
+};
+
+static int
+trie_cmp(const void *p, const void *q)
+{
+    const struct trie_entry *x = p, *y = q;
+
+    return memcmp(x->addr.s6_addr, y->addr.s6_addr, 16);
+}
+
+/* number of equal leading bits of two addresses */
+
+static int
+lcp(const uint8_t *x, const uint8_t *y)
+{
+    uint8_t d;
+    int i, l;
+
+    for (i = 0; i < 16 && x[i] == y[i]; i++) ;
+    if (i == 16) {
+	return IPv6LENGTH;
+    }
+    for (l = 8*i, d = x[i] ^ y[i]; ! (d & 0x80); d <<= 1, l++) ;
+    return l;
+}
+
+/*
+ * prefix-preserving anonymization of n addresses at once, evaluating
+ * each distinct PRF block only once. The addresses are sorted and
+ * walked as an implicit prefix trie: if an address shares its first
+ * l bits with its predecessor, the flip bits of the positions 0..l are
+ * the same and only the positions l+1..127 need cipher calls. The new
+ * blocks of many addresses are encrypted in a single call and the
+ * results are scattered back in input order. Addresses of one site
+ * share long prefixes, which saves most cipher calls. The /64 cache
+ * is not used. ip and aip may point to the same array.
+ */
+
+int
+anon_ipv6_map_pref_trie(anon_ipv6_t *a, const in6_addr_t *ip,
+			in6_addr_t *aip, const size_t n)
+{
+    uint8_t rin_output[TRIEBLOCKS][16];
+    uint8_t rin_input[TRIEBLOCKS][16];
+    uint8_t from[TRIEBLOCKS];
+    uint8_t pad[16];
+    struct trie_entry *sorted;
+    in6_addr_t res;
+    prf_addr_t w;
+    size_t i, j, k, nb;
+    int pos, f, b, len = IPv6LENGTH;
+
+    assert(a);
+
+    if (a->iid != ANON_IPV6_IID_PREF) {
+	len = IPv6IID;
+    }
+
+    sorted = (struct trie_entry *)
+	malloc((n ? n : 1) * sizeof(struct trie_entry));
+    if (! sorted) {
+	return -1;
+    }
+    for (i = 0; i < n; i++) {
+	sorted[i].addr = ip[i];
+	sorted[i].index = i;
+    }
+    qsort(sorted, n, sizeof(struct trie_entry), trie_cmp);
+
+    memset(pad, 0, sizeof(pad));
+    for (i = 0; i < n; i = k) {
+
+	/* collect the new blocks of as many addresses as fit */
+	for (k = i, nb = 0; k < n && k - i < TRIEBLOCKS; k++) {
+	    f = (k == 0) ? 0 : lcp(sorted[k].addr.s6_addr,
+				   sorted[k-1].addr.s6_addr) + 1;
+	    if (f > len) {
+		f = len;
+	    }
+	    if (a->ipv4 && embed_class(&sorted[k].addr, IPv6LENGTH) >= 0) {
+		f = EMBEDDED;
+	    }
+	    if (f < len && nb + len - f > TRIEBLOCKS) {
+		break;
+	    }
+	    from[k - i] = f;
+	    w = PRF_ADDR(&sorted[k].addr);
+	    for (pos = f; pos < len; pos++) {
+		prf_input(a, w, pos, rin_input[nb++]);
+	    }
+	}
+	anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], nb);
+
+	if (len < IPv6LENGTH && a->iid == ANON_IPV6_IID_HASH) {
+	    for (j = i; j < k; j++) {
+		memcpy(rin_input[j - i], sorted[j].addr.s6_addr, 16);
+	    }
+	    anon_aes_encrypt(&a->iid_aes, rin_input[0], rin_input[0], k - i);
+	}
+
+	/* combine the shared and the new bits and scatter the results */
+	for (j = i, nb = 0; j < k; j++) {
+	    f = from[j - i];
+	    if (f == EMBEDDED) {
+		map(a, &sorted[j].addr, &res, 1, IPv6LENGTH);
+		for (b = 0; b < 16; b++) {
+		    pad[b] = res.s6_addr[b] ^ sorted[j].addr.s6_addr[b];
+		}
+		aip[sorted[j].index] = res;
+		continue;
+	    }
+	    if (f < IPv6LENGTH) {
+		pad[f/8] &= 0xff << (8 - f%8);
+		memset(pad + f/8 + 1, 0, 15 - f/8);
+	    }
+	    if (f < len) {
+		add_bits(pad, (const uint8_t (*)[16]) rin_output + nb, f, len);
+		nb += len - f;
+	    }
+	    for (b = 0; b < 16; b++) {
+		res.s6_addr[b] = pad[b] ^ sorted[j].addr.s6_addr[b];
+	    }
+	    if (len < IPv6LENGTH) {
+		iid(a, &res, rin_input[j - i]);
+	    }
+	    aip[sorted[j].index] = res;
+	}
+    }
+    free(sorted);
+    return 0;
+}
+
+/*
+ * Map addresses with an embedded IPv4 address (IPv4-mapped, NAT64
+ * and 6to4) with the IPv4 anonymization object ipv4, which usually
+ * shares the key of a, so that the embedded address is anonymized
+ * like the same host seen over IPv4. This costs 32 instead of 128
+ * cipher calls (6to4 addresses still need the rounds of the subnet
+ * and interface identifier). The embedding prefixes themselves are
+ * anonymized like any other prefix, so the mapping stays a
+ * prefix-preserving permutation. ipv4 is not copied and must outlive
+ * a; NULL turns the mode off.
+ */
+
+int
+anon_ipv6_set_ipv4(anon_ipv6_t *a, anon_ipv4_t *ipv4)
+{
+    assert(a);
+
+    a->ipv4 = ipv4;
+    if (ipv4) {
+	embed_init(a);
+    }
+    return 0;
+}
+
+/*
+ * Select how the interface identifier (the low 64 bits) is treated
+ * by the prefix-preserving functions.
+ */
+
+int
+anon_ipv6_set_iid(anon_ipv6_t *a, const int mode)
+{
+    assert(a);
+
+    switch (mode) {
+    case ANON_IPV6_IID_PREF:
+    case ANON_IPV6_IID_KEEP:
+    case ANON_IPV6_IID_ZERO:
+    case ANON_IPV6_IID_HASH:
+	if (a->iid != mode) {
+	    anon_pcache_close(a->pcache);
+	    a->pcache = NULL;
+	}
+	a->iid = mode;
+	return 0;
+    }
+    return -1;
+}
+
+/*
+ * prefix-preserving anonymization of n addresses with each of the k
+ * anonymization objects in a (usually set up with different keys).
+ * The results of a[j] are stored in the array aip[j]. The addresses
+ * are processed in chunks of IPv6BATCH, which are mapped with all k
+ * objects while they are still in the cache, so that input only
+ * needs to be parsed once for all keys.
+ */
+
+int
+anon_ipv6_map_pref_multi(anon_ipv6_t **a, const size_t k,
+			 const in6_addr_t *ip, in6_addr_t **aip,
+			 const size_t n)
+{
+    size_t i, j, m;
+
+    assert(a && aip);
+
+    for (i = 0; i < n; i += m) {
+	m = (n - i < IPv6BATCH) ? n - i : IPv6BATCH;
+	for (j = 0; j < k; j++) {
+	    (void) anon_ipv6_map_pref_batch(a[j], ip + i, aip[j] + i, m);
+	}
+    }
+    return 0;
+}
+
+/*
+ * Materialization of the lex mapping: once all used prefixes are
+ * known, the mapping of every one of them is fixed by the used_i
+ * tree. The tree is first flattened into its nodes in preorder and
+ * released, so that the following passes run over memory
+ * sequentially. The second pass evaluates the flip bit of every
+ * node with a single child exactly once; the cipher inputs are
+ * collected and encrypted TRIEBLOCKS at a time. The third pass emits
+ * the complete nodes with their anonymized prefixes in ascending
+ * order. A node's prefix follows from its parent's, which is the
+ * closest preceding node of smaller depth.
+ */
+
+static void
+flatten(anon_nodes_t *tree, const uint32_t i, const int depth,
+	const uint8_t right, struct anon_step *s, size_t *n)
+{
+    struct anon_node *p = anon_node(tree, i);
+    struct anon_step *t = s + (*n)++;
+
+    t->depth = depth;
+    t->flags = right ? ANON_STEP_RIGHT : 0;
+    if (p->complete) {
+	t->flags |= ANON_STEP_COMPLETE;
+	return;
+    }
+    if (! (p->left && p->right)) {
+	t->flags |= ANON_STEP_SINGLE;
+    }
+    if (p->left) {
+	flatten(tree, p->left, depth + 1, 0, s, n);
+    }
+    if (p->right) {
+	flatten(tree, p->right, depth + 1, 1, s, n);
+    }
+}
+
+/* clear the bits from..to-1 of c */
+
+static inline void
+clear_bits(uint8_t *c, const int from, const int to)
+{
+    int i;
+
+    if (from < to) {
+	c[from/8] &= ~(0xff >> (from%8));
+	for (i = from/8 + 1; i <= (to - 1)/8; i++) {
+	    c[i] = 0;
+	}
+    }
+}
+
+/*
+ * Turn the prefix of the step before t, which has depth prev, into
+ * the prefix of t. Only the bits of the positions t->depth-1..prev-1
+ * may change.
+ */
+
+static inline void
+step_net(uint8_t *net, const struct anon_step *t, const int prev)
+{
+    const int pos = t->depth - 1;
+
+    if (t->depth > 0) {
+	clear_bits(net, pos, prev);
+	if (t->flags & ANON_STEP_RIGHT) {
+	    net[pos/8] |= 0x80 >> (pos%8);
+	}
+    }
+}
+
+static void
+step_encrypt(anon_ipv6_t *a, const uint8_t (*rin_input)[16],
+	     struct anon_step **wait, const size_t m)
+{
+    uint8_t rin_output[TRIEBLOCKS][16];
+    size_t k;
+
+    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], m);
+    for (k = 0; k < m; k++) {
+	wait[k]->flags |= (rin_output[k][0] >> 7) * ANON_STEP_FLIP;
+    }
+}
+
+static void
+step_flips(anon_ipv6_t *a, struct anon_step *s, const size_t n)
+{
+    uint8_t rin_input[TRIEBLOCKS][16];
+    struct anon_step *wait[TRIEBLOCKS];
+    in6_addr_t net;
+    size_t i, m = 0;
+
+    memset(&net, 0, sizeof(net));
+    for (i = 0; i < n; i++) {
+	step_net(net.s6_addr, &s[i], i ? s[i-1].depth : 0);
+	if (! (s[i].flags & ANON_STEP_SINGLE)) {
+	    continue;
+	}
+	prf_input(a, PRF_ADDR(&net), s[i].depth, rin_input[m]);
+	wait[m++] = &s[i];
+	if (m == TRIEBLOCKS) {
+	    step_encrypt(a, (const uint8_t (*)[16]) rin_input, wait, m);
+	    m = 0;
+	}
+    }
+    if (m) {
+	step_encrypt(a, (const uint8_t (*)[16]) rin_input, wait, m);
+    }
+}
+
+/*
+ * Compute the lex mapping of all used prefixes at once into a new
+ * sorted table and store it in *lexp and its size in *nlexp. The
+ * used set is released as soon as it has been flattened unless keep
+ * is set.
+ */
+
+static int
+lex_build(anon_ipv6_t *a, const int keep, struct lex **lexp, size_t *nlexp)
+{
+    struct anon_step *s;
+    struct lex *lex, *e;
+    uint8_t net[16], pad[16];
+    size_t i, n = 0;
+    int j, prev;
+
+    if (used_build(a) != 0 || a->nodes == UINT_MAX) {
+	return -1;
+    }
+
+    s = (struct anon_step *) malloc(a->nodes * sizeof(struct anon_step));
+    lex = (struct lex *) malloc((a->prefixes ? a->prefixes : 1)
+				* sizeof(struct lex));
+    if (! s || ! lex) {
+	free(s);
+	free(lex);
+	return -1;
+    }
+    if (a->ptree) {
+	n = anon_patricia_flatten(a->ptree, s);
+    } else if (a->sorted) {
+	n = anon_sorted_flatten(a->sorted, s);
+    } else {
+	flatten(&a->tree, 0, 0, 0, s, &n);
+    }
+    if (! keep) {
+	used_clear(a);
+    }
+    step_flips(a, s, n);
+
+    memset(net, 0, sizeof(net));
+    memset(pad, 0, sizeof(pad));
+    for (i = 0, e = lex; i < n; i++) {
+	prev = i ? s[i-1].depth : 0;
+	step_net(net, &s[i], prev);
+	/* drop the pad bits of the positions depth..prev */
+	clear_bits(pad, s[i].depth, prev < IPv6LENGTH ? prev + 1 : prev);
+	if (s[i].flags & ANON_STEP_COMPLETE) {
+	    for (j = 0; j < 16; j++) {
+		e->net.s6_addr[j] = net[j];
+		e->anet.s6_addr[j] = net[j] ^ pad[j];
+	    }
+	    e->prefixlen = s[i].depth;
+	    e++;
+	} else if (s[i].flags & ANON_STEP_FLIP) {
+	    pad[s[i].depth/8] |= 0x80 >> (s[i].depth%8);
+	}
+    }
+    free(s);
+
+    *nlexp = e - lex;
+    *lexp = (struct lex *) realloc(lex, (*nlexp ? *nlexp : 1)
+				   * sizeof(struct lex));
+    if (! *lexp) {
+	*lexp = lex;
+    }
+    return 0;
+}
+
+/*
+ * Compute the lex mapping of all used prefixes at once and replace
+ * the used_i tree by the sorted table of the results, which
+ * anon_ipv6_map_pref_lex() then searches. The table takes 36 bytes
+ * per used prefix instead of up to 128 tree nodes. The used set can
+ * not be extended afterwards.
+ */
+
+int
+anon_ipv6_materialize_lex(anon_ipv6_t *a)
+{
+    struct lex *lex;
+    size_t nlex;
+
+    assert(a);
+
+    if (USED_GONE(a)) {
+	return 0;
+    }
+    if (lex_build(a, 0, &lex, &nlex) != 0) {
+	return -1;
+    }
+    if (a->lex) {
+	free(a->lex);
+    }
+    a->lex = lex;
+    a->nlex = nlex;
+    return 0;
+}
+
+/*
+ * Find the used prefix covering ip in the sorted table lex of n
+ * prefixes by a binary search. Returns NULL if ip is not covered.
+ */
+
+static inline const struct lex*
+lex_lookup(const struct lex *lex, const size_t n, const in6_addr_t *ip)
+{
+    size_t lo = 0, hi = n, mid;
+    const struct lex *e;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (memcmp(ip, &lex[mid].net, sizeof(in6_addr_t)) < 0) {
+	    hi = mid;
+	} else {
+	    lo = mid + 1;
+	}
+    }
+    if (lo == 0) {
+	return NULL;
+    }
+    e = &lex[lo - 1];
+    return (lcp(ip->s6_addr, e->net.s6_addr) < e->prefixlen) ? NULL : e;
+}
+
+/*
+ * The table depends on the key: rebuild the used_i tree from the
+ * used prefixes and materialize it again. If that fails, the tree
+ * (or nothing) is left.
+ */
+
+static void
+lex_rekey(anon_ipv6_t *a)
+{
+    unsigned nodes = a->nodes;
+    size_t i;
+    int err = 0;
+
+    a->prefixes = 0;
+    err = used_init(a);
+    if (! err) {
+	for (i = 0; i < a->nlex && ! err; i++) {
+	    err = anon_ipv6_set_used(a, a->lex[i].net, a->lex[i].prefixlen);
+	}
+    }
+    a->nodes = nodes;
+    if (err || anon_ipv6_materialize_lex(a) != 0) {
+	free(a->lex);
+	a->lex = NULL;
+	a->nlex = 0;
+	if (err) {
+	    used_clear(a);
+	}
+    }
+}
+
+/*
+ * prefix- and lexicographical-order-preserving anonymization on
+ * ip. After anon_ipv6_materialize_lex(), the result is looked up and
+ * addresses outside of the used prefixes can not be mapped.
+ */
+
+int
+anon_ipv6_map_pref_lex(anon_ipv6_t *a, const in6_addr_t ip, in6_addr_t *aip)
+{
+    uint8_t rin_output[IPv6LENGTH][16];
+    uint8_t rin_input[IPv6LENGTH][16];
+    uint8_t flip[IPv6LENGTH];
+    const struct version *v;
+    const struct lex *e;
+    unsigned epoch;
+    prf_addr_t w;
+    int pos, i, k, nf;
+
+    assert(a);
+
+    /* net and ip share the first prefixlen bits and the other bits
+     * of net and anet are zero */
+    if (anon_rcu_published(&a->rcu)) {
+	v = anon_rcu_enter(&a->rcu, &epoch);
+	e = lex_lookup(v->lex, v->nlex, &ip);
+	for (i = 0; e && i < 16; i++) {
+	    aip->s6_addr[i] = ip.s6_addr[i] ^ e->net.s6_addr[i]
+		^ e->anet.s6_addr[i];
+	}
+	anon_rcu_leave(&a->rcu, epoch);
+	return e ? 0 : -1;
+    }
+    if (a->lex) {
+	e = lex_lookup(a->lex, a->nlex, &ip);
+	if (! e) {
+	    return -1;
+	}
+	for (i = 0; i < 16; i++) {
+	    aip->s6_addr[i] = ip.s6_addr[i] ^ e->net.s6_addr[i]
+		^ e->anet.s6_addr[i];
+	}
+	return 0;
+    }
+    if (USED_GONE(a) || used_build(a) != 0) {
+	return -1;
+    }
+
+    memset(aip, 0, sizeof(in6_addr_t));
+
+    /* Only the positions the used_i tree allows to flip need a bit
+     * of the pseudorandom one-time-pad. For each of these prefix
+     * lengths, generate a bit using the Rijndael cipher, which is
+     * used as a pseudorandom function here.
+     */
+    nf = canflip(a, &ip, flip);
+    w = PRF_ADDR(&ip);
+    for (k = 0; k < nf; k++) {
+	prf_input(a, w, flip[k], rin_input[k]);
+    }
+    anon_aes_encrypt(&a->aes, rin_input[0], rin_output[0], nf);
+
+    /* Combination: the bits are combined into a pseudorandom
+     *  one-time-pad
+     */
+    for (k = 0; k < nf; k++) {
+	pos = flip[k];
+	aip->s6_addr[pos/8] |=  (rin_output[k][0] >> 7) << (7-(pos%8));
+    }
+    /* XOR the orginal address with the pseudorandom one-time-pad */
     for(i=0;i<16;i++) {
 	aip->s6_addr[i] = aip->s6_addr[i] ^ ip.s6_addr[i];
     }
     return 0;
 }
+
+/*
+ * Freeze a for concurrent mapping, see anon_ipv4_freeze().
+ */
+
+int
+anon_ipv6_freeze(anon_ipv6_t *a)
+{
+    assert(a);
+
+    if (anon_ipv6_materialize_lex(a) != 0) {
+	return -1;
+    }
+    return anon_ipv6_set_cache(a, 0);
+}
+
+static void
+version_free(struct version *v)
+{
+    if (v) {
+	free(v->lex);
+	free(v);
+    }
+}
+
+/*
+ * Publish the lex mapping of the used set as it is now for readers
+ * in other threads, see anon_ipv4_publish().
+ */
+
+int
+anon_ipv6_publish(anon_ipv6_t *a)
+{
+    struct version *v;
+    int err = 0;
+
+    assert(a);
+
+    v = (struct version *) malloc(sizeof(struct version));
+    if (! v) {
+	return -1;
+    }
+    if (! USED_GONE(a)) {
+	err = lex_build(a, 1, &v->lex, &v->nlex);
+    } else if (a->lex) {
+	v->nlex = a->nlex;
+	v->lex = (struct lex *) malloc((a->nlex ? a->nlex : 1)
+				       * sizeof(struct lex));
+	if (v->lex) {
+	    memcpy(v->lex, a->lex, a->nlex * sizeof(struct lex));
+	}
+	err = v->lex ? 0 : -1;
+    } else {
+	err = -1;
+    }
+    if (err) {
+	free(v);
+	return -1;
+    }
+    version_free(anon_rcu_publish(&a->rcu, v));
+    return 0;
+}
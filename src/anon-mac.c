@@ -43,6 +43,8 @@ struct _anon_mac {
     LHASH *hash_table;
     struct node *list;
     int state;
+    struct hash_node *table; /* sorted mappings once frozen, or NULL */
+    size_t size;	/* number of entries in table */
 };
 
 enum anon_mac_state_t {INIT=0, /* MAC anon object initialized,
@@ -81,6 +83,36 @@ anon_mac_cmp(const struct hash_node *arg1, const struct hash_node *arg2) {
 static IMPLEMENT_LHASH_HASH_FN(anon_mac_hash, const struct hash_node *);
 static IMPLEMENT_LHASH_COMP_FN(anon_mac_cmp, const struct hash_node *);
 
+/* functions for the sorted table of a frozen object */
+static int
+table_cmp(const void *arg1, const void *arg2)
+{
+    const struct hash_node *p = arg1, *q = arg2;
+
+    return memcmp(p->mac, q->mac, MAC_LENGTH);
+}
+
+static const struct hash_node*
+table_lookup(anon_mac_t *a, const uint8_t *mac)
+{
+    struct hash_node node;
+
+    memcpy(node.mac, mac, MAC_LENGTH);
+    return bsearch(&node, a->table, a->size, sizeof(struct hash_node),
+		   table_cmp);
+}
+
+/* move an entry of the lhash table into the table */
+static void
+table_collect(void *arg1, void *arg2)
+{
+    struct hash_node *node = arg1;
+    anon_mac_t *a = arg2;
+
+    a->table[a->size++] = *node;
+    free(node);
+}
+
 /* returns 0 if we're trying to insert a MAC address not yet in the list */
 static int
 list_insert(struct node **list, const uint8_t *mac)
@@ -288,6 +320,10 @@ anon_mac_delete(anon_mac_t *a)
 	free(q);
     }
 
+    if (a->table) {
+	free(a->table);
+    }
+
     free(a);
 }
 
@@ -313,6 +349,9 @@ anon_mac_set_used(anon_mac_t *a, const uint8_t *mac)
 {
     assert(a && mac);
     
+    if (a->table) {
+	return -1;
+    }
     (void) anon_mac_set_state(a, INIT);
 
     if (list_insert(&(a->list), mac) >= 0) {
@@ -335,6 +374,14 @@ anon_mac_map(anon_mac_t *a, const uint8_t *mac,
     struct hash_node *p;
     int tmp = 0;
 
+    if (a->table) {
+	p = (struct hash_node *) table_lookup(a, mac);
+	if (a->state != NON_LEX || ! p) {
+	    return -1;
+	}
+	memcpy(amac, p->hash, MAC_LENGTH);
+	return 0;
+    }
     (void) anon_mac_set_state(a, NON_LEX);
 
     /* lookup anon. MAC in lhash table */
@@ -387,6 +434,15 @@ anon_mac_map_lex(anon_mac_t *a, const uint8_t *mac,
 {
     struct hash_node node;
     struct hash_node *p;
+
+    if (a->table) {
+	p = (struct hash_node *) table_lookup(a, mac);
+	if (a->state != LEX || ! p) {
+	    return -1;
+	}
+	memcpy(amac, p->hash, MAC_LENGTH);
+	return 0;
+    }
     (void) anon_mac_set_state(a, LEX);
     
     /* lookup the anonymized mac address in the lhash table */
@@ -397,3 +453,45 @@ anon_mac_map_lex(anon_mac_t *a, const uint8_t *mac,
     memcpy(amac, p->hash, MAC_LENGTH);
     return 0;
 }
+
+/*
+ * Freeze the object for concurrent mapping: the mappings (all of
+ * them unless anon_mac_map() has been used) move from the lhash
+ * table into a sorted array, which the map functions then search
+ * without changing anything. No more MAC addresses can be marked as
+ * used and anon_mac_map() fails for addresses it has not mapped
+ * before.
+ */
+int
+anon_mac_freeze(anon_mac_t *a)
+{
+    struct node *p;
+
+    assert(a);
+
+    if (a->table) {
+	return 0;
+    }
+    if (a->state == INIT) {
+	(void) anon_mac_set_state(a, LEX);
+    }
+
+    a->table = (struct hash_node *)
+	malloc((lh_num_items(a->hash_table) + 1) * sizeof(struct hash_node));
+    if (! a->table) {
+	return -1;
+    }
+    lh_doall_arg(a->hash_table, table_collect, a);
+    qsort(a->table, a->size, sizeof(struct hash_node), table_cmp);
+    lh_free(a->hash_table);
+    a->hash_table = NULL;
+
+    /* the MAC addresses generated so far are not needed anymore */
+    for (p = a->list; p; ) {
+	struct node *q = p;
+	p = p->next;
+	free(q);
+    }
+    a->list = NULL;
+    return 0;
+}
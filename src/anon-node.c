@@ -0,0 +1,177 @@
+/*
+ * anon-node.c --
+ *
+ * Arena of used_i tree nodes. The chunks are never moved, so node
+ * pointers stay valid while the tree grows; only the (small) array
+ * of chunk pointers is reallocated.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "anon-node.h"
+
+#define CHUNK	((uint32_t) 1 << ANON_NODE_SHIFT)
+
+/*
+ * Initialize an arena holding just the root of an empty tree.
+ * Returns 0 on success, -1 otherwise.
+ */
+
+int
+anon_nodes_init(anon_nodes_t *t)
+{
+    assert(t);
+
+    memset(t, 0, sizeof(anon_nodes_t));
+    return anon_nodes_alloc(t) == 0 ? 0 : -1;
+}
+
+/*
+ * Allocate a node without children. Returns its index or
+ * ANON_NODE_MAX if there is no memory or no index left. (The first
+ * node allocated is the root, index 0.)
+ */
+
+uint32_t
+anon_nodes_alloc(anon_nodes_t *t)
+{
+    struct anon_node **chunks;
+    uint32_t i = t->size;
+
+    if (i == ANON_NODE_MAX) {
+	return ANON_NODE_MAX;
+    }
+    if ((i >> ANON_NODE_SHIFT) == t->nchunks) {
+	if (t->nchunks == ANON_NODE_CHUNKS) {
+	    return ANON_NODE_MAX;
+	}
+	if (! t->shared && (t->nchunks & (t->nchunks - 1)) == 0) {
+	    chunks = (struct anon_node **) realloc(t->chunks,
+		(t->nchunks ? 2 * t->nchunks : 1) * sizeof(*chunks));
+	    if (! chunks) {
+		return ANON_NODE_MAX;
+	    }
+	    t->chunks = chunks;
+	}
+	t->chunks[t->nchunks] = (struct anon_node *)
+	    malloc(CHUNK * sizeof(struct anon_node));
+	if (! t->chunks[t->nchunks]) {
+	    return ANON_NODE_MAX;
+	}
+	t->nchunks++;
+    }
+    memset(anon_node(t, i), 0, sizeof(struct anon_node));
+    t->size++;
+    return i;
+}
+
+/*
+ * Prepare the arena for concurrent allocation: the array of chunks
+ * gets room for all chunks, so that it never moves. Must be called
+ * before the threads start. Returns 0 on success, -1 otherwise.
+ */
+
+int
+anon_nodes_share(anon_nodes_t *t)
+{
+    struct anon_node **chunks;
+
+    assert(t);
+
+    if (t->shared) {
+	return 0;
+    }
+    chunks = (struct anon_node **) realloc(t->chunks,
+					   ANON_NODE_CHUNKS * sizeof(*chunks));
+    if (! chunks) {
+	return -1;
+    }
+    t->chunks = chunks;
+    t->shared = 1;
+    return 0;
+}
+
+void
+anon_nodes_pool_init(anon_nodes_pool_t *p, anon_nodes_t *t)
+{
+    p->t = t;
+    p->next = p->end = 0;
+}
+
+/*
+ * Allocate a node without children from the pool. A chunk slot is
+ * claimed with a compare-and-swap; the chunk is stored before any of
+ * its nodes is published, so that readers who find a node also find
+ * its chunk. Returns the index of the node or ANON_NODE_MAX.
+ */
+
+uint32_t
+anon_nodes_pool_alloc(anon_nodes_pool_t *p)
+{
+    anon_nodes_t *t = p->t;
+    struct anon_node *chunk;
+    uint32_t c;
+
+    if (p->next == p->end) {
+	c = __atomic_load_n(&t->nchunks, __ATOMIC_RELAXED);
+	do {
+	    if (c == ANON_NODE_CHUNKS) {
+		return ANON_NODE_MAX;
+	    }
+	} while (! __atomic_compare_exchange_n(&t->nchunks, &c, c + 1, 0,
+					       __ATOMIC_RELAXED,
+					       __ATOMIC_RELAXED));
+	chunk = (struct anon_node *) malloc(CHUNK * sizeof(struct anon_node));
+	t->chunks[c] = chunk;
+	if (! chunk) {
+	    return ANON_NODE_MAX;
+	}
+	p->next = c << ANON_NODE_SHIFT;
+	p->end = p->next + CHUNK;
+    }
+    memset(anon_node(t, p->next), 0, sizeof(struct anon_node));
+    return p->next++;
+}
+
+/*
+ * Retire a pool. Sequential allocation continues behind all chunks
+ * taken by pools so far.
+ */
+
+void
+anon_nodes_pool_done(anon_nodes_pool_t *p)
+{
+    anon_nodes_t *t = p->t;
+    uint32_t size, end;
+
+    end = __atomic_load_n(&t->nchunks, __ATOMIC_RELAXED) << ANON_NODE_SHIFT;
+    size = __atomic_load_n(&t->size, __ATOMIC_RELAXED);
+    while (size < end
+	   && ! __atomic_compare_exchange_n(&t->size, &size, end, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * Release all nodes. The arena is empty (without a root) afterwards.
+ */
+
+void
+anon_nodes_clear(anon_nodes_t *t)
+{
+    uint32_t i;
+
+    assert(t);
+
+    for (i = 0; i < t->nchunks; i++) {
+	free(t->chunks[i]);
+    }
+    if (t->chunks) {
+	free(t->chunks);
+    }
+    memset(t, 0, sizeof(anon_nodes_t));
+}
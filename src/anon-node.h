@@ -0,0 +1,82 @@
+/*
+ * anon-node.h --
+ *
+ * Internal arena of the nodes of the used_i trees of the IP address
+ * anonymization objects. Nodes are allocated from large chunks and
+ * refer to their children by 32-bit indices into the arena; index 0
+ * is the root, which is nobody's child, so that 0 also means "no
+ * child". The whole tree is released at once. Not installed and not
+ * part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_NODE_H_
+#define _ANON_NODE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ANON_NODE_SHIFT	14		/* 2^14 nodes per chunk */
+#define ANON_NODE_MAX	0xffffffff	/* maximum number of nodes */
+#define ANON_NODE_CHUNKS (ANON_NODE_MAX >> ANON_NODE_SHIFT) /* maximum */
+
+struct anon_node {
+    uint32_t left;	/* index of the left child or 0 */
+    uint32_t right;	/* index of the right child or 0 */
+    uint8_t complete;	/* if complete subtree below node is used */
+};
+
+typedef struct {
+    struct anon_node **chunks;
+    uint32_t nchunks;	/* number of allocated chunks */
+    uint32_t size;	/* number of allocated nodes */
+    int shared;		/* chunks has room for ANON_NODE_CHUNKS */
+} anon_nodes_t;
+
+int		anon_nodes_init(anon_nodes_t *t);
+uint32_t	anon_nodes_alloc(anon_nodes_t *t);
+void		anon_nodes_clear(anon_nodes_t *t);
+
+/*
+ * Concurrent allocation: once the arena is shared, every thread
+ * allocates from a pool of its own, which takes a whole chunk at a
+ * time. Sequential allocation must not run at the same time.
+ */
+
+typedef struct {
+    anon_nodes_t *t;
+    uint32_t next;	/* next free node of the pool's chunk */
+    uint32_t end;	/* end of the pool's chunk */
+} anon_nodes_pool_t;
+
+int		anon_nodes_share(anon_nodes_t *t);
+void		anon_nodes_pool_init(anon_nodes_pool_t *p, anon_nodes_t *t);
+uint32_t	anon_nodes_pool_alloc(anon_nodes_pool_t *p);
+void		anon_nodes_pool_done(anon_nodes_pool_t *p);
+
+static inline struct anon_node*
+anon_node(const anon_nodes_t *t, const uint32_t i)
+{
+    return &t->chunks[i >> ANON_NODE_SHIFT]
+	[i & (((uint32_t) 1 << ANON_NODE_SHIFT) - 1)];
+}
+
+/*
+ * A used_i tree flattened into its nodes in preorder, the form in
+ * which lex mappings are materialized. The prefix of a node follows
+ * from the prefix of the node before it: its parent is the closest
+ * preceding node of smaller depth.
+ */
+
+struct anon_step {
+    uint8_t depth;
+    uint8_t flags;
+};
+
+#define ANON_STEP_RIGHT		0x01	/* right child of its parent */
+#define ANON_STEP_COMPLETE	0x02
+#define ANON_STEP_SINGLE	0x04	/* has no two children */
+#define ANON_STEP_FLIP		0x08	/* flip bit of the next position */
+
+#endif /* _ANON_NODE_H_ */
@@ -40,6 +40,9 @@ struct _anon_octs {
     LHASH *hash_table;
     struct node *list;
     int state;
+    struct hash_node *table; /* sorted mappings once frozen, or NULL */
+    size_t size;	/* number of entries in table */
+    char *strings;	/* the strings of table */
 };
 
 enum anon_octs_state_t
@@ -119,6 +122,36 @@ IMPLEMENT_LHASH_HASH_FN(anon_octs_hash, const struct hash_node *);
 static
 IMPLEMENT_LHASH_COMP_FN(anon_octs_cmp, const struct hash_node *);
 
+/* functions for the sorted table of a frozen object */
+static int
+table_cmp(const void *arg1, const void *arg2)
+{
+    const struct hash_node *p = arg1, *q = arg2;
+
+    return strcmp(p->data, q->data);
+}
+
+static const struct hash_node*
+table_lookup(anon_octs_t *a, const char *str)
+{
+    struct hash_node node;
+
+    node.data = (char*) str;
+    return bsearch(&node, a->table, a->size, sizeof(struct hash_node),
+		   table_cmp);
+}
+
+/* move an entry of the lhash table into the table */
+static void
+table_collect(void *arg1, void *arg2)
+{
+    struct hash_node *node = arg1;
+    anon_octs_t *a = arg2;
+
+    a->table[a->size++] = *node;
+    free(node);
+}
+
 /*
  * lookup str in hash table and copy found hash into astr
  * copies at most strlen chars
@@ -504,6 +537,8 @@ anon_octs_new()
 void
 anon_octs_delete(anon_octs_t *a)
 {
+    size_t i;
+
     if (! a) {
 	return;
     }
@@ -512,6 +547,15 @@ anon_octs_delete(anon_octs_t *a)
 
     list_remove_all(&(a->list));
 
+    if (a->table) {
+	for (i = 0; ! a->strings && i < a->size; i++) {
+	    free(a->table[i].data);
+	    free(a->table[i].hash);
+	}
+	free(a->table);
+	free(a->strings);
+    }
+
     free(a);
 }
 
@@ -537,6 +581,9 @@ anon_octs_set_used(anon_octs_t *a, const char *str)
 {
     assert(a && str);
     
+    if (a->table) {
+	return -1;
+    }
     (void) anon_octs_set_state(a, INIT);
 
     if (list_insert(&(a->list), str) >= 0) {
@@ -562,6 +609,14 @@ anon_octs_map(anon_octs_t *a, const char *str, char *astr)
     struct hash_node *p;
     int tmp;
     
+    if (a->table) {
+	p = (struct hash_node *) table_lookup(a, str);
+	if (a->state != NON_LEX || ! p) {
+	    return -1;
+	}
+	strcpy(astr, p->hash);
+	return 0;
+    }
     (void) anon_octs_set_state(a, NON_LEX);
 
     /* lookup anon. string in lhash table */
@@ -601,6 +656,16 @@ anon_octs_map(anon_octs_t *a, const char *str, char *astr)
 int
 anon_octs_map_lex(anon_octs_t *a, const char *str, char *astr)
 {
+    const struct hash_node *p;
+
+    if (a->table) {
+	p = table_lookup(a, str);
+	if (a->state != LEX || ! p) {
+	    return 1;
+	}
+	strcpy(astr, p->hash);
+	return 0;
+    }
     (void) anon_octs_set_state(a, LEX);
     
     /* lookup the anonymized string in the lhash table */
@@ -610,3 +675,60 @@ anon_octs_map_lex(anon_octs_t *a, const char *str, char *astr)
     else
 	return 1;
 }
+
+/*
+ * Freeze the object for concurrent mapping: the mappings (all of
+ * them unless anon_octs_map() has been used) move from the lhash
+ * table into a sorted array, with all strings packed into a single
+ * block in the same order, which the map functions then search
+ * without changing anything. No more strings can be marked as used
+ * and anon_octs_map() fails for strings it has not mapped before.
+ */
+int
+anon_octs_freeze(anon_octs_t *a)
+{
+    struct hash_node *p;
+    size_t i, len = 0;
+    char *s;
+
+    assert(a);
+
+    if (a->table) {
+	return 0;
+    }
+    if (a->state == INIT) {
+	(void) anon_octs_set_state(a, LEX);
+    }
+
+    a->table = (struct hash_node *)
+	malloc((lh_num_items(a->hash_table) + 1) * sizeof(struct hash_node));
+    if (! a->table) {
+	return -1;
+    }
+    lh_doall_arg(a->hash_table, table_collect, a);
+    qsort(a->table, a->size, sizeof(struct hash_node), table_cmp);
+    lh_free(a->hash_table);
+    a->hash_table = NULL;
+
+    /* pack the strings, unless there is no memory to do so */
+    for (i = 0; i < a->size; i++) {
+	len += strlen(a->table[i].data) + strlen(a->table[i].hash) + 2;
+    }
+    a->strings = (char*) malloc(len + 1);
+    for (i = 0, s = a->strings; s && i < a->size; i++) {
+	p = &a->table[i];
+	strcpy(s, p->data);
+	free(p->data);
+	p->data = s;
+	s += strlen(s) + 1;
+	strcpy(s, p->hash);
+	free(p->hash);
+	p->hash = s;
+	s += strlen(s) + 1;
+    }
+
+    /* the strings generated so far are not needed anymore */
+    list_remove_all(&(a->list));
+    a->list = NULL;
+    return 0;
+}
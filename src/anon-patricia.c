@@ -0,0 +1,305 @@
+/*
+ * anon-patricia.c --
+ *
+ * Path-compressed tree of used IPv6 prefixes. A node stores its
+ * prefix and length, so that the binary nodes between a node and its
+ * parent, which all have a single child, need not be stored. Stored
+ * are the root, the complete nodes and the nodes with two children;
+ * an address adds at most two nodes instead of up to 128. A binary
+ * node at depth d below the parent of a node exists if its prefix is
+ * the first d bits of the node's prefix.
+ *
+ * Nodes are allocated from chunks, which never move, and refer to
+ * their children by index; index 0 is the root, which is nobody's
+ * child, so that 0 also means "no child".
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "anon-patricia.h"
+#include "anon-pp.h"
+
+#define LENGTH		128
+#define CHUNKSHIFT	12		/* 2^12 nodes per chunk */
+#define CHUNK		(1 << CHUNKSHIFT)
+#define NIL		0xffffffff
+
+struct pnode {
+    uint64_t key[2];		/* prefix, the bits from len on are 0 */
+    uint32_t child[2];		/* index of the children or 0 */
+    uint8_t len;		/* prefix length (depth) */
+    uint8_t complete;
+};
+
+struct _anon_patricia {
+    struct pnode **chunks;
+    uint32_t nchunks;		/* number of allocated chunks */
+    uint32_t size;		/* number of allocated nodes */
+};
+
+#define BIT(k, i)	(((k)[(i) >> 6] >> (63 - ((i) & 63))) & 1)
+
+static inline struct pnode*
+pnode(anon_patricia_t *t, const uint32_t i)
+{
+    return &t->chunks[i >> CHUNKSHIFT][i & (CHUNK - 1)];
+}
+
+/* word with the first len bits set (none if len <= 0) */
+
+static inline uint64_t
+mask(const int len)
+{
+    if (len <= 0) {
+	return 0;
+    }
+    return len >= 64 ? ~(uint64_t) 0 : ~(~(uint64_t) 0 >> len);
+}
+
+/* length of the longest common prefix of x and y */
+
+static inline int
+lcp(const uint64_t *x, const uint64_t *y)
+{
+    if (x[0] != y[0]) {
+	return __builtin_clzll(x[0] ^ y[0]);
+    }
+    if (x[1] != y[1]) {
+	return 64 + __builtin_clzll(x[1] ^ y[1]);
+    }
+    return LENGTH;
+}
+
+/*
+ * Allocate a node with prefix key/len and without children. Returns
+ * its index or NIL.
+ */
+
+static uint32_t
+node_alloc(anon_patricia_t *t, const uint64_t *key, const int len,
+	   const int complete)
+{
+    struct pnode **chunks, *p;
+    uint32_t i = t->size;
+
+    if (i == NIL) {
+	return NIL;
+    }
+    if ((i >> CHUNKSHIFT) == t->nchunks) {
+	if ((t->nchunks & (t->nchunks - 1)) == 0) {
+	    chunks = (struct pnode **) realloc(t->chunks,
+		(t->nchunks ? 2 * t->nchunks : 1) * sizeof(*chunks));
+	    if (! chunks) {
+		return NIL;
+	    }
+	    t->chunks = chunks;
+	}
+	t->chunks[t->nchunks] = (struct pnode *)
+	    malloc(CHUNK * sizeof(struct pnode));
+	if (! t->chunks[t->nchunks]) {
+	    return NIL;
+	}
+	t->nchunks++;
+    }
+    p = pnode(t, i);
+    memset(p, 0, sizeof(struct pnode));
+    p->key[0] = key[0] & mask(len);
+    p->key[1] = key[1] & mask(len - 64);
+    p->len = len;
+    p->complete = complete;
+    t->size++;
+    return i;
+}
+
+anon_patricia_t*
+anon_patricia_new(void)
+{
+    anon_patricia_t *t;
+    const uint64_t zero[2] = { 0, 0 };
+
+    t = (anon_patricia_t *) malloc(sizeof(anon_patricia_t));
+    if (! t) {
+	return NULL;
+    }
+    memset(t, 0, sizeof(anon_patricia_t));
+    if (node_alloc(t, zero, 0, 0) != 0) {
+	anon_patricia_delete(t);
+	return NULL;
+    }
+    return t;
+}
+
+/*
+ * Mark the prefix addr/prefixlen (addr in network byte order) as
+ * used and add the number of binary nodes created to *nodes (which
+ * saturates at UINT_MAX). Returns
+ * 1 if the prefix was not covered yet, 0 if it was and -1 if there
+ * is no memory.
+ */
+
+int
+anon_patricia_insert(anon_patricia_t *t, const uint8_t *addr,
+		     const int prefixlen, unsigned *nodes)
+{
+    const uint64_t key[2] = {
+	anon_pp_load64(addr), anon_pp_load64(addr + 8)
+    };
+    struct pnode *p = pnode(t, 0), *q;
+    uint32_t c, m, l;
+    int b, d;
+
+    for (;;) {
+	if (p->complete) {
+	    return 0;
+	}
+	if (p->len == prefixlen) {
+	    p->complete = 1;
+	    return 1;
+	}
+	b = BIT(key, p->len);
+	c = p->child[b];
+	if (! c) {
+	    /* a new chain of binary nodes ending in a leaf */
+	    l = node_alloc(t, key, prefixlen, 1);
+	    if (l == NIL) {
+		return -1;
+	    }
+	    d = prefixlen - p->len;
+	    *nodes = *nodes < UINT_MAX - d ? *nodes + d : UINT_MAX;
+	    p->child[b] = l;
+	    return 1;
+	}
+	q = pnode(t, c);
+	d = lcp(key, q->key);
+	if (d >= q->len && q->len <= prefixlen) {
+	    p = q;
+	    continue;
+	}
+
+	/* the prefix leaves or ends on the chain above q: store the
+	 * binary node at depth d (or prefixlen) and hang q below it */
+	if (d > prefixlen) {
+	    d = prefixlen;
+	}
+	m = node_alloc(t, key, d, d == prefixlen);
+	if (m == NIL) {
+	    return -1;
+	}
+	/* nodes stay valid, chunks never move */
+	pnode(t, m)->child[BIT(q->key, d)] = c;
+	p->child[b] = m;
+	if (d == prefixlen) {
+	    return 1;
+	}
+	p = pnode(t, m);
+    }
+}
+
+/*
+ * Store the positions of addr (network byte order) that can be
+ * flipped in pos in ascending order and return their number, see
+ * canflip() in anon-ipv6.c. The binary nodes on the chain above a
+ * stored node all have a single child; the walk along addr leaves the
+ * chain where addr and the node's prefix differ.
+ */
+
+int
+anon_patricia_canflip(anon_patricia_t *t, const uint8_t *addr, uint8_t *pos)
+{
+    const uint64_t key[2] = {
+	anon_pp_load64(addr), anon_pp_load64(addr + 8)
+    };
+    const struct pnode *p = pnode(t, 0), *q;
+    uint32_t c;
+    int d, n, k = 0;
+
+    for (;;) {
+	if (p->complete) {
+	    break;
+	}
+	if (! (p->child[0] && p->child[1])) {
+	    pos[k++] = p->len;
+	}
+	c = p->child[BIT(key, p->len)];
+	if (! c) {
+	    break;
+	}
+	q = pnode(t, c);
+	d = lcp(key, q->key);
+	for (n = p->len + 1; n < q->len && n <= d; n++) {
+	    pos[k++] = n;
+	}
+	if (d < q->len) {
+	    break;
+	}
+	p = q;
+    }
+    return k;
+}
+
+static void
+flatten(anon_patricia_t *t, const struct pnode *p, const int right,
+	struct anon_step *s, size_t *n)
+{
+    const struct pnode *q;
+    struct anon_step *u = s + (*n)++;
+    int b, d;
+
+    u->depth = p->len;
+    u->flags = right ? ANON_STEP_RIGHT : 0;
+    if (p->complete) {
+	u->flags |= ANON_STEP_COMPLETE;
+	return;
+    }
+    if (! (p->child[0] && p->child[1])) {
+	u->flags |= ANON_STEP_SINGLE;
+    }
+    for (b = 0; b < 2; b++) {
+	if (! p->child[b]) {
+	    continue;
+	}
+	q = pnode(t, p->child[b]);
+	for (d = p->len + 1; d < q->len; d++) {
+	    u = s + (*n)++;
+	    u->depth = d;
+	    u->flags = (BIT(q->key, d - 1) ? ANON_STEP_RIGHT : 0)
+		| ANON_STEP_SINGLE;
+	}
+	flatten(t, q, BIT(q->key, q->len - 1), s, n);
+    }
+}
+
+/*
+ * Store all binary nodes, the implied ones included, in preorder in
+ * s, which must have room for all of them, and return their number.
+ */
+
+size_t
+anon_patricia_flatten(anon_patricia_t *t, struct anon_step *s)
+{
+    size_t n = 0;
+
+    flatten(t, pnode(t, 0), 0, s, &n);
+    return n;
+}
+
+void
+anon_patricia_delete(anon_patricia_t *t)
+{
+    uint32_t i;
+
+    if (! t) {
+	return;
+    }
+    for (i = 0; i < t->nchunks; i++) {
+	free(t->chunks[i]);
+    }
+    if (t->chunks) {
+	free(t->chunks);
+    }
+    free(t);
+}
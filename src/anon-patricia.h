@@ -0,0 +1,32 @@
+/*
+ * anon-patricia.h --
+ *
+ * Internal path-compressed (Patricia) tree holding a set of used IPv6
+ * prefixes, an alternative to the binary used_i tree of anon-ipv6.c.
+ * Only the nodes with two children and the complete nodes are stored;
+ * chains of nodes with a single child are implied by the stored
+ * prefixes. It answers the same canflip queries. Not installed and
+ * not part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_PATRICIA_H_
+#define _ANON_PATRICIA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "anon-node.h"
+
+typedef struct _anon_patricia anon_patricia_t;
+
+anon_patricia_t* anon_patricia_new(void);
+int		anon_patricia_insert(anon_patricia_t *t, const uint8_t *addr,
+				     const int prefixlen, unsigned *nodes);
+int		anon_patricia_canflip(anon_patricia_t *t, const uint8_t *addr,
+				      uint8_t *pos);
+size_t		anon_patricia_flatten(anon_patricia_t *t, struct anon_step *s);
+void		anon_patricia_delete(anon_patricia_t *t);
+
+#endif /* _ANON_PATRICIA_H_ */
@@ -0,0 +1,286 @@
+/*
+ * anon-pcache.c --
+ *
+ * Persistent cache mapping 128-bit keys to 128-bit values. The cache
+ * is an open addressing hash table in a memory-mapped file: a header,
+ * a byte per slot telling whether the slot holds a valid entry, and
+ * the slots themselves. Entries are never removed; once the table is
+ * three quarters full, new entries are dropped.
+ *
+ * Lookups do not lock. Writers are serialized by an exclusive flock()
+ * on the file (and by a mutex between threads of one process, since
+ * they share the lock). A writer fills in a slot before it sets the
+ * valid byte, so readers never see partial entries.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "anon-pcache.h"
+
+/*
+ * Layout of a cache file: a header of PCACHE_HEADER bytes, the valid
+ * bytes (padded to PCACHE_HEADER) and the slots. All header fields
+ * are in network byte order.
+ */
+
+#define PCACHE_MAGIC	"LIBANONC"
+#define PCACHE_VERSION	1
+#define PCACHE_HEADER	64
+#define PCACHE_MAX	0x40000000	/* maximum number of slots */
+#define PCACHE_PROBES	32		/* maximum probe sequence length */
+
+struct pcache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t used;
+    uint8_t fingerprint[ANON_PCACHE_FINGERPRINT];
+};
+
+struct slot {
+    uint8_t key[16];
+    uint8_t value[16];
+};
+
+struct _anon_pcache {
+    int fd;
+    void *map;
+    size_t maplen;
+    struct pcache_header *header;
+    uint8_t *valid;
+    struct slot *slots;
+    uint32_t mask;		/* number of slots - 1 */
+    pthread_mutex_t lock;
+};
+
+static inline size_t
+valid_size(const uint32_t slots)
+{
+    return (slots + PCACHE_HEADER - 1) / PCACHE_HEADER * PCACHE_HEADER;
+}
+
+static inline size_t
+file_size(const uint32_t slots)
+{
+    return PCACHE_HEADER + valid_size(slots)
+	+ (size_t) slots * sizeof(struct slot);
+}
+
+static inline uint32_t
+hash(anon_pcache_t *c, const uint8_t *key)
+{
+    uint64_t h, l;
+
+    memcpy(&h, key, 8);
+    memcpy(&l, key + 8, 8);
+    return (uint32_t) (((h ^ (l * 0x9e3779b97f4a7c15ULL))
+			* 0xff51afd7ed558ccdULL) >> 32) & c->mask;
+}
+
+/*
+ * Initialize an empty file or check the header of an existing one.
+ * Called with the file locked. The file is sized before its header
+ * is written; a file of the right size with an all zero header was
+ * left behind by an interrupted setup and is set up again. Returns
+ * the number of slots or 0.
+ */
+
+static uint32_t
+setup(const int fd, const size_t size, const uint8_t *fingerprint)
+{
+    static const uint8_t zero[PCACHE_HEADER];
+    uint8_t header[PCACHE_HEADER];
+    struct pcache_header *h = (struct pcache_header *) header;
+    struct stat st;
+    uint32_t slots = 0;
+
+    if (fstat(fd, &st) == -1) {
+	return 0;
+    }
+
+    if (size != 0) {
+	for (slots = 1; slots < size && slots < PCACHE_MAX; slots <<= 1) ;
+    }
+    if (st.st_size == 0
+	|| (slots && (size_t) st.st_size == file_size(slots)
+	    && pread(fd, header, sizeof(header), 0) == sizeof(header)
+	    && memcmp(header, zero, sizeof(header)) == 0)) {
+	if (size == 0) {
+	    return 0;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(h->magic, PCACHE_MAGIC, sizeof(h->magic));
+	h->version = htonl(PCACHE_VERSION);
+	h->slots = htonl(slots);
+	memcpy(h->fingerprint, fingerprint, ANON_PCACHE_FINGERPRINT);
+	if (ftruncate(fd, 0) == -1
+	    || ftruncate(fd, file_size(slots)) == -1
+	    || pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+	    return 0;
+	}
+	return slots;
+    }
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+	return 0;
+    }
+    slots = ntohl(h->slots);
+    if (memcmp(h->magic, PCACHE_MAGIC, sizeof(h->magic)) != 0
+	|| ntohl(h->version) != PCACHE_VERSION
+	|| slots == 0 || slots > PCACHE_MAX || (slots & (slots - 1))
+	|| (size_t) st.st_size != file_size(slots)
+	|| memcmp(h->fingerprint, fingerprint,
+		  ANON_PCACHE_FINGERPRINT) != 0) {
+	return 0;
+    }
+    return slots;
+}
+
+/*
+ * Open the cache file filename, creating it with room for size
+ * entries if it does not exist. Fails if the file was created with a
+ * different fingerprint, i.e., for different mapping parameters.
+ */
+
+anon_pcache_t*
+anon_pcache_open(const char *filename, const size_t size,
+		 const uint8_t *fingerprint)
+{
+    anon_pcache_t *c;
+    uint32_t slots;
+    void *map;
+    int fd;
+
+    assert(filename && fingerprint);
+
+    fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+	return NULL;
+    }
+    if (flock(fd, LOCK_EX) == -1) {
+	close(fd);
+	return NULL;
+    }
+    slots = setup(fd, size, fingerprint);
+    (void) flock(fd, LOCK_UN);
+    if (! slots) {
+	close(fd);
+	return NULL;
+    }
+
+    map = mmap(NULL, file_size(slots), PROT_READ | PROT_WRITE,
+	       MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	close(fd);
+	return NULL;
+    }
+
+    c = (anon_pcache_t *) malloc(sizeof(anon_pcache_t));
+    if (! c || pthread_mutex_init(&c->lock, NULL) != 0) {
+	munmap(map, file_size(slots));
+	close(fd);
+	free(c);
+	return NULL;
+    }
+    c->fd = fd;
+    c->map = map;
+    c->maplen = file_size(slots);
+    c->header = (struct pcache_header *) map;
+    c->valid = (uint8_t *) map + PCACHE_HEADER;
+    c->slots = (struct slot *) (c->valid + valid_size(slots));
+    c->mask = slots - 1;
+    return c;
+}
+
+/*
+ * Lookup key. Returns 1 and sets value on a hit, 0 on a miss.
+ */
+
+int
+anon_pcache_get(anon_pcache_t *c, const uint8_t *key, uint8_t *value)
+{
+    uint32_t i;
+    int p;
+
+    assert(c && key && value);
+
+    for (i = hash(c, key), p = 0; p < PCACHE_PROBES;
+	 i = (i + 1) & c->mask, p++) {
+	if (! __atomic_load_n(&c->valid[i], __ATOMIC_ACQUIRE)) {
+	    return 0;
+	}
+	if (memcmp(c->slots[i].key, key, 16) == 0) {
+	    memcpy(value, c->slots[i].value, 16);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Add n entries under a single lock. Keys already present (possibly
+ * added by another process in the meantime) are left alone.
+ */
+
+void
+anon_pcache_put(anon_pcache_t *c, const uint8_t (*key)[16],
+		const uint8_t (*value)[16], const size_t n)
+{
+    uint32_t i, used, slots = c->mask + 1;
+    size_t j;
+    int p;
+
+    assert(c);
+
+    if (n == 0) {
+	return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (flock(c->fd, LOCK_EX) == -1) {
+	pthread_mutex_unlock(&c->lock);
+	return;
+    }
+    used = ntohl(c->header->used);
+    for (j = 0; j < n && used < slots / 4 * 3; j++) {
+	for (i = hash(c, key[j]), p = 0; p < PCACHE_PROBES;
+	     i = (i + 1) & c->mask, p++) {
+	    if (! c->valid[i]) {
+		memcpy(c->slots[i].key, key[j], 16);
+		memcpy(c->slots[i].value, value[j], 16);
+		__atomic_store_n(&c->valid[i], 1, __ATOMIC_RELEASE);
+		used++;
+		break;
+	    }
+	    if (memcmp(c->slots[i].key, key[j], 16) == 0) {
+		break;
+	    }
+	}
+    }
+    c->header->used = htonl(used);
+    (void) flock(c->fd, LOCK_UN);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+anon_pcache_close(anon_pcache_t *c)
+{
+    if (! c) {
+	return;
+    }
+    munmap(c->map, c->maplen);
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
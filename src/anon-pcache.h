@@ -0,0 +1,30 @@
+/*
+ * anon-pcache.h --
+ *
+ * Internal persistent cache mapping 128-bit keys to 128-bit values,
+ * kept in a memory-mapped file so that results survive across runs
+ * and can be shared by concurrent processes. Not installed and not
+ * part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_PCACHE_H_
+#define _ANON_PCACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ANON_PCACHE_FINGERPRINT 20
+
+typedef struct _anon_pcache anon_pcache_t;
+
+anon_pcache_t*	anon_pcache_open(const char *filename, const size_t size,
+				 const uint8_t *fingerprint);
+int		anon_pcache_get(anon_pcache_t *c, const uint8_t *key,
+				uint8_t *value);
+void		anon_pcache_put(anon_pcache_t *c, const uint8_t (*key)[16],
+				const uint8_t (*value)[16], const size_t n);
+void		anon_pcache_close(anon_pcache_t *c);
+
+#endif /* _ANON_PCACHE_H_ */
@@ -0,0 +1,330 @@
+/*
+ * anon-poptrie.c --
+ *
+ * Multibit trie of used IPv4 prefixes in the style of poptrie. Every
+ * node covers a binary subtree of STRIDE+1 levels (7 address bits
+ * and the roots of the next nodes) and fills one 64-byte cache line:
+ * bitmaps telling which binary nodes exist and which are complete,
+ * with the binary nodes numbered in heap order (the root is 1, the
+ * children of j are 2j and 2j+1), and a bitmap of the child nodes.
+ * The children of a node are stored next to each other, so that the
+ * index of a child is base plus the number of children before it
+ * (a popcount). Nodes at depth 28 cover the last 4 address bits and
+ * have no children.
+ *
+ * Inserting a child moves the children of its parent into a new
+ * array one node larger; freed arrays are kept on free lists by size.
+ * Nodes are allocated from chunks, which never move and which arrays
+ * never cross.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "anon-poptrie.h"
+
+#define STRIDE		7
+#define FANOUT		(1 << STRIDE)	/* children per node */
+#define LENGTH		32
+#define CHUNKSHIFT	12		/* 2^12 nodes per chunk */
+#define CHUNK		(1 << CHUNKSHIFT)
+#define NIL		0xffffffff
+
+struct pnode {
+    uint64_t exists[2];		/* binary nodes 1..FANOUT-1 */
+    uint64_t complete[2];
+    uint64_t children[2];	/* binary nodes FANOUT..2*FANOUT-1 */
+    uint32_t base;		/* index of the first child */
+    uint32_t pad[3];
+};
+
+struct _anon_poptrie {
+    struct pnode **chunks;
+    uint32_t nchunks;		/* number of allocated chunks */
+    uint32_t size;		/* number of nodes taken from the chunks */
+    uint32_t free[FANOUT + 1];	/* free arrays by size */
+};
+
+#define TEST(b, j)	(((b)[(j) >> 6] >> ((j) & 63)) & 1)
+#define SET(b, j)	((b)[(j) >> 6] |= (uint64_t) 1 << ((j) & 63))
+
+/* both binary children 2j and 2j+1 (an aligned pair) present? */
+#define BOTH(b, j)	((((b)[(2*(j)) >> 6] >> ((2*(j)) & 63)) & 3) == 3)
+
+static inline struct pnode*
+pnode(anon_poptrie_t *t, const uint32_t i)
+{
+    return &t->chunks[i >> CHUNKSHIFT][i & (CHUNK - 1)];
+}
+
+/* number of children of p before child c */
+
+static inline int
+rank(const struct pnode *p, const int c)
+{
+    uint64_t lo = p->children[0], hi = p->children[1];
+
+    if (c < 64) {
+	return __builtin_popcountll(lo & (((uint64_t) 1 << c) - 1));
+    }
+    return __builtin_popcountll(lo)
+	+ __builtin_popcountll(hi & (((uint64_t) 1 << (c - 64)) - 1));
+}
+
+static inline int
+count(const struct pnode *p)
+{
+    return __builtin_popcountll(p->children[0])
+	+ __builtin_popcountll(p->children[1]);
+}
+
+/*
+ * Allocate an array of n nodes. Returns the index of the first node
+ * or NIL.
+ */
+
+static uint32_t
+array_alloc(anon_poptrie_t *t, const int n)
+{
+    struct pnode **chunks;
+    uint32_t i;
+    void *chunk;
+
+    if (t->free[n] != NIL) {
+	i = t->free[n];
+	t->free[n] = pnode(t, i)->base;
+	return i;
+    }
+
+    if ((uint64_t) t->size + n > (uint64_t) t->nchunks << CHUNKSHIFT) {
+	if (t->nchunks == (NIL >> CHUNKSHIFT)) {
+	    return NIL;
+	}
+	if ((t->nchunks & (t->nchunks - 1)) == 0) {
+	    chunks = (struct pnode **) realloc(t->chunks,
+		(t->nchunks ? 2 * t->nchunks : 1) * sizeof(*chunks));
+	    if (! chunks) {
+		return NIL;
+	    }
+	    t->chunks = chunks;
+	}
+	if (posix_memalign(&chunk, 64, CHUNK * sizeof(struct pnode)) != 0) {
+	    return NIL;
+	}
+	t->chunks[t->nchunks] = (struct pnode *) chunk;
+	t->size = t->nchunks << CHUNKSHIFT;
+	t->nchunks++;
+    }
+    i = t->size;
+    t->size += n;
+    return i;
+}
+
+static inline void
+array_free(anon_poptrie_t *t, const uint32_t i, const int n)
+{
+    pnode(t, i)->base = t->free[n];
+    t->free[n] = i;
+}
+
+anon_poptrie_t*
+anon_poptrie_new(void)
+{
+    anon_poptrie_t *t;
+    int n;
+
+    t = (anon_poptrie_t *) malloc(sizeof(anon_poptrie_t));
+    if (! t) {
+	return NULL;
+    }
+    memset(t, 0, sizeof(anon_poptrie_t));
+    for (n = 0; n <= FANOUT; n++) {
+	t->free[n] = NIL;
+    }
+    if (array_alloc(t, 1) != 0) {
+	anon_poptrie_delete(t);
+	return NULL;
+    }
+    memset(pnode(t, 0), 0, sizeof(struct pnode));
+    SET(pnode(t, 0)->exists, 1);
+    return t;
+}
+
+/*
+ * Add child c to node p. Returns the index of the new child or NIL.
+ */
+
+static uint32_t
+add_child(anon_poptrie_t *t, struct pnode *p, const int c)
+{
+    const int n = count(p), r = rank(p, c);
+    uint32_t a;
+
+    a = array_alloc(t, n + 1);
+    if (a == NIL) {
+	return NIL;
+    }
+    if (n) {
+	memcpy(pnode(t, a), pnode(t, p->base), r * sizeof(struct pnode));
+	memcpy(pnode(t, a + r + 1), pnode(t, p->base + r),
+	       (n - r) * sizeof(struct pnode));
+	array_free(t, p->base, n);
+    }
+    memset(pnode(t, a + r), 0, sizeof(struct pnode));
+    SET(pnode(t, a + r)->exists, 1);
+    p->base = a;
+    SET(p->children, c);
+    return a + r;
+}
+
+/*
+ * Mark the prefix addr/prefixlen (host byte order) as used and add
+ * the number of binary nodes created to *nodes. Returns 1 if the
+ * prefix was not covered yet, 0 if it was and -1 if there is no
+ * memory.
+ */
+
+int
+anon_poptrie_insert(anon_poptrie_t *t, const uint32_t addr,
+		    const int prefixlen, unsigned *nodes)
+{
+    struct pnode *p = pnode(t, 0);
+    uint32_t j = 1, c;
+    int n;
+
+    for (n = 0; n < prefixlen; n++) {
+	if (TEST(p->complete, j)) {
+	    return 0;
+	}
+	j = 2*j + ((addr >> (LENGTH - 1 - n)) & 1);
+	if (j < FANOUT) {
+	    if (! TEST(p->exists, j)) {
+		SET(p->exists, j);
+		(*nodes)++;
+	    }
+	    continue;
+	}
+	c = j - FANOUT;
+	if (TEST(p->children, c)) {
+	    p = pnode(t, p->base + rank(p, c));
+	} else {
+	    c = add_child(t, p, c);
+	    if (c == NIL) {
+		return -1;
+	    }
+	    p = pnode(t, c);
+	    (*nodes)++;
+	}
+	j = 1;
+    }
+    if (TEST(p->complete, j)) {
+	return 0;
+    }
+    SET(p->complete, j);
+    return 1;
+}
+
+/*
+ * Bit n (counted from the most significant bit) of the result is set
+ * if bit n of addr can be flipped, see canflip() in anon-ip.c.
+ */
+
+uint32_t
+anon_poptrie_canflip(anon_poptrie_t *t, const uint32_t addr)
+{
+    const struct pnode *p = pnode(t, 0);
+    uint32_t j = 1, mask = 0;
+    int n, c;
+
+    for (n = 0; n < LENGTH; n++) {
+	if (TEST(p->complete, j)) {
+	    break;
+	}
+	if (2*j < FANOUT ? ! BOTH(p->exists, j)
+	    : ! BOTH(p->children, j - FANOUT/2)) {
+	    mask |= (uint32_t) 0x80000000 >> n;
+	}
+	j = 2*j + ((addr >> (LENGTH - 1 - n)) & 1);
+	if (j < FANOUT) {
+	    if (! TEST(p->exists, j)) {
+		break;
+	    }
+	    continue;
+	}
+	c = j - FANOUT;
+	if (! TEST(p->children, c)) {
+	    break;
+	}
+	p = pnode(t, p->base + rank(p, c));
+	j = 1;
+    }
+    return mask;
+}
+
+static void
+flatten(anon_poptrie_t *t, const struct pnode *p, const uint32_t j,
+	const int depth, const int right, struct anon_step *s, size_t *n)
+{
+    struct anon_step *u = s + (*n)++;
+    int k;
+
+    u->depth = depth;
+    u->flags = right ? ANON_STEP_RIGHT : 0;
+    if (TEST(p->complete, j)) {
+	u->flags |= ANON_STEP_COMPLETE;
+	return;
+    }
+    if (2*j < FANOUT) {
+	if (! BOTH(p->exists, j)) {
+	    u->flags |= ANON_STEP_SINGLE;
+	}
+	for (k = 0; k < 2; k++) {
+	    if (TEST(p->exists, 2*j + k)) {
+		flatten(t, p, 2*j + k, depth + 1, k, s, n);
+	    }
+	}
+    } else {
+	if (! BOTH(p->children, j - FANOUT/2)) {
+	    u->flags |= ANON_STEP_SINGLE;
+	}
+	for (k = 0; k < 2; k++) {
+	    if (TEST(p->children, 2*j + k - FANOUT)) {
+		flatten(t, pnode(t, p->base + rank(p, 2*j + k - FANOUT)),
+			1, depth + 1, k, s, n);
+	    }
+	}
+    }
+}
+
+/*
+ * Store the binary nodes in preorder in s, which must have room for
+ * all of them, and return their number.
+ */
+
+size_t
+anon_poptrie_flatten(anon_poptrie_t *t, struct anon_step *s)
+{
+    size_t n = 0;
+
+    flatten(t, pnode(t, 0), 1, 0, 0, s, &n);
+    return n;
+}
+
+void
+anon_poptrie_delete(anon_poptrie_t *t)
+{
+    uint32_t i;
+
+    if (! t) {
+	return;
+    }
+    for (i = 0; i < t->nchunks; i++) {
+	free(t->chunks[i]);
+    }
+    if (t->chunks) {
+	free(t->chunks);
+    }
+    free(t);
+}
@@ -0,0 +1,29 @@
+/*
+ * anon-poptrie.h --
+ *
+ * Internal multibit trie holding a set of used IPv4 prefixes, an
+ * alternative to the binary used_i tree of anon-ip.c. It answers the
+ * same canflip queries with a node (one cache line) per 7 address
+ * bits. Not installed and not part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_POPTRIE_H_
+#define _ANON_POPTRIE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "anon-node.h"
+
+typedef struct _anon_poptrie anon_poptrie_t;
+
+anon_poptrie_t*	anon_poptrie_new(void);
+int		anon_poptrie_insert(anon_poptrie_t *t, const uint32_t addr,
+				    const int prefixlen, unsigned *nodes);
+uint32_t	anon_poptrie_canflip(anon_poptrie_t *t, const uint32_t addr);
+size_t		anon_poptrie_flatten(anon_poptrie_t *t, struct anon_step *s);
+void		anon_poptrie_delete(anon_poptrie_t *t);
+
+#endif /* _ANON_POPTRIE_H_ */
@@ -0,0 +1,145 @@
+/*
+ * anon-pp.h --
+ *
+ * Internal width-generic building blocks of the prefix-preserving
+ * (Crypto-PAn) mappings. ANON_PP_DEFINE(name, width, word_t)
+ * generates static inline functions for addresses of width bits held
+ * in an unsigned integer type word_t, most significant bit first, so
+ * that bit i of the address is bit width-1-i of the word:
+ *
+ *   name_load(c)       address bytes (network order) to a word
+ *   name_store(w, c)   word to address bytes
+ *   name_mask(pos)     word with the first pos address bits set
+ *   name_prf_input()   PRF input of round pos: the first pos bits of
+ *                      the address followed by the secret pad
+ *   name_bits()        flip bits of rounds from..to-1 as a word
+ *
+ * The 128-bit instance needs a native 128-bit integer type; where
+ * there is none, ANON_PP_U128 is not defined.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_PP_H_
+#define _ANON_PP_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SIZEOF_INT128__
+#define ANON_PP_U128
+typedef unsigned __int128 anon_u128_t;
+#endif
+
+/* big-endian 64-bit loads and stores */
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ANON_PP_BE64(q)	__builtin_bswap64(q)
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ANON_PP_BE64(q)	(q)
+#endif
+
+static inline uint64_t
+anon_pp_load64(const uint8_t *c)
+{
+#ifdef ANON_PP_BE64
+    uint64_t q;
+
+    memcpy(&q, c, 8);
+    return ANON_PP_BE64(q);
+#else
+    return ((uint64_t) c[0] << 56) | ((uint64_t) c[1] << 48)
+	| ((uint64_t) c[2] << 40) | ((uint64_t) c[3] << 32)
+	| ((uint64_t) c[4] << 24) | ((uint64_t) c[5] << 16)
+	| ((uint64_t) c[6] << 8) | (uint64_t) c[7];
+#endif
+}
+
+static inline void
+anon_pp_store64(uint64_t q, uint8_t *c)
+{
+#ifdef ANON_PP_BE64
+    q = ANON_PP_BE64(q);
+    memcpy(c, &q, 8);
+#else
+    c[0] = q >> 56; c[1] = q >> 48; c[2] = q >> 40; c[3] = q >> 32;
+    c[4] = q >> 24; c[5] = q >> 16; c[6] = q >> 8; c[7] = q;
+#endif
+}
+
+/* shifts by 64 bits in steps, so that they are defined (and yield 0)
+ * for words narrower than 64 bits */
+
+#define ANON_PP_SHL64(w)	(((((w) << 16) << 16) << 16) << 16)
+#define ANON_PP_SHR64(w)	(((((w) >> 16) >> 16) >> 16) >> 16)
+
+#define ANON_PP_DEFINE(name, width, word_t)				\
+									\
+static inline word_t							\
+name##_load(const uint8_t *c)						\
+{									\
+    word_t w = 0;							\
+    int i;								\
+									\
+    for (i = 0; i + 8 <= (width)/8; i += 8) {				\
+	w = ANON_PP_SHL64(w) | anon_pp_load64(c + i);			\
+    }									\
+    for (; i < (width)/8; i++) {					\
+	w = (w << 8) | c[i];						\
+    }									\
+    return w;								\
+}									\
+									\
+static inline void							\
+name##_store(word_t w, uint8_t *c)					\
+{									\
+    int i;								\
+									\
+    for (i = (width)/8; i % 8; i--) {					\
+	c[i - 1] = (uint8_t) w;						\
+	w >>= 8;							\
+    }									\
+    for (; i >= 8; i -= 8) {						\
+	anon_pp_store64((uint64_t) w, c + i - 8);			\
+	w = ANON_PP_SHR64(w);						\
+    }									\
+}									\
+static inline word_t							\
+name##_mask(const int pos)						\
+{									\
+    const word_t ones = ((word_t) ~(word_t) 0)				\
+	>> (8 * sizeof(word_t) - (width));				\
+									\
+    return pos ? (ones << ((width) - pos)) & ones : 0;			\
+}									\
+									\
+/* m_pad is the 16 byte secret pad and mpad its first width bits */	\
+									\
+static inline void							\
+name##_prf_input(const word_t addr, const uint8_t *m_pad,		\
+		 const word_t mpad, const int pos, uint8_t *rin_input)	\
+{									\
+    const word_t m = name##_mask(pos);					\
+									\
+    memcpy(rin_input, m_pad, 16);					\
+    name##_store((addr & m) | (mpad & ~m), rin_input);			\
+}									\
+									\
+/* rin_output holds the cipher outputs of rounds from..to-1 */		\
+									\
+static inline word_t							\
+name##_bits(const uint8_t (*rin_output)[16], const int from,		\
+	    const int to)						\
+{									\
+    word_t w = 0;							\
+    int pos;								\
+									\
+    for (pos = from; pos < to; pos++) {					\
+	w |= (word_t) (rin_output[pos - from][0] >> 7)			\
+	    << ((width) - 1 - pos);					\
+    }									\
+    return w;								\
+}
+
+#endif /* _ANON_PP_H_ */
@@ -0,0 +1,71 @@
+/*
+ * anon-rcu.c --
+ *
+ * Publication of read-mostly data, see anon-rcu.h. A reader counts
+ * itself under the epoch it finds before it loads the current
+ * version. After switching versions, a writer flips the epoch and
+ * waits until the readers counted under the old epoch have left, and
+ * then does the same for the other epoch. A reader that found the
+ * previous version had counted itself in before the switch, so it
+ * has left once both counts have drained. New readers count
+ * themselves under the flipped epoch, so a count being waited for
+ * can only go down.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <string.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "anon-rcu.h"
+
+void
+anon_rcu_init(anon_rcu_t *r)
+{
+    assert(r);
+
+    memset(r, 0, sizeof(anon_rcu_t));
+    pthread_mutex_init(&r->lock, NULL);
+}
+
+/*
+ * Make v the current version. Returns the previous version (or
+ * NULL) once no reader uses it anymore, so that the caller can
+ * release it. Writers are serialized.
+ */
+
+void*
+anon_rcu_publish(anon_rcu_t *r, void *v)
+{
+    void *old;
+    unsigned epoch;
+    int i;
+
+    assert(r);
+
+    pthread_mutex_lock(&r->lock);
+    old = __atomic_exchange_n(&r->current, v, __ATOMIC_SEQ_CST);
+    for (i = 0; i < 2; i++) {
+	epoch = r->epoch;
+	__atomic_store_n(&r->epoch, ! epoch, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&r->readers[epoch], __ATOMIC_SEQ_CST)) {
+	    sched_yield();
+	}
+    }
+    pthread_mutex_unlock(&r->lock);
+    return old;
+}
+
+/*
+ * Release the resources of r. The current version is left to the
+ * caller.
+ */
+
+void
+anon_rcu_cleanup(anon_rcu_t *r)
+{
+    if (r) {
+	pthread_mutex_destroy(&r->lock);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * anon-rcu.h --
+ *
+ * Internal publication of read-mostly data in the style of RCU. A
+ * writer replaces the current version with a single atomic store and
+ * releases the previous one after a grace period, once no reader can
+ * still use it. Readers never lock or wait; they only count
+ * themselves in and out. Not installed and not part of the libanon
+ * API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_RCU_H_
+#define _ANON_RCU_H_
+
+#include <pthread.h>
+
+typedef struct {
+    void *current;		/* published version or NULL */
+    unsigned epoch;		/* readers count themselves under it */
+    unsigned long readers[2];	/* readers per epoch */
+    pthread_mutex_t lock;	/* serializes writers */
+} anon_rcu_t;
+
+void		anon_rcu_init(anon_rcu_t *r);
+void*		anon_rcu_publish(anon_rcu_t *r, void *v);
+void		anon_rcu_cleanup(anon_rcu_t *r);
+
+/*
+ * Enter a read-side section and return the current version, which
+ * stays valid until anon_rcu_leave() is called with the same epoch.
+ */
+
+static inline void*
+anon_rcu_enter(anon_rcu_t *r, unsigned *epoch)
+{
+    *epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&r->readers[*epoch], 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->current, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+anon_rcu_leave(anon_rcu_t *r, const unsigned epoch)
+{
+    __atomic_fetch_sub(&r->readers[epoch], 1, __ATOMIC_RELEASE);
+}
+
+/* has any version been published yet? */
+
+static inline int
+anon_rcu_published(anon_rcu_t *r)
+{
+    return __atomic_load_n(&r->current, __ATOMIC_RELAXED) != NULL;
+}
+
+#endif /* _ANON_RCU_H_ */
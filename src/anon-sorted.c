@@ -0,0 +1,460 @@
+/*
+ * anon-sorted.c --
+ *
+ * Used IPv6 prefixes as a sorted array of 128-bit keys (the prefixes
+ * with the bits from the prefix length on cleared) and their prefix
+ * lengths. No prefix in the array covers another, so that the keys
+ * are the starts of disjoint address ranges in ascending order. New
+ * prefixes are appended and merged into the sorted part when the set
+ * is used next.
+ *
+ * The binary used_i tree is implied: a node at depth d on the path of
+ * an address exists if some key shares d bits with the address, and
+ * it has a second child if a key branches off the path there, that
+ * is, shares exactly d bits with the address. The keys sharing the
+ * most bits with an address are its neighbours in the array, and the
+ * keys branching off at one depth are contiguous, so that the
+ * branching depths are found by skipping from subtree to subtree.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "anon-sorted.h"
+#include "anon-pp.h"
+
+#define LENGTH		128
+
+struct _anon_sorted {
+    uint64_t (*key)[2];		/* sorted keys, then the appended ones */
+    uint8_t *len;		/* prefix lengths */
+    size_t n;			/* number of sorted keys */
+    size_t size;		/* number of keys */
+    size_t alloc;		/* number of allocated keys */
+};
+
+#define BIT(k, i)	(((k)[(i) >> 6] >> (63 - ((i) & 63))) & 1)
+
+/* word with the first len bits set (none if len <= 0) */
+
+static inline uint64_t
+mask(const int len)
+{
+    if (len <= 0) {
+	return 0;
+    }
+    return len >= 64 ? ~(uint64_t) 0 : ~(~(uint64_t) 0 >> len);
+}
+
+/* length of the longest common prefix of x and y */
+
+static inline int
+lcp(const uint64_t *x, const uint64_t *y)
+{
+    if (x[0] != y[0]) {
+	return __builtin_clzll(x[0] ^ y[0]);
+    }
+    if (x[1] != y[1]) {
+	return 64 + __builtin_clzll(x[1] ^ y[1]);
+    }
+    return LENGTH;
+}
+
+static inline int
+keycmp(const uint64_t *x, const uint64_t *y)
+{
+    if (x[0] != y[0]) {
+	return x[0] < y[0] ? -1 : 1;
+    }
+    if (x[1] != y[1]) {
+	return x[1] < y[1] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* order by key, a shorter prefix before the longer ones it covers */
+
+static inline int
+less(const uint64_t *x, const int xl, const uint64_t *y, const int yl)
+{
+    const int c = keycmp(x, y);
+
+    return c < 0 || (c == 0 && xl < yl);
+}
+
+static inline void
+swap(anon_sorted_t *t, const size_t i, const size_t j)
+{
+    uint64_t k0 = t->key[i][0], k1 = t->key[i][1];
+    uint8_t l = t->len[i];
+
+    t->key[i][0] = t->key[j][0];
+    t->key[i][1] = t->key[j][1];
+    t->len[i] = t->len[j];
+    t->key[j][0] = k0;
+    t->key[j][1] = k1;
+    t->len[j] = l;
+}
+
+/* quicksort of the keys lo..hi-1 */
+
+static void
+sort(anon_sorted_t *t, size_t lo, size_t hi)
+{
+    uint64_t p[2];
+    size_t i, j, m;
+    int pl;
+
+    while (hi - lo > 16) {
+	m = lo + (hi - lo) / 2;
+	if (less(t->key[m], t->len[m], t->key[lo], t->len[lo])) {
+	    swap(t, m, lo);
+	}
+	if (less(t->key[hi-1], t->len[hi-1], t->key[m], t->len[m])) {
+	    swap(t, hi - 1, m);
+	    if (less(t->key[m], t->len[m], t->key[lo], t->len[lo])) {
+		swap(t, m, lo);
+	    }
+	}
+	p[0] = t->key[m][0];
+	p[1] = t->key[m][1];
+	pl = t->len[m];
+	i = lo - 1;
+	j = hi;
+	for (;;) {
+	    do i++; while (less(t->key[i], t->len[i], p, pl));
+	    do j--; while (less(p, pl, t->key[j], t->len[j]));
+	    if (i >= j) {
+		break;
+	    }
+	    swap(t, i, j);
+	}
+	/* lo..j and j+1..hi-1, recurse into the smaller one */
+	if (j + 1 - lo < hi - j - 1) {
+	    sort(t, lo, j + 1);
+	    lo = j + 1;
+	} else {
+	    sort(t, j + 1, hi);
+	    hi = j + 1;
+	}
+    }
+    for (i = lo + 1; i < hi; i++) {
+	for (j = i; j > lo; j--) {
+	    if (! less(t->key[j], t->len[j], t->key[j-1], t->len[j-1])) {
+		break;
+	    }
+	    swap(t, j, j - 1);
+	}
+    }
+}
+
+anon_sorted_t*
+anon_sorted_new(void)
+{
+    anon_sorted_t *t;
+
+    t = (anon_sorted_t *) malloc(sizeof(anon_sorted_t));
+    if (! t) {
+	return NULL;
+    }
+    memset(t, 0, sizeof(anon_sorted_t));
+    return t;
+}
+
+/*
+ * Make room for n more keys. Returns 0 on success, -1 otherwise.
+ */
+
+int
+anon_sorted_reserve(anon_sorted_t *t, const size_t n)
+{
+    uint64_t (*key)[2];
+    uint8_t *len;
+    size_t alloc = t->alloc ? t->alloc : 1024;
+
+    if (t->size + n <= t->alloc) {
+	return 0;
+    }
+    while (alloc < t->size + n) {
+	alloc *= 2;
+    }
+    key = (uint64_t (*)[2]) realloc(t->key, alloc * sizeof(*key));
+    if (! key) {
+	return -1;
+    }
+    t->key = key;
+    len = (uint8_t *) realloc(t->len, alloc);
+    if (! len) {
+	return -1;
+    }
+    t->len = len;
+    t->alloc = alloc;
+    return 0;
+}
+
+/*
+ * Add the prefix addr/prefixlen (addr in network byte order). Returns
+ * 0 on success, -1 otherwise.
+ */
+
+int
+anon_sorted_insert(anon_sorted_t *t, const uint8_t *addr,
+		   const int prefixlen)
+{
+    if (anon_sorted_reserve(t, 1) != 0) {
+	return -1;
+    }
+    t->key[t->size][0] = anon_pp_load64(addr) & mask(prefixlen);
+    t->key[t->size][1] = anon_pp_load64(addr + 8) & mask(prefixlen - 64);
+    t->len[t->size] = prefixlen;
+    t->size++;
+    return 0;
+}
+
+/*
+ * Sort the appended keys (unless they come sorted) and merge them
+ * into the sorted ones, dropping the keys covered by others. Stores
+ * the number of nodes of the implied used_i tree (saturated at
+ * UINT_MAX) and the number of keys.
+ * Returns 0 on success, -1 if there is no memory.
+ */
+
+int
+anon_sorted_build(anon_sorted_t *t, unsigned *nodes, size_t *prefixes)
+{
+    uint64_t (*key)[2];
+    uint8_t *len;
+    uint64_t count;
+    size_t i, j, k, m = t->size - t->n;
+
+    if (! m) {
+	return 0;
+    }
+    for (i = t->n + 1; i < t->size; i++) {
+	if (less(t->key[i], t->len[i], t->key[i-1], t->len[i-1])) {
+	    sort(t, t->n, t->size);
+	    break;
+	}
+    }
+
+    /* merge from the back, with the appended keys moved aside */
+    if (t->n) {
+	key = (uint64_t (*)[2]) malloc(m * sizeof(*key));
+	len = (uint8_t *) malloc(m);
+	if (! key || ! len) {
+	    free(key);
+	    free(len);
+	    return -1;
+	}
+	memcpy(key, t->key + t->n, m * sizeof(*key));
+	memcpy(len, t->len + t->n, m);
+	i = t->n;
+	j = m;
+	k = t->size;
+	while (j > 0) {
+	    k--;
+	    if (i > 0
+		&& less(key[j-1], len[j-1], t->key[i-1], t->len[i-1])) {
+		i--;
+		t->key[k][0] = t->key[i][0];
+		t->key[k][1] = t->key[i][1];
+		t->len[k] = t->len[i];
+	    } else {
+		j--;
+		t->key[k][0] = key[j][0];
+		t->key[k][1] = key[j][1];
+		t->len[k] = len[j];
+	    }
+	}
+	free(key);
+	free(len);
+    }
+
+    /* a key covered by another follows it */
+    for (i = 0, k = 0; i < t->size; i++) {
+	if (k && lcp(t->key[k-1], t->key[i]) >= t->len[k-1]) {
+	    continue;
+	}
+	t->key[k][0] = t->key[i][0];
+	t->key[k][1] = t->key[i][1];
+	t->len[k] = t->len[i];
+	k++;
+    }
+    t->n = t->size = k;
+
+    /* a key adds the nodes below the one it shares with its
+     * predecessor */
+    count = 1;
+    for (i = 0; i < t->n; i++) {
+	count += t->len[i] - (i ? lcp(t->key[i-1], t->key[i]) : 0);
+    }
+    *nodes = count < UINT_MAX ? (unsigned) count : UINT_MAX;
+    *prefixes = t->n;
+    return 0;
+}
+
+/* first of the keys lo..hi-1 greater than x (hi if none) */
+
+static inline size_t
+upper(const anon_sorted_t *t, size_t lo, size_t hi, const uint64_t *x)
+{
+    size_t mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (keycmp(t->key[mid], x) <= 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+/* first of the keys lo..hi-1 not less than x (hi if none) */
+
+static inline size_t
+lower(const anon_sorted_t *t, size_t lo, size_t hi, const uint64_t *x)
+{
+    size_t mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (keycmp(t->key[mid], x) < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+/*
+ * Store the positions of addr (network byte order) that can be
+ * flipped in pos in ascending order and return their number, see
+ * canflip() in anon-ipv6.c. The keys must have been built.
+ *
+ * The deepest node on the path of addr is at depth d, the length of
+ * the prefix containing addr or else the longest common prefix with
+ * a neighbour. The positions 0..d (0..d-1 below a complete node) can
+ * be flipped, except those above d where a key branches off. The
+ * keys branching off at one depth are skipped at once by galloping.
+ */
+
+int
+anon_sorted_canflip(anon_sorted_t *t, const uint8_t *addr, uint8_t *pos)
+{
+    const uint64_t key[2] = {
+	anon_pp_load64(addr), anon_pp_load64(addr + 8)
+    };
+    uint64_t branch[2] = { 0, 0 }, x[2];
+    size_t p, e, j, lo, hi, step;
+    int d = 0, l, last, n, k = 0, contained = 0;
+
+    p = upper(t, 0, t->n, key);
+    if (p > 0) {
+	d = lcp(t->key[p-1], key);
+	if (d >= t->len[p-1]) {
+	    d = t->len[p-1];
+	    contained = 1;
+	}
+    }
+    if (! contained && p < t->n && (l = lcp(t->key[p], key)) > d) {
+	d = l;
+    }
+
+    /* keys below addr, which branch off to the left */
+    for (e = contained ? p - 1 : p; e > 0; ) {
+	l = lcp(t->key[e-1], key);
+	if (l < d) {
+	    branch[l >> 6] |= (uint64_t) 1 << (63 - (l & 63));
+	}
+	x[0] = key[0] & mask(l);
+	x[1] = key[1] & mask(l - 64);
+	for (hi = e - 1, step = 1; ; step <<= 1) {
+	    if (hi < step) {
+		lo = 0;
+		break;
+	    }
+	    if (keycmp(t->key[hi - step], x) < 0) {
+		lo = hi - step + 1;
+		break;
+	    }
+	    hi -= step;
+	}
+	e = lower(t, lo, hi, x);
+    }
+
+    /* keys above addr, which branch off to the right */
+    for (j = p; j < t->n; ) {
+	l = lcp(t->key[j], key);
+	if (l < d) {
+	    branch[l >> 6] |= (uint64_t) 1 << (63 - (l & 63));
+	}
+	x[0] = (key[0] & mask(l)) | ~mask(l);
+	x[1] = (key[1] & mask(l - 64)) | ~mask(l - 64);
+	for (lo = j, step = 1; ; step <<= 1) {
+	    hi = t->n - lo > step ? lo + step : t->n;
+	    if (hi == t->n || keycmp(t->key[hi], x) > 0) {
+		break;
+	    }
+	    lo = hi;
+	}
+	j = upper(t, lo + 1, hi, x);
+    }
+
+    last = contained ? d - 1 : d;
+    for (n = 0; n <= last; n++) {
+	if (! BIT(branch, n)) {
+	    pos[k++] = n;
+	}
+    }
+    return k;
+}
+
+/*
+ * Store the nodes of the implied used_i tree in preorder in s, which
+ * must have room for all of them, and return their number. The keys
+ * must have been built. A node turns out to have two children when a
+ * later key branches off at its depth.
+ */
+
+size_t
+anon_sorted_flatten(anon_sorted_t *t, struct anon_step *s)
+{
+    size_t path[LENGTH + 1];	/* steps of the nodes of the last key */
+    size_t i, n = 0;
+    int d, l;
+
+    s[n].depth = 0;
+    s[n].flags = ANON_STEP_SINGLE;
+    path[0] = n++;
+    for (i = 0; i < t->n; i++) {
+	l = 0;
+	if (i) {
+	    l = lcp(t->key[i-1], t->key[i]);
+	    s[path[l]].flags &= ~ANON_STEP_SINGLE;
+	}
+	for (d = l + 1; d <= t->len[i]; d++) {
+	    s[n].depth = d;
+	    s[n].flags = (BIT(t->key[i], d - 1) ? ANON_STEP_RIGHT : 0)
+		| (d == t->len[i] ? ANON_STEP_COMPLETE : ANON_STEP_SINGLE);
+	    path[d] = n++;
+	}
+    }
+    return n;
+}
+
+void
+anon_sorted_delete(anon_sorted_t *t)
+{
+    if (! t) {
+	return;
+    }
+    free(t->key);
+    free(t->len);
+    free(t);
+}
@@ -0,0 +1,34 @@
+/*
+ * anon-sorted.h --
+ *
+ * Internal set of used IPv6 prefixes kept as a sorted array of 128-bit
+ * keys, an alternative to the binary used_i tree of anon-ipv6.c. The
+ * canflip queries are answered from the longest common prefixes of an
+ * address with its neighbours in the array. Not installed and not
+ * part of the libanon API.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#ifndef _ANON_SORTED_H_
+#define _ANON_SORTED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "anon-node.h"
+
+typedef struct _anon_sorted anon_sorted_t;
+
+anon_sorted_t*	anon_sorted_new(void);
+int		anon_sorted_insert(anon_sorted_t *t, const uint8_t *addr,
+				   const int prefixlen);
+int		anon_sorted_reserve(anon_sorted_t *t, const size_t n);
+int		anon_sorted_build(anon_sorted_t *t, unsigned *nodes,
+				  size_t *prefixes);
+int		anon_sorted_canflip(anon_sorted_t *t, const uint8_t *addr,
+				    uint8_t *pos);
+size_t		anon_sorted_flatten(anon_sorted_t *t, struct anon_step *s);
+void		anon_sorted_delete(anon_sorted_t *t);
+
+#endif /* _ANON_SORTED_H_ */
@@ -44,6 +44,8 @@ struct _anon_uint64 {
     int state;
     uint64_t lower, upper;
     uint64_t range; /* range = upper - lower + 1 */
+    struct hash_node *table; /* sorted mappings once frozen, or NULL */
+    size_t size;	/* number of entries in table */
 };
 
 enum anon_uint64_state_t {INIT=0, /* anon object initialized,
@@ -75,6 +77,36 @@ anon_uint64_cmp(const struct hash_node *arg1, const struct hash_node *arg2) {
 static IMPLEMENT_LHASH_HASH_FN(anon_uint64_hash, const struct hash_node *);
 static IMPLEMENT_LHASH_COMP_FN(anon_uint64_cmp, const struct hash_node *);
 
+/* functions for the sorted table of a frozen object */
+static int
+table_cmp(const void *arg1, const void *arg2)
+{
+    const struct hash_node *p = arg1, *q = arg2;
+
+    return (p->num > q->num) - (p->num < q->num);
+}
+
+static const struct hash_node*
+table_lookup(anon_uint64_t *a, const uint64_t num)
+{
+    struct hash_node node;
+
+    node.num = num;
+    return bsearch(&node, a->table, a->size, sizeof(struct hash_node),
+		   table_cmp);
+}
+
+/* move an entry of the lhash table into the table */
+static void
+table_collect(void *arg1, void *arg2)
+{
+    struct hash_node *node = arg1;
+    anon_uint64_t *a = arg2;
+
+    a->table[a->size++] = *node;
+    free(node);
+}
+
 /* returns 0 if we're trying to insert a number not yet in the list */
 static int
 list_insert(struct node **list, const uint64_t num)
@@ -267,6 +299,10 @@ anon_uint64_delete(anon_uint64_t *a)
 	free(q);
     }
 
+    if (a->table) {
+	free(a->table);
+    }
+
     free(a);
 }
 
@@ -292,6 +328,9 @@ anon_uint64_set_used(anon_uint64_t *a, const uint64_t num)
 {
     assert(a);
     
+    if (a->table) {
+	return -1;
+    }
     (void) anon_uint64_set_state(a, INIT);
 
     if (list_insert(&(a->list), num) >= 0) {
@@ -313,6 +352,14 @@ anon_uint64_map(anon_uint64_t *a, const uint64_t num, uint64_t *anum)
     struct hash_node *p;
     int tmp;
 
+    if (a->table) {
+	p = (struct hash_node *) table_lookup(a, num);
+	if (a->state != NON_LEX || ! p) {
+	    return -1;
+	}
+	*anum = p->hash;
+	return 0;
+    }
     (void) anon_uint64_set_state(a, NON_LEX);
 
     /* lookup anon. number in lhash table */
@@ -346,6 +393,15 @@ anon_uint64_map_lex(anon_uint64_t *a, const uint64_t num, uint64_t *anum)
 {
     struct hash_node node;
     struct hash_node *p;
+
+    if (a->table) {
+	p = (struct hash_node *) table_lookup(a, num);
+	if (a->state != LEX || ! p) {
+	    return -1;
+	}
+	*anum = p->hash;
+	return 0;
+    }
     (void) anon_uint64_set_state(a, LEX);
     
     /* lookup the anonymized number address in the lhash table */
@@ -356,3 +412,44 @@ anon_uint64_map_lex(anon_uint64_t *a, const uint64_t num, uint64_t *anum)
     *anum = p->hash;
     return 0;
 }
+
+/*
+ * Freeze the object for concurrent mapping: the mappings (all of
+ * them unless anon_uint64_map() has been used) move from the lhash
+ * table into a sorted array, which the map functions then search
+ * without changing anything. No more numbers can be marked as used
+ * and anon_uint64_map() fails for numbers it has not mapped before.
+ */
+int
+anon_uint64_freeze(anon_uint64_t *a)
+{
+    struct node *p;
+
+    assert(a);
+
+    if (a->table) {
+	return 0;
+    }
+    if (a->state == INIT) {
+	(void) anon_uint64_set_state(a, LEX);
+    }
+
+    a->table = (struct hash_node *)
+	malloc((lh_num_items(a->hash_table) + 1) * sizeof(struct hash_node));
+    if (! a->table) {
+	return -1;
+    }
+    lh_doall_arg(a->hash_table, table_collect, a);
+    qsort(a->table, a->size, sizeof(struct hash_node), table_cmp);
+    lh_free(a->hash_table);
+    a->hash_table = NULL;
+
+    /* the numbers generated so far are not needed anymore */
+    for (p = a->list; p; ) {
+	struct node *q = p;
+	p = p->next;
+	free(q);
+    }
+    a->list = NULL;
+    return 0;
+}
@@ -30,6 +30,8 @@
 #include "libanon.h"
 
 #define STRLEN (64*1024)
+#define BATCH 1024
+#define MAXKEYS 16
 
 static const char *progname = "anon";
 
@@ -51,8 +53,8 @@ static void cmd_key(int argc, char **argv, struct cmd *cmd);
 
 static struct cmd cmds[] = {
     { "help",	cmd_help,   "anon help" },
-    { "ipv4",	cmd_ipv4,   "anon ipv4 [-hlc] [-p passphrase] file" },
-    { "ipv6",	cmd_ipv6,   "anon ipv6 [-hlc] [-p passphrase] file" },
+    { "ipv4",	cmd_ipv4,   "anon ipv4 [-hlc] [-p passphrase [-o outfile]]... [-t table] file" },
+    { "ipv6",	cmd_ipv6,   "anon ipv6 [-hlc] [-p passphrase [-o outfile]]... [-i iid] [-t cache] file" },
     { "mac",	cmd_mac,    "anon mac [-hl] [-p passphrase] file" },
     { "int64",	cmd_int64,  "anon int64 lower upper [-hl] [-p passphrase] file" },
     { "uint64",	cmd_uint64, "anon uint64 lower upper [-hl] [-p passphrase] file" },
@@ -116,6 +118,76 @@ trim(char *buffer)
     return 1;
 }
 
+/*
+ * Append the width bytes at p to the array *v of *n elements, which
+ * has room for *alloc elements.
+ */
+
+static void
+append(uint8_t **v, size_t *n, size_t *alloc, const void *p,
+       const size_t width)
+{
+    uint8_t *w;
+
+    if (*n == *alloc) {
+	w = (uint8_t *) realloc(*v, (*alloc ? 2 * *alloc : BATCH) * width);
+	if (! w) {
+	    fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+	*v = w;
+	*alloc = *alloc ? 2 * *alloc : BATCH;
+    }
+    memcpy(*v + *n * width, p, width);
+    (*n)++;
+}
+
+/*
+ * Sort the n addresses of width bytes (network byte order) in v with
+ * a least significant digit radix sort. Bytes that are the same in
+ * all addresses are skipped.
+ */
+
+static void
+radix_sort(uint8_t *v, const size_t n, const size_t width)
+{
+    uint8_t *tmp, *src = v, *dst, *t;
+    size_t count[256], i, k, c, sum;
+
+    if (n < 2) {
+	return;
+    }
+    tmp = (uint8_t *) malloc(n * width);
+    if (! tmp) {
+	fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+    dst = tmp;
+    for (k = width; k-- > 0; ) {
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++) {
+	    count[src[i * width + k]]++;
+	}
+	if (count[src[k]] == n) {
+	    continue;
+	}
+	for (c = 0, sum = 0; c < 256; c++) {
+	    i = count[c];
+	    count[c] = sum;
+	    sum += i;
+	}
+	for (i = 0; i < n; i++) {
+	    memcpy(dst + width * count[src[i * width + k]]++,
+		   src + i * width, width);
+	}
+	t = src, src = dst, dst = t;
+    }
+    if (src != v) {
+	memcpy(v, src, n * width);
+    }
+    free(tmp);
+}
+
 /*
  * Show information about the current resource usage on the given
  * stream.
@@ -132,33 +204,128 @@ show_resource_usage(FILE *stream)
     }
 }
 
+/*
+ * The recipients of the address anonymization subcommands. Every -p
+ * option adds a key and every -o option the output file for the key
+ * at the same position, so that one pass over the input produces
+ * the anonymized addresses for all keys. Without -p, a single random
+ * key is used and without -o, the results go to the standard output.
+ */
+
+struct recipients {
+    size_t n, nfiles;
+    anon_key_t *key[MAXKEYS];
+    const char *file[MAXKEYS];
+    FILE *out[MAXKEYS];
+};
+
+static void
+recipients_add(struct recipients *r, const char *passphrase,
+	       const char *file)
+{
+    if ((passphrase && r->n == MAXKEYS)
+	|| (file && r->nfiles == MAXKEYS)) {
+	fprintf(stderr, "%s: at most %d keys are supported\n",
+		progname, MAXKEYS);
+	exit(EXIT_FAILURE);
+    }
+    if (passphrase) {
+	r->key[r->n] = anon_key_new();
+	anon_key_set_passphase(r->key[r->n], passphrase);
+	r->n++;
+    }
+    if (file) {
+	r->file[r->nfiles++] = file;
+    }
+}
+
+static void
+recipients_open(struct recipients *r, struct cmd *cmd)
+{
+    size_t i;
+
+    if (r->n == 0) {
+	r->key[0] = anon_key_new();
+	anon_key_set_random(r->key[0]);
+	r->n = 1;
+    }
+    if (r->nfiles == 0 && r->n == 1) {
+	r->out[0] = stdout;
+	return;
+    }
+    if (r->nfiles != r->n) {
+	fprintf(stderr, "usage: %s\n", cmd->usage);
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < r->n; i++) {
+	r->out[i] = xfopen(r->file[i], "w");
+    }
+}
+
+static void
+recipients_close(struct recipients *r)
+{
+    size_t i;
+
+    for (i = 0; i < r->n; i++) {
+	if (r->out[i] && r->out[i] != stdout) {
+	    fclose(r->out[i]);
+	}
+	anon_key_delete(r->key[i]);
+    }
+}
+
 /*
  * Prefix preserving IP address anonymization.
  */
 
 static unsigned
-ipv4_pref(anon_ipv4_t *a, FILE *f)
+ipv4_pref(anon_ipv4_t **a, struct recipients *r, FILE *f)
 {
-    in_addr_t raw_addr, anon_addr;
+    in_addr_t raw_addr[BATCH], *anon_addr[MAXKEYS];
     char buf[10*INET_ADDRSTRLEN];
     unsigned cnt = 0;
+    size_t i, j, n;
+    int eof = 0;
+
+    for (j = 0; j < r->n; j++) {
+	anon_addr[j] = (in_addr_t *) malloc(BATCH * sizeof(in_addr_t));
+	if (! anon_addr[j]) {
+	    fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+    }
 
     /*
-     * read ip addresses (one per input line), call the prefix
-     * preserving anonymization function and print the anonymized
-     * addresses
+     * read ip addresses (one per input line) in chunks of BATCH
+     * addresses, call the batched prefix preserving anonymization
+     * function for all keys and print the anonymized addresses
      */
 
-    while (fgets(buf, sizeof(buf), f) 
-	   && trim(buf)
-	   && inet_pton(AF_INET, buf, &raw_addr) > 0) {
+    while (! eof) {
+	for (n = 0; n < BATCH; n++) {
+	    if (! (fgets(buf, sizeof(buf), f)
+		   && trim(buf)
+		   && inet_pton(AF_INET, buf, &raw_addr[n]) > 0)) {
+		eof = 1;
+		break;
+	    }
+	}
 
-	(void) anon_ipv4_map_pref(a, raw_addr, &anon_addr);
-	cnt++;
-	
-	printf("%s\n", inet_ntop(AF_INET, &anon_addr, buf, sizeof(buf)));
+	(void) anon_ipv4_map_pref_multi(a, r->n, raw_addr, anon_addr, n);
+	cnt += n;
+
+	for (j = 0; j < r->n; j++) {
+	    for (i = 0; i < n; i++) {
+		fprintf(r->out[j], "%s\n", inet_ntop(AF_INET, &anon_addr[j][i],
+						      buf, sizeof(buf)));
+	    }
+	}
     }
 
+    for (j = 0; j < r->n; j++) {
+	free(anon_addr[j]);
+    }
     return cnt;
 }
 
@@ -167,27 +334,42 @@ ipv4_pref(anon_ipv4_t *a, FILE *f)
  */
 
 static unsigned
-ipv4_lex(anon_ipv4_t *a, FILE *f)
+ipv4_lex(anon_ipv4_t **a, struct recipients *r, FILE *f)
 {
     in_addr_t raw_addr, anon_addr;
     char buf[10*INET_ADDRSTRLEN];
     unsigned cnt = 0;
+    uint8_t *used = NULL;
+    size_t j, n = 0, alloc = 0;
 
     /*
-     * first pass: read ip addresses (one per input line) and mark
-     * them as used
+     * first pass: read ip addresses (one per input line), sort them
+     * and mark them as used, which walks the used trees in order
      */
 
     while (fgets(buf, sizeof(buf), f) 
 	   && trim(buf)
 	   && inet_pton(AF_INET, buf, &raw_addr) > 0) {
+	append(&used, &n, &alloc, &raw_addr, sizeof(in_addr_t));
+    }
+    radix_sort(used, n, sizeof(in_addr_t));
+    for (j = 0; j < r->n; j++) {
+	anon_ipv4_set_used_sorted(a[j], (in_addr_t *) used, n, 32);
+    }
+    free(used);
+
+    /*
+     * compute the mapping of all used addresses at once, which also
+     * releases the used tree before the output is produced
+     */
 
-	anon_ipv4_set_used(a, raw_addr, 32);
+    for (j = 0; j < r->n; j++) {
+	(void) anon_ipv4_materialize_lex(a[j]);
     }
 
     /*
-     * second pass: read ip addresses (one per input line), call the
-     * prefix and lexcographic oder preserving anonymization function
+     * second pass: read ip addresses (one per input line), look up
+     * their prefix and lexcographic oder preserving anonymization
      * and print the anonymized addresses
      */
 
@@ -196,10 +378,12 @@ ipv4_lex(anon_ipv4_t *a, FILE *f)
 	   && trim(buf)
 	   && inet_pton(AF_INET, buf, &raw_addr) > 0) {
 	
-	(void) anon_ipv4_map_pref_lex(a, raw_addr, &anon_addr);
 	cnt++;
-
-	printf("%s\n", inet_ntop(AF_INET, &anon_addr, buf, sizeof(buf)));
+	for (j = 0; j < r->n; j++) {
+	    (void) anon_ipv4_map_pref_lex(a[j], raw_addr, &anon_addr);
+	    fprintf(r->out[j], "%s\n",
+		    inet_ntop(AF_INET, &anon_addr, buf, sizeof(buf)));
+	}
     }
 
     return cnt;
@@ -214,17 +398,21 @@ static void
 cmd_ipv4(int argc, char **argv, struct cmd *cmd)
 {
     FILE *in;
-    anon_ipv4_t *a;
-    anon_key_t *key = NULL;
+    anon_ipv4_t *a[MAXKEYS];
+    struct recipients r;
     int c, lflag = 0, cflag = 0;
+    const char *table = NULL;
     unsigned cnt;
+    size_t j;
 
-    key = anon_key_new();
-    anon_key_set_random(key);
+    memset(&r, 0, sizeof(r));
 
     optind = 2;
-    while ((c = getopt(argc, argv, "clhp:")) != -1) {
+    while ((c = getopt(argc, argv, "clhp:o:t:")) != -1) {
 	switch (c) {
+	case 't':
+	    table = optarg;
+	    break;
 	case 'c':
 	    cflag = 1;
 	    break;
@@ -232,7 +420,10 @@ cmd_ipv4(int argc, char **argv, struct cmd *cmd)
 	    lflag = 1;
 	    break;
 	case 'p':
-	    anon_key_set_passphase(key, optarg);
+	    recipients_add(&r, optarg, NULL);
+	    break;
+	case 'o':
+	    recipients_add(&r, NULL, optarg);
 	    break;
 	case 'h':
 	case '?':
@@ -244,36 +435,61 @@ cmd_ipv4(int argc, char **argv, struct cmd *cmd)
     argc -= optind;
     argv += optind;
 
-    if (argc != 1) {
+    if (argc != 1 || (table && r.n > 1)) {
 	fprintf(stderr, "usage: %s\n", cmd->usage);
-	anon_key_delete(key);
+	recipients_close(&r);
 	exit(EXIT_FAILURE);
     }
 
     in = fopen(argv[0], "r");
     if (! in) {
 	fprintf(stderr, "%s: %s: %s\n", progname, argv[0], strerror(errno));
-	anon_key_delete(key);
+	recipients_close(&r);
 	exit(EXIT_FAILURE);
     }
+    recipients_open(&r, cmd);
 
-    a = anon_ipv4_new();
-    if (! a) {
-	fprintf(stderr, "%s: Failed to initialize IP mapping\n", progname);
-	anon_key_delete(key);
-	exit(EXIT_FAILURE);
+    for (j = 0; j < r.n; j++) {
+	a[j] = anon_ipv4_new();
+	if (! a[j]) {
+	    fprintf(stderr, "%s: Failed to initialize IP mapping\n",
+		    progname);
+	    exit(EXIT_FAILURE);
+	}
+	anon_ipv4_set_key(a[j], r.key[j]);
+    }
+    if (table) {
+	/* build the table only if loading finds no file: checking for
+	 * it first would race with other processes creating it */
+	if (anon_ipv4_precompute_load(a[0], table) != 0) {
+	    if (errno != ENOENT) {
+		fprintf(stderr, "%s: %s: %s\n", progname, table,
+			errno == EINVAL ? "not a pad table for this key"
+			: strerror(errno));
+		exit(EXIT_FAILURE);
+	    }
+	    if (anon_ipv4_precompute(a[0], 24) != 0
+		|| anon_ipv4_precompute_save(a[0], table) != 0) {
+		fprintf(stderr, "%s: %s: failed to create pad table\n",
+			progname, table);
+		exit(EXIT_FAILURE);
+	    }
+	}
+    } else {
+	for (j = 0; j < r.n; j++) {
+	    (void) anon_ipv4_precompute(a[j], 16);
+	}
     }
-    anon_ipv4_set_key(a, key);
     if (lflag) {
-	cnt = ipv4_lex(a, in);
+	cnt = ipv4_lex(a, &r, in);
     } else {
-	cnt = ipv4_pref(a, in);
+	cnt = ipv4_pref(a, &r, in);
     }
     if (cflag) {
 	show_resource_usage(stderr);
 	fprintf(stderr, "%s: number of addresses:\t%u\n", progname, cnt);
 	fprintf(stderr, "%s: number of tree nodes:\t%u\n", progname,
-		anon_ipv4_nodes_count(a));
+		anon_ipv4_nodes_count(a[0]));
     }
 
 #if 0
@@ -281,8 +497,10 @@ cmd_ipv4(int argc, char **argv, struct cmd *cmd)
     scanf("\n");
 #endif
     
-    anon_ipv4_delete(a);
-    anon_key_delete(key);
+    for (j = 0; j < r.n; j++) {
+	anon_ipv4_delete(a[j]);
+    }
+    recipients_close(&r);
     fclose(in);
 }
 
@@ -291,28 +509,53 @@ cmd_ipv4(int argc, char **argv, struct cmd *cmd)
  */
 
 static unsigned
-ipv6_pref(anon_ipv6_t *a, FILE *f)
+ipv6_pref(anon_ipv6_t **a, struct recipients *r, FILE *f)
 {
-    struct in6_addr raw_addr, anon_addr;
+    struct in6_addr raw_addr[BATCH], *anon_addr[MAXKEYS];
     char buf[10*INET6_ADDRSTRLEN];
     unsigned cnt = 0;
+    size_t i, j, n;
+    int eof = 0;
+
+    for (j = 0; j < r->n; j++) {
+	anon_addr[j] = (struct in6_addr *)
+	    malloc(BATCH * sizeof(struct in6_addr));
+	if (! anon_addr[j]) {
+	    fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+    }
 
     /*
-     * read ip addresses (one per input line), call the prefix
-     * preserving anonymization function and print the anonymized
-     * addresses
+     * read ip addresses (one per input line) in chunks of BATCH
+     * addresses, call the batched prefix preserving anonymization
+     * function for all keys and print the anonymized addresses
      */
 
-    while (fgets(buf, sizeof(buf), f) 
-	   && trim(buf)
-	   && inet_pton(AF_INET6, buf, &raw_addr) > 0) {
+    while (! eof) {
+	for (n = 0; n < BATCH; n++) {
+	    if (! (fgets(buf, sizeof(buf), f)
+		   && trim(buf)
+		   && inet_pton(AF_INET6, buf, &raw_addr[n]) > 0)) {
+		eof = 1;
+		break;
+	    }
+	}
 
-	(void) anon_ipv6_map_pref(a, raw_addr, &anon_addr);
-	cnt++;
-	
-	printf("%s\n", inet_ntop(AF_INET6, &anon_addr, buf, sizeof(buf)));
+	(void) anon_ipv6_map_pref_multi(a, r->n, raw_addr, anon_addr, n);
+	cnt += n;
+
+	for (j = 0; j < r->n; j++) {
+	    for (i = 0; i < n; i++) {
+		fprintf(r->out[j], "%s\n", inet_ntop(AF_INET6, &anon_addr[j][i],
+						      buf, sizeof(buf)));
+	    }
+	}
     }
 
+    for (j = 0; j < r->n; j++) {
+	free(anon_addr[j]);
+    }
     return cnt;
 }
 
@@ -321,27 +564,42 @@ ipv6_pref(anon_ipv6_t *a, FILE *f)
  */
 
 static unsigned
-ipv6_lex(anon_ipv6_t *a, FILE *f)
+ipv6_lex(anon_ipv6_t **a, struct recipients *r, FILE *f)
 {
     struct in6_addr raw_addr, anon_addr;
     char buf[10*INET6_ADDRSTRLEN];
     unsigned cnt = 0;
+    uint8_t *used = NULL;
+    size_t j, n = 0, alloc = 0;
 
     /*
-     * first pass: read ip addresses (one per input line) and mark
-     * them as used
+     * first pass: read ip addresses (one per input line), sort them
+     * and mark them as used, which walks the used trees in order
      */
 
     while (fgets(buf, sizeof(buf), f) 
 	   && trim(buf)
 	   && inet_pton(AF_INET6, buf, &raw_addr) > 0) {
+	append(&used, &n, &alloc, &raw_addr, sizeof(struct in6_addr));
+    }
+    radix_sort(used, n, sizeof(struct in6_addr));
+    for (j = 0; j < r->n; j++) {
+	anon_ipv6_set_used_sorted(a[j], (struct in6_addr *) used, n, 128);
+    }
+    free(used);
 
-	anon_ipv6_set_used(a, raw_addr, 128);
+    /*
+     * compute the mapping of all used addresses at once, which also
+     * releases the used tree before the output is produced
+     */
+
+    for (j = 0; j < r->n; j++) {
+	(void) anon_ipv6_materialize_lex(a[j]);
     }
 
     /*
-     * second pass: read ip addresses (one per input line), call the
-     * prefix and lexcographic oder preserving anonymization function
+     * second pass: read ip addresses (one per input line), look up
+     * their prefix and lexcographic oder preserving anonymization
      * and print the anonymized addresses
      */
 
@@ -350,10 +608,12 @@ ipv6_lex(anon_ipv6_t *a, FILE *f)
 	   && trim(buf)
 	   && inet_pton(AF_INET6, buf, &raw_addr) > 0) {
 	
-	(void) anon_ipv6_map_pref_lex(a, raw_addr, &anon_addr);
 	cnt++;
-
-	printf("%s\n", inet_ntop(AF_INET6, &anon_addr, buf, sizeof(buf)));
+	for (j = 0; j < r->n; j++) {
+	    (void) anon_ipv6_map_pref_lex(a[j], raw_addr, &anon_addr);
+	    fprintf(r->out[j], "%s\n",
+		    inet_ntop(AF_INET6, &anon_addr, buf, sizeof(buf)));
+	}
     }
 
     return cnt;
@@ -368,17 +628,36 @@ static void
 cmd_ipv6(int argc, char **argv, struct cmd *cmd)
 {
     FILE *in;
-    anon_ipv6_t *a;
-    anon_key_t *key = NULL;
+    anon_ipv6_t *a[MAXKEYS];
+    struct recipients r;
     int c, lflag = 0, cflag = 0;
     unsigned cnt = 0;
+    int iid = ANON_IPV6_IID_PREF;
+    const char *cache = NULL;
+    size_t j;
 
-    key = anon_key_new();
-    anon_key_set_random(key);
+    memset(&r, 0, sizeof(r));
 
     optind = 2;
-    while ((c = getopt(argc, argv, "clhp:")) != -1) {
+    while ((c = getopt(argc, argv, "clhp:o:i:t:")) != -1) {
 	switch (c) {
+	case 't':
+	    cache = optarg;
+	    break;
+	case 'i':
+	    if (strcmp(optarg, "pref") == 0) {
+		iid = ANON_IPV6_IID_PREF;
+	    } else if (strcmp(optarg, "keep") == 0) {
+		iid = ANON_IPV6_IID_KEEP;
+	    } else if (strcmp(optarg, "zero") == 0) {
+		iid = ANON_IPV6_IID_ZERO;
+	    } else if (strcmp(optarg, "hash") == 0) {
+		iid = ANON_IPV6_IID_HASH;
+	    } else {
+		fprintf(stderr, "usage: %s\n", cmd->usage);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	case 'c':
 	    cflag = 1;
 	    break;
@@ -386,7 +665,10 @@ cmd_ipv6(int argc, char **argv, struct cmd *cmd)
 	    lflag = 1;
 	    break;
 	case 'p':
-	    anon_key_set_passphase(key, optarg);
+	    recipients_add(&r, optarg, NULL);
+	    break;
+	case 'o':
+	    recipients_add(&r, NULL, optarg);
 	    break;
 	case 'h':
 	case '?':
@@ -398,35 +680,48 @@ cmd_ipv6(int argc, char **argv, struct cmd *cmd)
     argc -= optind;
     argv += optind;
 
-    if (argc != 1) {
+    if (argc != 1 || (cache && r.n > 1)) {
 	fprintf(stderr, "usage: %s\n", cmd->usage);
+	recipients_close(&r);
 	exit(EXIT_FAILURE);
     }
 
     in = fopen(argv[0], "r");
     if (! in) {
 	fprintf(stderr, "%s: %s: %s\n", progname, argv[0], strerror(errno));
-	anon_key_delete(key);
+	recipients_close(&r);
 	exit(EXIT_FAILURE);
     }
+    recipients_open(&r, cmd);
 
-    a = anon_ipv6_new();
-    if (! a) {
-	fprintf(stderr, "%s: Failed to initialize IPv6 mapping\n", progname);
-	anon_key_delete(key);
+    for (j = 0; j < r.n; j++) {
+	/* the used set of lex mode is sparse, compress its paths */
+	a[j] = lflag ? anon_ipv6_new_used(ANON_IPV6_USED_PATRICIA)
+	    : anon_ipv6_new();
+	if (! a[j]) {
+	    fprintf(stderr, "%s: Failed to initialize IPv6 mapping\n",
+		    progname);
+	    exit(EXIT_FAILURE);
+	}
+	anon_ipv6_set_key(a[j], r.key[j]);
+	(void) anon_ipv6_set_iid(a[j], iid);
+    }
+    if (cache && ! lflag
+	&& anon_ipv6_set_cache_file(a[0], cache, 1 << 24) != 0) {
+	fprintf(stderr, "%s: %s: not a cache file for this key\n",
+		progname, cache);
 	exit(EXIT_FAILURE);
     }
-    anon_ipv6_set_key(a, key);
     if (lflag) {
-	cnt = ipv6_lex(a, in);
+	cnt = ipv6_lex(a, &r, in);
     } else {
-	cnt = ipv6_pref(a, in);
+	cnt = ipv6_pref(a, &r, in);
     }
     if (cflag) {
 	show_resource_usage(stderr);
 	fprintf(stderr, "%s: number of addresses:\t%u\n", progname, cnt);
 	fprintf(stderr, "%s: number of tree nodes:\t%u\n", progname,
-		anon_ipv6_nodes_count(a));
+		anon_ipv6_nodes_count(a[0]));
     }
 
 #if 0
@@ -434,8 +729,10 @@ cmd_ipv6(int argc, char **argv, struct cmd *cmd)
     scanf("\n");
 #endif
 
-    anon_ipv6_delete(a);
-    anon_key_delete(key);
+    for (j = 0; j < r.n; j++) {
+	anon_ipv6_delete(a[j]);
+    }
+    recipients_close(&r);
     fclose(in);
 }
 
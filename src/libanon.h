@@ -14,6 +14,7 @@
 #ifndef _LIBANON_H_
 #define _LIBANON_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <netinet/in.h>
 
@@ -40,14 +41,58 @@ void		anon_key_delete(anon_key_t *key);
 
 typedef struct _anon_ipv4 anon_ipv4_t;
 
+/* representation of the set of used addresses (lex mode) */
+#define ANON_IPV4_USED_TREE	0	/* binary tree (default) */
+#define ANON_IPV4_USED_POPTRIE	1	/* multibit trie */
+#define ANON_IPV4_USED_BITMAP	2	/* bitmap per tree level */
+
 anon_ipv4_t*	anon_ipv4_new(void);
+anon_ipv4_t*	anon_ipv4_new_used(const int used);
 void		anon_ipv4_set_key(anon_ipv4_t *a, const anon_key_t *key);
+int		anon_ipv4_precompute(anon_ipv4_t *a, const int depth);
+int		anon_ipv4_precompute_save(anon_ipv4_t *a,
+					  const char *filename);
+int		anon_ipv4_precompute_load(anon_ipv4_t *a,
+					  const char *filename);
+int		anon_ipv4_precompute_cidr(anon_ipv4_t *a,
+					  const in_addr_t *net,
+					  const int *prefixlen,
+					  const size_t n);
+int		anon_ipv4_set_cache(anon_ipv4_t *a, const size_t size);
+void		anon_ipv4_cache_stats(anon_ipv4_t *a, uint64_t *hits,
+				      uint64_t *misses);
 int		anon_ipv4_set_used(anon_ipv4_t *a, const in_addr_t ip,
 				   const int prefixlen);
+int		anon_ipv4_set_used_sorted(anon_ipv4_t *a,
+					  const in_addr_t *ip, const size_t n,
+					  const int prefixlen);
+
+/* concurrent marking of used addresses, a pool per thread */
+typedef struct _anon_ipv4_pool anon_ipv4_pool_t;
+
+anon_ipv4_pool_t* anon_ipv4_pool_new(anon_ipv4_t *a);
+int		anon_ipv4_pool_set_used(anon_ipv4_pool_t *p,
+					const in_addr_t ip,
+					const int prefixlen);
+void		anon_ipv4_pool_delete(anon_ipv4_pool_t *p);
+
 int		anon_ipv4_map_pref(anon_ipv4_t *a, const in_addr_t ip,
 				   in_addr_t *aip);
+int		anon_ipv4_map_prefix(anon_ipv4_t *a, const in_addr_t ip,
+				     const int prefixlen, in_addr_t *aip);
+int		anon_ipv4_map_pref_batch(anon_ipv4_t *a, const in_addr_t *ip,
+					 in_addr_t *aip, const size_t n);
+int		anon_ipv4_map_pref_trie(anon_ipv4_t *a, const in_addr_t *ip,
+					in_addr_t *aip, const size_t n);
+int		anon_ipv4_map_pref_multi(anon_ipv4_t **a, const size_t k,
+					 const in_addr_t *ip, in_addr_t **aip,
+					 const size_t n);
 int		anon_ipv4_map_pref_lex(anon_ipv4_t *a, const in_addr_t ip,
 				       in_addr_t *aip);
+int		anon_ipv4_materialize_lex(anon_ipv4_t *a);
+/* frozen, the lex mapping only maps addresses marked as used */
+int		anon_ipv4_freeze(anon_ipv4_t *a);
+int		anon_ipv4_publish(anon_ipv4_t *a);
 void		anon_ipv4_delete(anon_ipv4_t *a);
 unsigned	anon_ipv4_nodes_count(anon_ipv4_t *a);
 
@@ -58,14 +103,64 @@ unsigned	anon_ipv4_nodes_count(anon_ipv4_t *a);
 typedef struct _anon_ipv6 anon_ipv6_t;
 typedef struct in6_addr in6_addr_t;
 
+/* treatment of the interface identifier (low 64 bits) */
+#define ANON_IPV6_IID_PREF	0	/* prefix-preserving (default) */
+#define ANON_IPV6_IID_KEEP	1	/* keep unchanged */
+#define ANON_IPV6_IID_ZERO	2	/* set to zero */
+#define ANON_IPV6_IID_HASH	3	/* keyed hash of the address */
+
+/* representation of the set of used addresses (lex mode) */
+#define ANON_IPV6_USED_TREE	0	/* binary tree (default) */
+#define ANON_IPV6_USED_PATRICIA	1	/* path-compressed tree */
+#define ANON_IPV6_USED_ARRAY	2	/* sorted array */
+
 anon_ipv6_t*	anon_ipv6_new(void);
+anon_ipv6_t*	anon_ipv6_new_used(const int used);
 void		anon_ipv6_set_key(anon_ipv6_t *a, const anon_key_t *key);
+int		anon_ipv6_set_iid(anon_ipv6_t *a, const int mode);
+int		anon_ipv6_set_cache(anon_ipv6_t *a, const size_t size);
+/* the cache file holds original addresses in the clear, protect it
+ * as strictly as the key */
+int		anon_ipv6_set_cache_file(anon_ipv6_t *a, const char *filename,
+					 const size_t size);
+int		anon_ipv6_set_ipv4(anon_ipv6_t *a, anon_ipv4_t *ipv4);
+void		anon_ipv6_cache_stats(anon_ipv6_t *a, uint64_t *hits,
+				      uint64_t *misses);
 int		anon_ipv6_set_used(anon_ipv6_t *a, const in6_addr_t ip,
 				   const int prefixlen);
+int		anon_ipv6_set_used_array(anon_ipv6_t *a,
+					 const in6_addr_t *ip, const size_t n,
+					 const int prefixlen);
+int		anon_ipv6_set_used_sorted(anon_ipv6_t *a,
+					  const in6_addr_t *ip, const size_t n,
+					  const int prefixlen);
+
+/* concurrent marking of used addresses, a pool per thread */
+typedef struct _anon_ipv6_pool anon_ipv6_pool_t;
+
+anon_ipv6_pool_t* anon_ipv6_pool_new(anon_ipv6_t *a);
+int		anon_ipv6_pool_set_used(anon_ipv6_pool_t *p,
+					const in6_addr_t ip,
+					const int prefixlen);
+void		anon_ipv6_pool_delete(anon_ipv6_pool_t *p);
+
 int		anon_ipv6_map_pref(anon_ipv6_t *a, const in6_addr_t ip,
 				   in6_addr_t *aip);
+int		anon_ipv6_map_prefix(anon_ipv6_t *a, const in6_addr_t ip,
+				     const int prefixlen, in6_addr_t *aip);
+int		anon_ipv6_map_pref_batch(anon_ipv6_t *a, const in6_addr_t *ip,
+					 in6_addr_t *aip, const size_t n);
+int		anon_ipv6_map_pref_trie(anon_ipv6_t *a, const in6_addr_t *ip,
+					in6_addr_t *aip, const size_t n);
+int		anon_ipv6_map_pref_multi(anon_ipv6_t **a, const size_t k,
+					 const in6_addr_t *ip,
+					 in6_addr_t **aip, const size_t n);
 int		anon_ipv6_map_pref_lex(anon_ipv6_t *a, const in6_addr_t ip,
 				       in6_addr_t *aip);
+int		anon_ipv6_materialize_lex(anon_ipv6_t *a);
+/* frozen, the lex mapping only maps addresses marked as used */
+int		anon_ipv6_freeze(anon_ipv6_t *a);
+int		anon_ipv6_publish(anon_ipv6_t *a);
 void		anon_ipv6_delete(anon_ipv6_t *a);
 unsigned	anon_ipv6_nodes_count(anon_ipv6_t *a);
 
@@ -82,6 +177,7 @@ int		anon_mac_map(anon_mac_t *a, const uint8_t *mac,
 			     uint8_t *amac);
 int		anon_mac_map_lex(anon_mac_t *a, const uint8_t *mac,
 				 uint8_t *amac);
+int		anon_mac_freeze(anon_mac_t *a);
 void		anon_mac_delete(anon_mac_t *a);
 
 /*
@@ -97,6 +193,7 @@ int		anon_int64_map(anon_int64_t *a, const int64_t num,
 			       int64_t *anum);
 int		anon_int64_map_lex(anon_int64_t *a, const int64_t num,
 				   int64_t *anum);
+int		anon_int64_freeze(anon_int64_t *a);
 void		anon_int64_delete(anon_int64_t *a);
 
 /*
@@ -112,6 +209,7 @@ int		anon_uint64_map(anon_uint64_t *a, const uint64_t num,
 			       uint64_t *anum);
 int		anon_uint64_map_lex(anon_uint64_t *a, const uint64_t num,
 				   uint64_t *anum);
+int		anon_uint64_freeze(anon_uint64_t *a);
 void		anon_uint64_delete(anon_uint64_t *a);
 
 /*
@@ -129,6 +227,7 @@ int		anon_octs_map(anon_octs_t *a,
 				      const char *str, char *astr);
 int		anon_octs_map_lex(anon_octs_t *a,
 					  const char *str, char *astr);
+int		anon_octs_freeze(anon_octs_t *a);
 void		anon_octs_delete(anon_octs_t *a);
 
 /*
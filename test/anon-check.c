@@ -0,0 +1,1284 @@
+/*
+ * anon-check.c --
+ *
+ * Regression checks of libanon interfaces the anon program does not
+ * use. A check reads addresses (one per input line), anonymizes them
+ * through the interface under test and prints the results, which the
+ * test scripts compare with the results of the plain interfaces.
+ *
+ * Copyright (c) 2008 Juergen Schoenwaelder
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "libanon.h"
+#include "anon-aes.h"
+
+static const char *progname = "anon-check";
+
+#define MAXCIDR 16
+#define THREADS 4
+
+/*
+ * Options shared by all checks; they set up the anonymization
+ * objects before the addresses are mapped.
+ */
+
+struct opts {
+    anon_key_t *key;
+    int depth;			/* -d: precomputed pad table depth */
+    size_t cache;		/* -c: prefix cache size */
+    int stats;			/* -s: print cache statistics */
+    in_addr_t net[MAXCIDR];	/* -r: precomputed CIDR blocks */
+    int prefixlen[MAXCIDR];
+    size_t ncidr;
+    int iid;			/* -i: treatment of IPv6 identifiers */
+    anon_ipv4_t *ipv4;		/* -4: maps embedded IPv4 addresses */
+    int materialize;		/* -m: materialize the lex mapping */
+    const char *used;		/* -u: representation of the used set */
+    const char *mark;		/* -M: how addresses are marked as used */
+    int freeze;			/* -F: freeze, then map concurrently */
+    int publish;		/* -P: publish while mapping concurrently */
+};
+
+struct check {
+    const char *name;
+    void (*func)(FILE *in, struct opts *o);
+};
+
+static void check_backend(FILE *in, struct opts *o);
+static void check_ipv4_pref(FILE *in, struct opts *o);
+static void check_ipv4_prefix(FILE *in, struct opts *o);
+static void check_ipv4_trie(FILE *in, struct opts *o);
+static void check_ipv6_pref(FILE *in, struct opts *o);
+static void check_ipv6_prefix(FILE *in, struct opts *o);
+static void check_ipv6_trie(FILE *in, struct opts *o);
+static void check_ipv6_embed(FILE *in, struct opts *o);
+static void check_ipv4_lex(FILE *in, struct opts *o);
+static void check_ipv6_lex(FILE *in, struct opts *o);
+static void check_freeze(FILE *in, struct opts *o);
+
+static struct check checks[] = {
+    { "backend",	check_backend },
+    { "ipv4-pref",	check_ipv4_pref },
+    { "ipv4-prefix",	check_ipv4_prefix },
+    { "ipv4-trie",	check_ipv4_trie },
+    { "ipv6-pref",	check_ipv6_pref },
+    { "ipv6-prefix",	check_ipv6_prefix },
+    { "ipv6-trie",	check_ipv6_trie },
+    { "ipv6-embed",	check_ipv6_embed },
+    { "ipv4-lex",	check_ipv4_lex },
+    { "ipv6-lex",	check_ipv6_lex },
+    { "freeze",		check_freeze },
+    { NULL, NULL }
+};
+
+static const char *usage =
+    "anon-check check [-s4mFP] [-p passphrase] [-d depth] [-c size]"
+    " [-r net/prefixlen]... [-i iid] [-u used] [-M mark] file";
+
+static void
+fail(const char *what)
+{
+    fprintf(stderr, "%s: %s failed\n", progname, what);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Read all addresses of the address family af (one per line) into a
+ * new array of elements of size len and return their number.
+ */
+
+static size_t
+read_addrs(FILE *in, const int af, const size_t len, void **addrs)
+{
+    char buf[10*INET6_ADDRSTRLEN], *s, *e;
+    size_t n = 0, alloc = 0;
+    uint8_t *p = NULL;
+
+    while (fgets(buf, sizeof(buf), in)) {
+	for (s = buf; *s && isspace((int) *s); s++) ;
+	for (e = s + strlen(s); e > s && isspace((int) e[-1]); e--) ;
+	*e = 0;
+	if (n == alloc) {
+	    alloc = alloc ? 2 * alloc : 1024;
+	    p = (uint8_t *) realloc(p, alloc * len);
+	    if (! p) {
+		fail("realloc");
+	    }
+	}
+	if (inet_pton(af, s, p + n * len) <= 0) {
+	    break;
+	}
+	n++;
+    }
+    *addrs = p;
+    return n;
+}
+
+static void
+print_addrs(const int af, const void *addrs, const size_t len,
+	    const size_t n)
+{
+    char buf[INET6_ADDRSTRLEN];
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	printf("%s\n", inet_ntop(af, (const uint8_t *) addrs + i * len,
+				 buf, sizeof(buf)));
+    }
+}
+
+static anon_ipv4_t*
+ipv4_new(struct opts *o)
+{
+    anon_ipv4_t *a;
+
+    a = anon_ipv4_new();
+    if (! a) {
+	fail("anon_ipv4_new");
+    }
+    anon_ipv4_set_key(a, o->key);
+    if (anon_ipv4_precompute(a, o->depth) != 0) {
+	fail("anon_ipv4_precompute");
+    }
+    if (anon_ipv4_set_cache(a, o->cache) != 0) {
+	fail("anon_ipv4_set_cache");
+    }
+    if (o->ncidr
+	&& anon_ipv4_precompute_cidr(a, o->net, o->prefixlen, o->ncidr) != 0) {
+	fail("anon_ipv4_precompute_cidr");
+    }
+    return a;
+}
+
+static anon_ipv6_t*
+ipv6_new(struct opts *o)
+{
+    anon_ipv6_t *a;
+
+    a = anon_ipv6_new();
+    if (! a) {
+	fail("anon_ipv6_new");
+    }
+    anon_ipv6_set_key(a, o->key);
+    if (anon_ipv6_set_iid(a, o->iid) != 0) {
+	fail("anon_ipv6_set_iid");
+    }
+    if (anon_ipv6_set_cache(a, o->cache) != 0) {
+	fail("anon_ipv6_set_cache");
+    }
+    if (anon_ipv6_set_ipv4(a, o->ipv4) != 0) {
+	fail("anon_ipv6_set_ipv4");
+    }
+    return a;
+}
+
+/*
+ * Representations of the used set of lex mode, by name.
+ */
+
+static const struct {
+    const char *name;
+    int af;
+    int used;
+} useds[] = {
+    { "tree",		AF_INET,	ANON_IPV4_USED_TREE },
+    { "poptrie",	AF_INET,	ANON_IPV4_USED_POPTRIE },
+    { "bitmap",		AF_INET,	ANON_IPV4_USED_BITMAP },
+    { "tree",		AF_INET6,	ANON_IPV6_USED_TREE },
+    { "patricia",	AF_INET6,	ANON_IPV6_USED_PATRICIA },
+    { "array",		AF_INET6,	ANON_IPV6_USED_ARRAY },
+};
+
+#define USEDS (sizeof(useds) / sizeof(useds[0]))
+
+static int
+used(struct opts *o, const int af)
+{
+    size_t i;
+
+    for (i = 0; i < USEDS; i++) {
+	if (useds[i].af == af
+	    && strcmp(useds[i].name, o->used ? o->used : "tree") == 0) {
+	    return useds[i].used;
+	}
+    }
+    fprintf(stderr, "%s: unknown used set '%s'\n", progname, o->used);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Mark the n addresses ip as used, one at a time in input order
+ * (-M one, the default), as a sorted copy at once (-M sorted), as
+ * they are at once (-M array, IPv6 only) or concurrently by THREADS
+ * threads through pools of their own (-M pool), which take every
+ * THREADS-th address so that they race for the same nodes.
+ */
+
+static int
+mark(struct opts *o, const char *name)
+{
+    return strcmp(o->mark ? o->mark : "one", name) == 0;
+}
+
+static void
+unknown_mark(struct opts *o)
+{
+    fprintf(stderr, "%s: unknown marking '%s'\n", progname, o->mark);
+    exit(EXIT_FAILURE);
+}
+
+static int
+cmp_ipv4(const void *x, const void *y)
+{
+    return memcmp(x, y, sizeof(in_addr_t));
+}
+
+static int
+cmp_ipv6(const void *x, const void *y)
+{
+    return memcmp(x, y, sizeof(in6_addr_t));
+}
+
+struct worker {
+    pthread_t thread;
+    const void *ip;
+    void *aip;
+    size_t first, n;
+    int rounds;			/* passes of the mappers */
+    anon_ipv4_t *a4;
+    anon_ipv6_t *a6;
+    anon_ipv4_pool_t *p4;
+    anon_ipv6_pool_t *p6;
+    int rc;
+};
+
+static void*
+ipv4_worker(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    const in_addr_t *ip = (const in_addr_t *) w->ip;
+    size_t i;
+
+    for (i = w->first; i < w->n; i += THREADS) {
+	if (anon_ipv4_pool_set_used(w->p4, ip[i], 32) != 0) {
+	    w->rc = -1;
+	}
+    }
+    return NULL;
+}
+
+static void*
+ipv4_mapper(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    const in_addr_t *ip = (const in_addr_t *) w->ip;
+    in_addr_t *aip = (in_addr_t *) w->aip;
+    size_t i;
+
+    int k;
+
+    for (k = 0; k < w->rounds; k++) {
+	for (i = w->first; i < w->n; i += THREADS) {
+	    if (anon_ipv4_map_pref_lex(w->a4, ip[i], &aip[i]) != 0) {
+		w->rc = -1;
+	    }
+	}
+    }
+    return NULL;
+}
+
+static void*
+ipv6_worker(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    const in6_addr_t *ip = (const in6_addr_t *) w->ip;
+    size_t i;
+
+    for (i = w->first; i < w->n; i += THREADS) {
+	if (anon_ipv6_pool_set_used(w->p6, ip[i], 128) != 0) {
+	    w->rc = -1;
+	}
+    }
+    return NULL;
+}
+
+static void*
+ipv6_mapper(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    const in6_addr_t *ip = (const in6_addr_t *) w->ip;
+    in6_addr_t *aip = (in6_addr_t *) w->aip;
+    size_t i;
+
+    int k;
+
+    for (k = 0; k < w->rounds; k++) {
+	for (i = w->first; i < w->n; i += THREADS) {
+	    if (anon_ipv6_map_pref_lex(w->a6, ip[i], &aip[i]) != 0) {
+		w->rc = -1;
+	    }
+	}
+    }
+    return NULL;
+}
+
+static void
+start_workers(struct worker *w, void *(*func)(void *))
+{
+    int t;
+
+    for (t = 0; t < THREADS; t++) {
+	if (pthread_create(&w[t].thread, NULL, func, &w[t]) != 0) {
+	    fail("pthread_create");
+	}
+    }
+}
+
+static void
+join_workers(struct worker *w, const char *what)
+{
+    int t;
+
+    for (t = 0; t < THREADS; t++) {
+	pthread_join(w[t].thread, NULL);
+	if (w[t].rc != 0) {
+	    fail(what);
+	}
+    }
+}
+
+static void
+run_workers(struct worker *w, void *(*func)(void *), const char *what)
+{
+    start_workers(w, func);
+    join_workers(w, what);
+}
+
+static void
+ipv4_mark(anon_ipv4_t *a, const in_addr_t *ip, const size_t n,
+	  struct opts *o)
+{
+    struct worker w[THREADS];
+    in_addr_t *s;
+    size_t i;
+    int t;
+
+    if (mark(o, "one")) {
+	for (i = 0; i < n; i++) {
+	    if (anon_ipv4_set_used(a, ip[i], 32) != 0) {
+		fail("anon_ipv4_set_used");
+	    }
+	}
+    } else if (mark(o, "sorted")) {
+	s = (in_addr_t *) malloc((n ? n : 1) * sizeof(in_addr_t));
+	if (! s) {
+	    fail("malloc");
+	}
+	memcpy(s, ip, n * sizeof(in_addr_t));
+	qsort(s, n, sizeof(in_addr_t), cmp_ipv4);
+	if (anon_ipv4_set_used_sorted(a, s, n, 32) != 0) {
+	    fail("anon_ipv4_set_used_sorted");
+	}
+	free(s);
+    } else if (mark(o, "pool")) {
+	memset(w, 0, sizeof(w));
+	for (t = 0; t < THREADS; t++) {
+	    w[t].ip = ip;
+	    w[t].first = t;
+	    w[t].n = n;
+	    w[t].p4 = anon_ipv4_pool_new(a);
+	    if (! w[t].p4) {
+		fail("anon_ipv4_pool_new");
+	    }
+	}
+	run_workers(w, ipv4_worker, "anon_ipv4_pool_set_used");
+	for (t = 0; t < THREADS; t++) {
+	    anon_ipv4_pool_delete(w[t].p4);
+	}
+    } else {
+	unknown_mark(o);
+    }
+}
+
+static void
+ipv6_mark(anon_ipv6_t *a, const in6_addr_t *ip, const size_t n,
+	  struct opts *o)
+{
+    struct worker w[THREADS];
+    in6_addr_t *s;
+    size_t i;
+    int t;
+
+    if (mark(o, "one")) {
+	for (i = 0; i < n; i++) {
+	    if (anon_ipv6_set_used(a, ip[i], 128) != 0) {
+		fail("anon_ipv6_set_used");
+	    }
+	}
+    } else if (mark(o, "sorted")) {
+	s = (in6_addr_t *) malloc((n ? n : 1) * sizeof(in6_addr_t));
+	if (! s) {
+	    fail("malloc");
+	}
+	memcpy(s, ip, n * sizeof(in6_addr_t));
+	qsort(s, n, sizeof(in6_addr_t), cmp_ipv6);
+	if (anon_ipv6_set_used_sorted(a, s, n, 128) != 0) {
+	    fail("anon_ipv6_set_used_sorted");
+	}
+	free(s);
+    } else if (mark(o, "array")) {
+	if (anon_ipv6_set_used_array(a, ip, n, 128) != 0) {
+	    fail("anon_ipv6_set_used_array");
+	}
+    } else if (mark(o, "pool")) {
+	memset(w, 0, sizeof(w));
+	for (t = 0; t < THREADS; t++) {
+	    w[t].ip = ip;
+	    w[t].first = t;
+	    w[t].n = n;
+	    w[t].p6 = anon_ipv6_pool_new(a);
+	    if (! w[t].p6) {
+		fail("anon_ipv6_pool_new");
+	    }
+	}
+	run_workers(w, ipv6_worker, "anon_ipv6_pool_set_used");
+	for (t = 0; t < THREADS; t++) {
+	    anon_ipv6_pool_delete(w[t].p6);
+	}
+    } else {
+	unknown_mark(o);
+    }
+}
+
+/* do the first len bits of x and y agree? */
+
+static int
+prefix_equal(const uint8_t *x, const uint8_t *y, const int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+	if ((x[i/8] ^ y[i/8]) & (0x80 >> (i % 8))) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static void
+ipv4_stats(anon_ipv4_t *a, struct opts *o)
+{
+    uint64_t hits, misses;
+
+    if (o->stats) {
+	anon_ipv4_cache_stats(a, &hits, &misses);
+	fprintf(stderr, "%llu %llu\n", (unsigned long long) hits,
+		(unsigned long long) misses);
+    }
+}
+
+/*
+ * Print the name of the AES backend in use, which LIBANON_PRF picks
+ * if the CPU supports it. The input is not read.
+ */
+
+static void
+check_backend(FILE *in, struct opts *o)
+{
+    printf("%s\n", anon_aes_backend());
+}
+
+/*
+ * Prefix-preserving anonymization, one address at a time.
+ */
+
+static void
+check_ipv4_pref(FILE *in, struct opts *o)
+{
+    anon_ipv4_t *a;
+    in_addr_t *ip, *aip;
+    size_t i, n;
+
+    n = read_addrs(in, AF_INET, sizeof(in_addr_t), (void **) &ip);
+    aip = (in_addr_t *) malloc((n ? n : 1) * sizeof(in_addr_t));
+    if (! aip) {
+	fail("malloc");
+    }
+    a = ipv4_new(o);
+    for (i = 0; i < n; i++) {
+	if (anon_ipv4_map_pref(a, ip[i], &aip[i]) != 0) {
+	    fail("anon_ipv4_map_pref");
+	}
+    }
+    print_addrs(AF_INET, aip, sizeof(in_addr_t), n);
+    ipv4_stats(a, o);
+    anon_ipv4_delete(a);
+    free(aip);
+    free(ip);
+}
+
+static void
+ipv6_stats(anon_ipv6_t *a, struct opts *o)
+{
+    uint64_t hits, misses;
+
+    if (o->stats) {
+	anon_ipv6_cache_stats(a, &hits, &misses);
+	fprintf(stderr, "%llu %llu\n", (unsigned long long) hits,
+		(unsigned long long) misses);
+    }
+}
+
+static void
+check_ipv6_pref(FILE *in, struct opts *o)
+{
+    anon_ipv6_t *a;
+    in6_addr_t *ip, *aip;
+    size_t i, n;
+
+    n = read_addrs(in, AF_INET6, sizeof(in6_addr_t), (void **) &ip);
+    aip = (in6_addr_t *) malloc((n ? n : 1) * sizeof(in6_addr_t));
+    if (! aip) {
+	fail("malloc");
+    }
+    a = ipv6_new(o);
+    for (i = 0; i < n; i++) {
+	if (anon_ipv6_map_pref(a, ip[i], &aip[i]) != 0) {
+	    fail("anon_ipv6_map_pref");
+	}
+    }
+    print_addrs(AF_INET6, aip, sizeof(in6_addr_t), n);
+    ipv6_stats(a, o);
+    anon_ipv6_delete(a);
+    free(aip);
+    free(ip);
+}
+
+/*
+ * Prefix anonymization: bit i of the printed address is bit i of the
+ * anonymized prefix ip/i+1, which is bit i of the anonymized address.
+ * The bits behind a prefix must be those of ip.
+ */
+
+static void
+check_ipv4_prefix(FILE *in, struct opts *o)
+{
+    anon_ipv4_t *a;
+    in_addr_t *ip, *aip, r;
+    uint32_t mask;
+    size_t i, n;
+    int len;
+
+    n = read_addrs(in, AF_INET, sizeof(in_addr_t), (void **) &ip);
+    aip = (in_addr_t *) calloc(n ? n : 1, sizeof(in_addr_t));
+    if (! aip) {
+	fail("calloc");
+    }
+    a = ipv4_new(o);
+    for (i = 0; i < n; i++) {
+	for (len = 0; len <= 32; len++) {
+	    if (anon_ipv4_map_prefix(a, ip[i], len, &r) != 0) {
+		fail("anon_ipv4_map_prefix");
+	    }
+	    mask = len ? 0xffffffff << (32 - len) : 0;
+	    if ((ntohl(r) ^ ntohl(ip[i])) & ~mask) {
+		fail("anon_ipv4_map_prefix (host bits)");
+	    }
+	    if (len) {
+		aip[i] |= htonl(ntohl(r) & (0x80000000 >> (len - 1)));
+	    }
+	}
+    }
+    print_addrs(AF_INET, aip, sizeof(in_addr_t), n);
+    anon_ipv4_delete(a);
+    free(aip);
+    free(ip);
+}
+
+static void
+check_ipv6_prefix(FILE *in, struct opts *o)
+{
+    anon_ipv6_t *a;
+    in6_addr_t *ip, *aip, r;
+    size_t i, n;
+    int len, k, b;
+
+    n = read_addrs(in, AF_INET6, sizeof(in6_addr_t), (void **) &ip);
+    aip = (in6_addr_t *) calloc(n ? n : 1, sizeof(in6_addr_t));
+    if (! aip) {
+	fail("calloc");
+    }
+    a = ipv6_new(o);
+    for (i = 0; i < n; i++) {
+	for (len = 0; len <= 128; len++) {
+	    if (anon_ipv6_map_prefix(a, ip[i], len, &r) != 0) {
+		fail("anon_ipv6_map_prefix");
+	    }
+	    for (b = len; b < 128; b++) {
+		k = 0x80 >> (b % 8);
+		if ((r.s6_addr[b/8] ^ ip[i].s6_addr[b/8]) & k) {
+		    fail("anon_ipv6_map_prefix (host bits)");
+		}
+	    }
+	    if (len) {
+		b = len - 1;
+		aip[i].s6_addr[b/8] |= r.s6_addr[b/8] & (0x80 >> (b % 8));
+	    }
+	}
+    }
+    print_addrs(AF_INET6, aip, sizeof(in6_addr_t), n);
+    anon_ipv6_delete(a);
+    free(aip);
+    free(ip);
+}
+
+/*
+ * Sorted-trie batch anonymization of the whole input, into a separate
+ * array and in place.
+ */
+
+static void
+check_ipv4_trie(FILE *in, struct opts *o)
+{
+    anon_ipv4_t *a;
+    in_addr_t *ip, *aip;
+    size_t n;
+
+    n = read_addrs(in, AF_INET, sizeof(in_addr_t), (void **) &ip);
+    aip = (in_addr_t *) malloc((n ? n : 1) * sizeof(in_addr_t));
+    if (! aip) {
+	fail("malloc");
+    }
+    a = ipv4_new(o);
+    if (anon_ipv4_map_pref_trie(a, ip, aip, n) != 0
+	|| anon_ipv4_map_pref_trie(a, ip, ip, n) != 0) {
+	fail("anon_ipv4_map_pref_trie");
+    }
+    if (n && memcmp(ip, aip, n * sizeof(in_addr_t)) != 0) {
+	fail("anon_ipv4_map_pref_trie (in place)");
+    }
+    print_addrs(AF_INET, aip, sizeof(in_addr_t), n);
+    anon_ipv4_delete(a);
+    free(aip);
+    free(ip);
+}
+
+static void
+check_ipv6_trie(FILE *in, struct opts *o)
+{
+    anon_ipv6_t *a;
+    in6_addr_t *ip, *aip;
+    size_t n;
+
+    n = read_addrs(in, AF_INET6, sizeof(in6_addr_t), (void **) &ip);
+    aip = (in6_addr_t *) malloc((n ? n : 1) * sizeof(in6_addr_t));
+    if (! aip) {
+	fail("malloc");
+    }
+    a = ipv6_new(o);
+    if (anon_ipv6_map_pref_trie(a, ip, aip, n) != 0
+	|| anon_ipv6_map_pref_trie(a, ip, ip, n) != 0) {
+	fail("anon_ipv6_map_pref_trie");
+    }
+    if (n && memcmp(ip, aip, n * sizeof(in6_addr_t)) != 0) {
+	fail("anon_ipv6_map_pref_trie (in place)");
+    }
+    print_addrs(AF_INET6, aip, sizeof(in6_addr_t), n);
+    anon_ipv6_delete(a);
+    free(aip);
+    free(ip);
+}
+
+/*
+ * IPv4 addresses embedded in IPv4-mapped, NAT64 and 6to4 addresses:
+ * the embedded address must be anonymized like the IPv4 address
+ * itself, which is printed, and the embedding prefix like any other
+ * IPv6 prefix.
+ */
+
+static const struct {
+    const char *prefix;
+    int off;
+} embeds[] = {
+    { "::ffff:0:0", 96 },
+    { "64:ff9b::", 96 },
+    { "2002:0:0:1::1", 16 },
+};
+
+#define EMBEDS (sizeof(embeds) / sizeof(embeds[0]))
+
+static void
+check_ipv6_embed(FILE *in, struct opts *o)
+{
+    anon_ipv6_t *a, *plain;
+    in_addr_t *ip, *aip, v4;
+    in6_addr_t *ip6, *aip6, r;
+    size_t e, i, n;
+    int off;
+
+    n = read_addrs(in, AF_INET, sizeof(in_addr_t), (void **) &ip);
+    aip = (in_addr_t *) malloc((n ? n : 1) * sizeof(in_addr_t));
+    ip6 = (in6_addr_t *) malloc((n ? n : 1) * sizeof(in6_addr_t));
+    aip6 = (in6_addr_t *) malloc((n ? n : 1) * sizeof(in6_addr_t));
+    if (! aip || ! ip6 || ! aip6) {
+	fail("malloc");
+    }
+    if (! o->ipv4) {
+	o->ipv4 = ipv4_new(o);
+    }
+    a = ipv6_new(o);
+    plain = anon_ipv6_new();
+    if (! plain) {
+	fail("anon_ipv6_new");
+    }
+    anon_ipv6_set_key(plain, o->key);
+
+    for (e = 0; e < EMBEDS; e++) {
+	off = embeds[e].off;
+	for (i = 0; i < n; i++) {
+	    (void) inet_pton(AF_INET6, embeds[e].prefix, &ip6[i]);
+	    memcpy(ip6[i].s6_addr + off/8, &ip[i], 4);
+	}
+	if (anon_ipv6_map_pref_trie(a, ip6, aip6, n) != 0) {
+	    fail("anon_ipv6_map_pref_trie");
+	}
+	for (i = 0; i < n; i++) {
+	    if (anon_ipv6_map_pref(a, ip6[i], &r) != 0) {
+		fail("anon_ipv6_map_pref");
+	    }
+	    if (memcmp(&r, &aip6[i], sizeof(r)) != 0) {
+		fail("anon_ipv6_map_pref_trie (embedded)");
+	    }
+	    memcpy(&v4, r.s6_addr + off/8, 4);
+	    if (e == 0) {
+		aip[i] = v4;
+	    } else if (v4 != aip[i]) {
+		fail("anon_ipv6_map_pref (embedded formats)");
+	    }
+
+	    /* an embedded prefix is anonymized like the IPv4 prefix */
+	    if (anon_ipv6_map_prefix(a, ip6[i], off + 24, &r) != 0) {
+		fail("anon_ipv6_map_prefix");
+	    }
+	    if (! prefix_equal(r.s6_addr + off/8, (uint8_t *) &v4, 24)) {
+		fail("anon_ipv6_map_prefix (embedded)");
+	    }
+
+	    /* the embedding prefix like any other IPv6 prefix */
+	    if (anon_ipv6_map_pref(plain, ip6[i], &r) != 0) {
+		fail("anon_ipv6_map_pref");
+	    }
+	    if (! prefix_equal(r.s6_addr, aip6[i].s6_addr, off)) {
+		fail("anon_ipv6_map_pref (embedding prefix)");
+	    }
+	}
+    }
+    print_addrs(AF_INET, aip, sizeof(in_addr_t), n);
+    anon_ipv6_delete(plain);
+    anon_ipv6_delete(a);
+    free(aip6);
+    free(ip6);
+    free(aip);
+    free(ip);
+}
+
+/*
+ * Lexicographical-order-preserving anonymization: all addresses are
+ * marked as used before any of them is mapped, either by walking the
+ * used tree or from the materialized mapping. A frozen object (-F)
+ * is mapped by THREADS threads at once and must refuse an address
+ * next to the first one that has not been marked.
+ *
+ * With -P, the first half of the addresses is marked and published
+ * before THREADS threads start mapping it over and over again, while
+ * the rest is marked and published in PUBLISH steps. An address that
+ * has not been published yet must be refused.
+ */
+
+#define PUBLISH 8
+#define ROUNDS 20
+
+static void
+ipv4_publish(anon_ipv4_t *a, const in_addr_t *ip, in_addr_t *aip,
+	     const size_t n, struct opts *o)
+{
+    struct worker w[THREADS];
+    in_addr_t r;
+    size_t h = n / 2, i, j, k;
+    int t;
+
+    ipv4_mark(a, ip, h, o);
+    if (anon_ipv4_publish(a) != 0) {
+	fail("anon_ipv4_publish");
+    }
+    for (i = h; i < n; i++) {
+	for (k = 0; k < h && ip[k] != ip[i]; k++) ;
+	if (k == h) {
+	    if (anon_ipv4_map_pref_lex(a, ip[i], &r) == 0) {
+		fail("anon_ipv4_map_pref_lex (not published)");
+	    }
+	    break;
+	}
+    }
+
+    memset(w, 0, sizeof(w));
+    for (t = 0; t < THREADS; t++) {
+	w[t].ip = ip;
+	w[t].aip = aip;
+	w[t].first = t;
+	w[t].n = h;
+	w[t].rounds = ROUNDS;
+	w[t].a4 = a;
+    }
+    start_workers(w, ipv4_mapper);
+    for (i = h; i < n; i = j) {
+	j = i + (n - h + PUBLISH - 1) / PUBLISH;
+	ipv4_mark(a, ip + i, (j < n ? j : n) - i, o);
+	if (anon_ipv4_publish(a) != 0) {
+	    fail("anon_ipv4_publish");
+	}
+    }
+    join_workers(w, "anon_ipv4_map_pref_lex");
+}
+
+static void
+ipv6_publish(anon_ipv6_t *a, const in6_addr_t *ip, in6_addr_t *aip,
+	     const size_t n, struct opts *o)
+{
+    struct worker w[THREADS];
+    in6_addr_t r;
+    size_t h = n / 2, i, j, k;
+    int t;
+
+    ipv6_mark(a, ip, h, o);
+    if (anon_ipv6_publish(a) != 0) {
+	fail("anon_ipv6_publish");
+    }
+    for (i = h; i < n; i++) {
+	for (k = 0; k < h && memcmp(&ip[k], &ip[i], sizeof(r)) != 0; k++) ;
+	if (k == h) {
+	    if (anon_ipv6_map_pref_lex(a, ip[i], &r) == 0) {
+		fail("anon_ipv6_map_pref_lex (not published)");
+	    }
+	    break;
+	}
+    }
+
+    memset(w, 0, sizeof(w));
+    for (t = 0; t < THREADS; t++) {
+	w[t].ip = ip;
+	w[t].aip = aip;
+	w[t].first = t;
+	w[t].n = h;
+	w[t].rounds = ROUNDS;
+	w[t].a6 = a;
+    }
+    start_workers(w, ipv6_mapper);
+    for (i = h; i < n; i = j) {
+	j = i + (n - h + PUBLISH - 1) / PUBLISH;
+	ipv6_mark(a, ip + i, (j < n ? j : n) - i, o);
+	if (anon_ipv6_publish(a) != 0) {
+	    fail("anon_ipv6_publish");
+	}
+    }
+    join_workers(w, "anon_ipv6_map_pref_lex");
+}
+
+static void
+ipv4_map_frozen(anon_ipv4_t *a, const in_addr_t *ip, in_addr_t *aip,
+		const size_t n)
+{
+    struct worker w[THREADS];
+    in_addr_t x, r;
+    size_t i;
+    int t;
+
+    if (anon_ipv4_freeze(a) != 0) {
+	fail("anon_ipv4_freeze");
+    }
+    memset(w, 0, sizeof(w));
+    for (t = 0; t < THREADS; t++) {
+	w[t].ip = ip;
+	w[t].aip = aip;
+	w[t].first = t;
+	w[t].n = n;
+	w[t].rounds = 1;
+	w[t].a4 = a;
+    }
+    run_workers(w, ipv4_mapper, "anon_ipv4_map_pref_lex");
+
+    for (t = 0; n && t < 32; t++) {
+	x = ip[0] ^ htonl(1U << t);
+	for (i = 0; i < n && ip[i] != x; i++) ;
+	if (i == n) {
+	    if (anon_ipv4_map_pref_lex(a, x, &r) == 0) {
+		fail("anon_ipv4_map_pref_lex (not used)");
+	    }
+	    if (anon_ipv4_set_used(a, x, 32) == 0) {
+		fail("anon_ipv4_set_used (frozen)");
+	    }
+	    break;
+	}
+    }
+}
+
+static void
+ipv6_map_frozen(anon_ipv6_t *a, const in6_addr_t *ip, in6_addr_t *aip,
+		const size_t n)
+{
+    struct worker w[THREADS];
+    in6_addr_t x, r;
+    size_t i;
+    int t;
+
+    if (anon_ipv6_freeze(a) != 0) {
+	fail("anon_ipv6_freeze");
+    }
+    memset(w, 0, sizeof(w));
+    for (t = 0; t < THREADS; t++) {
+	w[t].ip = ip;
+	w[t].aip = aip;
+	w[t].first = t;
+	w[t].n = n;
+	w[t].rounds = 1;
+	w[t].a6 = a;
+    }
+    run_workers(w, ipv6_mapper, "anon_ipv6_map_pref_lex");
+
+    for (t = 0; n && t < 128; t++) {
+	x = ip[0];
+	x.s6_addr[15 - t/8] ^= 1 << (t % 8);
+	for (i = 0; i < n && memcmp(&ip[i], &x, sizeof(x)) != 0; i++) ;
+	if (i == n) {
+	    if (anon_ipv6_map_pref_lex(a, x, &r) == 0) {
+		fail("anon_ipv6_map_pref_lex (not used)");
+	    }
+	    if (anon_ipv6_set_used(a, x, 128) == 0) {
+		fail("anon_ipv6_set_used (frozen)");
+	    }
+	    break;
+	}
+    }
+}
+
+static void
+check_ipv4_lex(FILE *in, struct opts *o)
+{
+    anon_ipv4_t *a;
+    in_addr_t *ip, *aip;
+    size_t i, n;
+
+    n = read_addrs(in, AF_INET, sizeof(in_addr_t), (void **) &ip);
+    aip = (in_addr_t *) malloc((n ? n : 1) * sizeof(in_addr_t));
+    if (! aip) {
+	fail("malloc");
+    }
+    a = anon_ipv4_new_used(used(o, AF_INET));
+    if (! a) {
+	fail("anon_ipv4_new_used");
+    }
+    anon_ipv4_set_key(a, o->key);
+    if (o->publish) {
+	ipv4_publish(a, ip, aip, n, o);
+    } else {
+	ipv4_mark(a, ip, n, o);
+    }
+    if (o->materialize && anon_ipv4_materialize_lex(a) != 0) {
+	fail("anon_ipv4_materialize_lex");
+    }
+    if (o->freeze) {
+	ipv4_map_frozen(a, ip, aip, n);
+    }
+    for (i = 0; ! o->freeze && i < n; i++) {
+	if (anon_ipv4_map_pref_lex(a, ip[i], &aip[i]) != 0) {
+	    fail("anon_ipv4_map_pref_lex");
+	}
+    }
+    print_addrs(AF_INET, aip, sizeof(in_addr_t), n);
+    anon_ipv4_delete(a);
+    free(aip);
+    free(ip);
+}
+
+static void
+check_ipv6_lex(FILE *in, struct opts *o)
+{
+    anon_ipv6_t *a;
+    in6_addr_t *ip, *aip;
+    size_t i, n;
+
+    n = read_addrs(in, AF_INET6, sizeof(in6_addr_t), (void **) &ip);
+    aip = (in6_addr_t *) malloc((n ? n : 1) * sizeof(in6_addr_t));
+    if (! aip) {
+	fail("malloc");
+    }
+    a = anon_ipv6_new_used(used(o, AF_INET6));
+    if (! a) {
+	fail("anon_ipv6_new_used");
+    }
+    anon_ipv6_set_key(a, o->key);
+    if (o->publish) {
+	ipv6_publish(a, ip, aip, n, o);
+    } else {
+	ipv6_mark(a, ip, n, o);
+    }
+    if (o->materialize && anon_ipv6_materialize_lex(a) != 0) {
+	fail("anon_ipv6_materialize_lex");
+    }
+    if (o->freeze) {
+	ipv6_map_frozen(a, ip, aip, n);
+    }
+    for (i = 0; ! o->freeze && i < n; i++) {
+	if (anon_ipv6_map_pref_lex(a, ip[i], &aip[i]) != 0) {
+	    fail("anon_ipv6_map_pref_lex");
+	}
+    }
+    print_addrs(AF_INET6, aip, sizeof(in6_addr_t), n);
+    anon_ipv6_delete(a);
+    free(aip);
+    free(ip);
+}
+
+/*
+ * Freezing the MAC address, integer and octet string objects: their
+ * lex mappings are random rather than keyed, so the mappings of the
+ * numbers, MAC addresses and strings derived from the IPv4 addresses
+ * after the freeze are compared with the ones before it. Nothing is
+ * printed.
+ */
+
+static void
+derive(const in_addr_t ip, uint64_t *u, int64_t *i, uint8_t *mac, char *str)
+{
+    *u = ntohl(ip);
+    *i = (int64_t) *u - 0x100000000LL;
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    memcpy(mac + 2, &ip, 4);
+    (void) inet_ntop(AF_INET, &ip, str, INET_ADDRSTRLEN);
+}
+
+static void
+check_freeze(FILE *in, struct opts *o)
+{
+    anon_mac_t *am;
+    anon_int64_t *ai;
+    anon_uint64_t *au;
+    anon_octs_t *ao;
+    in_addr_t *ip, x;
+    uint64_t u, *lu, ru;
+    int64_t v, *li, ri;
+    uint8_t mac[6], (*lm)[6], rm[6];
+    char str[INET_ADDRSTRLEN], (*lo)[INET_ADDRSTRLEN], ro[INET_ADDRSTRLEN];
+    size_t i, n;
+    int pass, t;
+
+    n = read_addrs(in, AF_INET, sizeof(in_addr_t), (void **) &ip);
+    lu = (uint64_t *) malloc((n ? n : 1) * sizeof(*lu));
+    li = (int64_t *) malloc((n ? n : 1) * sizeof(*li));
+    lm = (uint8_t (*)[6]) malloc((n ? n : 1) * sizeof(*lm));
+    lo = (char (*)[INET_ADDRSTRLEN]) malloc((n ? n : 1) * sizeof(*lo));
+    if (! lu || ! li || ! lm || ! lo) {
+	fail("malloc");
+    }
+    am = anon_mac_new();
+    ai = anon_int64_new(-0x100000000LL, -1);
+    au = anon_uint64_new(0, 0xffffffffULL);
+    ao = anon_octs_new();
+    if (! am || ! ai || ! au || ! ao) {
+	fail("new");
+    }
+    anon_mac_set_key(am, o->key);
+    anon_int64_set_key(ai, o->key);
+    anon_uint64_set_key(au, o->key);
+    anon_octs_set_key(ao, o->key);
+
+    for (i = 0; i < n; i++) {
+	derive(ip[i], &u, &v, mac, str);
+	if (anon_mac_set_used(am, mac) != 0
+	    || anon_int64_set_used(ai, v) != 0
+	    || anon_uint64_set_used(au, u) != 0
+	    || anon_octs_set_used(ao, str) != 0) {
+	    fail("set_used");
+	}
+    }
+    for (pass = 0; pass < 2; pass++) {
+	if (pass == 1
+	    && (anon_mac_freeze(am) != 0 || anon_int64_freeze(ai) != 0
+		|| anon_uint64_freeze(au) != 0 || anon_octs_freeze(ao) != 0)) {
+	    fail("freeze");
+	}
+	for (i = 0; i < n; i++) {
+	    derive(ip[i], &u, &v, mac, str);
+	    if (anon_mac_map_lex(am, mac, rm) != 0
+		|| anon_int64_map_lex(ai, v, &ri) != 0
+		|| anon_uint64_map_lex(au, u, &ru) != 0
+		|| anon_octs_map_lex(ao, str, ro) != 0) {
+		fail("map_lex");
+	    }
+	    if (pass == 0) {
+		memcpy(lm[i], rm, sizeof(rm));
+		li[i] = ri;
+		lu[i] = ru;
+		strcpy(lo[i], ro);
+	    } else if (memcmp(lm[i], rm, sizeof(rm)) != 0 || li[i] != ri
+		       || lu[i] != ru || strcmp(lo[i], ro) != 0) {
+		fail("map_lex (frozen)");
+	    }
+	}
+    }
+
+    /* frozen objects neither map nor mark anything else */
+    for (t = 0; n && t < 32; t++) {
+	x = ip[0] ^ htonl(1U << t);
+	for (i = 0; i < n && ip[i] != x; i++) ;
+	if (i < n) {
+	    continue;
+	}
+	derive(x, &u, &v, mac, str);
+	if (anon_mac_map_lex(am, mac, rm) == 0
+	    || anon_int64_map_lex(ai, v, &ri) == 0
+	    || anon_uint64_map_lex(au, u, &ru) == 0
+	    || anon_octs_map_lex(ao, str, ro) == 0) {
+	    fail("map_lex (not used)");
+	}
+	if (anon_mac_set_used(am, mac) == 0
+	    || anon_int64_set_used(ai, v) == 0
+	    || anon_uint64_set_used(au, u) == 0
+	    || anon_octs_set_used(ao, str) == 0) {
+	    fail("set_used (frozen)");
+	}
+	break;
+    }
+
+    anon_octs_delete(ao);
+    anon_uint64_delete(au);
+    anon_int64_delete(ai);
+    anon_mac_delete(am);
+    free(lo);
+    free(lm);
+    free(li);
+    free(lu);
+    free(ip);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct opts o;
+    FILE *in;
+    char *s;
+    int c, i, ipv4 = 0;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s\n", usage);
+	return EXIT_FAILURE;
+    }
+    for (i = 0; checks[i].name; i++) {
+	if (strcmp(checks[i].name, argv[1]) == 0) {
+	    break;
+	}
+    }
+    if (! checks[i].name) {
+	fprintf(stderr, "%s: unknown check '%s'\n", progname, argv[1]);
+	return EXIT_FAILURE;
+    }
+
+    memset(&o, 0, sizeof(o));
+    o.key = anon_key_new();
+    anon_key_set_random(o.key);
+
+    optind = 2;
+    while ((c = getopt(argc, argv, "s4mFPp:d:c:r:i:u:M:")) != -1) {
+	switch (c) {
+	case 'p':
+	    anon_key_set_passphase(o.key, optarg);
+	    break;
+	case 'd':
+	    o.depth = atoi(optarg);
+	    break;
+	case 'c':
+	    o.cache = strtoul(optarg, NULL, 10);
+	    break;
+	case 's':
+	    o.stats = 1;
+	    break;
+	case '4':
+	    ipv4 = 1;
+	    break;
+	case 'm':
+	    o.materialize = 1;
+	    break;
+	case 'u':
+	    o.used = optarg;
+	    break;
+	case 'M':
+	    o.mark = optarg;
+	    break;
+	case 'F':
+	    o.freeze = 1;
+	    break;
+	case 'P':
+	    o.publish = 1;
+	    break;
+	case 'r':
+	    s = strchr(optarg, '/');
+	    if (! s || o.ncidr == MAXCIDR) {
+		fprintf(stderr, "usage: %s\n", usage);
+		return EXIT_FAILURE;
+	    }
+	    *s++ = 0;
+	    if (inet_pton(AF_INET, optarg, &o.net[o.ncidr]) <= 0) {
+		fprintf(stderr, "usage: %s\n", usage);
+		return EXIT_FAILURE;
+	    }
+	    o.prefixlen[o.ncidr++] = atoi(s);
+	    break;
+	case 'i':
+	    if (strcmp(optarg, "keep") == 0) {
+		o.iid = ANON_IPV6_IID_KEEP;
+	    } else if (strcmp(optarg, "zero") == 0) {
+		o.iid = ANON_IPV6_IID_ZERO;
+	    } else if (strcmp(optarg, "hash") == 0) {
+		o.iid = ANON_IPV6_IID_HASH;
+	    } else {
+		o.iid = ANON_IPV6_IID_PREF;
+	    }
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s\n", usage);
+	    return EXIT_FAILURE;
+	}
+    }
+    if (argc - optind != 1) {
+	fprintf(stderr, "usage: %s\n", usage);
+	return EXIT_FAILURE;
+    }
+
+    in = fopen(argv[optind], "r");
+    if (! in) {
+	fprintf(stderr, "%s: %s: %s\n", progname, argv[optind],
+		strerror(errno));
+	return EXIT_FAILURE;
+    }
+    if (ipv4) {
+	o.ipv4 = ipv4_new(&o);
+    }
+    (checks[i].func) (in, &o);
+    fclose(in);
+    anon_ipv4_delete(o.ipv4);
+    anon_key_delete(o.key);
+    return EXIT_SUCCESS;
+}